@@ -19,10 +19,14 @@ if [[ ! -d "src" || ! -d "tests" || ! -d "listings" ]]; then
     exit 1
 fi
 
-# Compile the test runner
+# Compile the test runner, linked against the simulator core. Blocks are
+# translated on their first run so the short listings exercise the JIT, and
+# disassembly chunks are small enough to split every listing.
+CORE="../src/simulator.c ../src/threaded.c ../src/jit.c ../src/profile.c ../src/trace.c ../src/output.c ../src/snapshot.c ../src/disasm.c"
 echo "Compiling test runner..."
 cd tests
-if gcc test_simulator.c -o test_simulator; then
+if gcc -O2 -I../src -DJIT_HOT_THRESHOLD=1 -DDISASM_CHUNK_SIZE=16 test_simulator.c $CORE ../src/batch.c -lpthread -o test_simulator &&
+   gcc -I../src test_library.c ../src/sim8086.c $CORE -lpthread -o test_library; then
     echo "✓ Test runner compiled successfully"
 else
     echo "✗ Failed to compile test runner"
@@ -33,10 +37,12 @@ fi
 echo ""
 echo "Running tests..."
 echo "================"
-./test_simulator
+status=0
+./test_simulator "$@" || status=$?
 
 # Clean up
-rm -f test_simulator
+rm -f test_simulator test_library
 
 echo ""
 echo "Test run complete!"
+exit $status
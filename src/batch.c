@@ -0,0 +1,328 @@
+#include "simulator.h"
+#include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// BATCH RUNNER
+//
+// --batch takes a list of programs, with directories standing for the files
+// in them, and runs them on a pool of worker threads. Workers claim the next
+// program from a shared counter, so they stay busy until the list runs out.
+// Each worker sets up one simulator_t and unloads it between programs, which
+// keeps its memory mapped and its output buffer allocated for the whole batch.
+//
+// With an output directory every program gets its own <name>.txt, and a
+// batch with two programs of the same name fails before running. Otherwise
+// the outputs go to stdout in input order, each under a "=== [index] path ==="
+// header; a finished output waits until everything before it is written.
+// Instruction and cycle limits apply to each program separately, so a
+// program that never ends fails on its own instead of holding up a worker.
+
+typedef struct BatchJob {
+	char *path;
+	bool failed;
+} batch_job_t;
+
+typedef struct Batch {
+	const batch_options_t *options;
+	batch_job_t *jobs;
+	size_t job_count;
+	ordered_output_t order; // One item per job; writes to stdout
+	bool write_failed;      // Some output was lost on its way to stdout
+} batch_t;
+
+static bool add_job(batch_t *batch, size_t *capacity, const char *path)
+{
+	if (batch->job_count == *capacity)
+	{
+		size_t new_capacity = *capacity ? *capacity * 2 : 64;
+		batch_job_t *jobs = realloc(batch->jobs, new_capacity * sizeof(batch_job_t));
+		if (!jobs)
+		{
+			fprintf(stderr, "Error: Could not allocate batch of %zu programs\n", new_capacity);
+			return false;
+		}
+		batch->jobs = jobs;
+		*capacity = new_capacity;
+	}
+	char *copy = strdup(path);
+	if (!copy)
+	{
+		fprintf(stderr, "Error: Could not allocate batch of %zu programs\n", batch->job_count + 1);
+		return false;
+	}
+	batch->jobs[batch->job_count++] = (batch_job_t){.path = copy};
+	return true;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Adds the regular files in a directory, in name order so a batch over a
+// directory always lists its outputs the same way
+static bool add_directory(batch_t *batch, size_t *capacity, const char *dir_path)
+{
+	DIR *dir = opendir(dir_path);
+	if (!dir)
+	{
+		fprintf(stderr, "Error: Could not open directory '%s'\n", dir_path);
+		return false;
+	}
+
+	bool ok = true;
+	size_t first = batch->job_count;
+	char path[PATH_MAX];
+	struct stat st;
+	for (struct dirent *entry; ok && (entry = readdir(dir));)
+	{
+		if (entry->d_name[0] == '.')
+		{
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+		{
+			ok = add_job(batch, capacity, path);
+		}
+	}
+	closedir(dir);
+
+	// Paths are the first member, so the jobs sort as strings
+	qsort(batch->jobs + first, batch->job_count - first, sizeof(batch_job_t), compare_names);
+	return ok;
+}
+
+static const char *file_name(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	return slash ? slash + 1 : path;
+}
+
+static int compare_file_names(const void *a, const void *b)
+{
+	return strcmp(file_name((*(const batch_job_t *const *)a)->path),
+		      file_name((*(const batch_job_t *const *)b)->path));
+}
+
+// Programs in different directories can share a name, and would write the
+// same output file
+static bool check_output_names(const batch_t *batch)
+{
+	const batch_job_t **jobs = malloc(batch->job_count * sizeof(batch_job_t *));
+	if (!jobs)
+	{
+		fprintf(stderr, "Error: Could not allocate batch of %zu programs\n", batch->job_count);
+		return false;
+	}
+	for (size_t i = 0; i < batch->job_count; i++)
+	{
+		jobs[i] = &batch->jobs[i];
+	}
+	qsort(jobs, batch->job_count, sizeof(batch_job_t *), compare_file_names);
+	bool ok = true;
+	for (size_t i = 1; i < batch->job_count; i++)
+	{
+		if (compare_file_names(&jobs[i - 1], &jobs[i]) == 0)
+		{
+			fprintf(stderr, "Error: '%s' and '%s' would both write '%s.txt' in the output directory\n",
+				jobs[i - 1]->path, jobs[i]->path, file_name(jobs[i]->path));
+			ok = false;
+		}
+	}
+	free(jobs);
+	return ok;
+}
+
+// Loads and runs one program, leaving its text in the worker's sink, or in
+// its own file when there is an output directory
+static bool run_job(const batch_options_t *options, simulator_t *simulator, batch_job_t *job)
+{
+	FILE *file = NULL;
+	if (options->output_dir)
+	{
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s.txt", options->output_dir, file_name(job->path));
+		file = fopen(path, "w");
+		if (!file)
+		{
+			fprintf(stderr, "Error: Could not create '%s'\n", path);
+			return false;
+		}
+		simulator->output.file = file;
+	}
+	// The sink carries over from the previous job
+	simulator->output.failed = false;
+
+	bool ok = load_program(simulator, job->path, options->load_address);
+	if (ok && options->profile)
+	{
+		simulator->profile = profile_create(simulator->program_size);
+		ok = simulator->profile != NULL;
+	}
+	if (ok)
+	{
+		run_engine(simulator, options->engine);
+		ok = simulator->status == SIMULATION_OK;
+		const char *stopped = stop_reason(simulator->status);
+		if (stopped)
+		{
+			fprintf(stderr, "'%s' stopped at 0x%04X: %s\n", job->path, simulator->cpu.instr_ptr, stopped);
+		}
+	}
+	profile_free(simulator->profile);
+	simulator->profile = NULL;
+
+	bool written = output_flush(&simulator->output);
+	if (file)
+	{
+		written = fclose(file) == 0 && written;
+		simulator->output.file = NULL;
+	}
+	if (!written)
+	{
+		fprintf(stderr, "Error: Could not write all of the output of '%s'\n", job->path);
+	}
+	return ok && written;
+}
+
+// Outputs go to stdout in input order, each under its header
+static void write_job_output(void *context, size_t index, const char *text, size_t length)
+{
+	batch_t *batch = context;
+	if (printf("=== [%zu] %s ===\n", index, batch->jobs[index].path) < 0 ||
+	    fwrite(text, 1, length, stdout) != length)
+	{
+		batch->write_failed = true;
+	}
+}
+
+static void *batch_worker(void *arg)
+{
+	batch_t *batch = arg;
+	const batch_options_t *options = batch->options;
+	decoder_t decoder = {};
+	simulator_t simulator = {
+		.decoder = &decoder,
+		.verbosity = options->verbosity,
+		.count_cycles = options->count_cycles || options->max_cycles,
+		.control = {
+			.max_instructions = options->max_instructions,
+			.max_cycles = options->max_cycles,
+		},
+	};
+	if (!memory_init(&simulator.memory))
+	{
+		return NULL;
+	}
+	bool ok = options->output_dir
+			  ? output_init(&simulator.output, OUTPUT_FILE, NULL, OUTPUT_BUFFER_SIZE)
+			  : output_init(&simulator.output, OUTPUT_MEMORY, NULL, BATCH_OUTPUT_SIZE);
+	if (!ok)
+	{
+		memory_free(&simulator.memory);
+		return NULL;
+	}
+
+	for (size_t i; ordered_claim(&batch->order, &i);)
+	{
+		batch_job_t *job = &batch->jobs[i];
+		job->failed = !run_job(options, &simulator, job);
+		unload_program(&simulator);
+
+		// With an output directory the text is already in the job's own file
+		if (!ordered_finish(&batch->order, i, options->output_dir ? NULL : &simulator.output))
+		{
+			fprintf(stderr, "Error: Could not keep the output of '%s'\n", job->path);
+			job->failed = true;
+		}
+	}
+
+	output_free(&simulator.output);
+	memory_free(&simulator.memory);
+	return NULL;
+}
+
+// Returns 0 when every program loaded and ran to its end, 1 otherwise
+int run_batch(const batch_options_t *options, char *const inputs[], int input_count)
+{
+	batch_t batch = {.options = options};
+	size_t capacity = 0;
+	bool ok = true;
+	struct stat st;
+	for (int i = 0; ok && i < input_count; i++)
+	{
+		if (stat(inputs[i], &st) == 0 && S_ISDIR(st.st_mode))
+		{
+			ok = add_directory(&batch, &capacity, inputs[i]);
+		}
+		else
+		{
+			ok = add_job(&batch, &capacity, inputs[i]);
+		}
+	}
+
+	if (ok && options->output_dir && batch.job_count > 1)
+	{
+		ok = check_output_names(&batch);
+	}
+
+	size_t failed = 0;
+	if (ok && batch.job_count > 0)
+	{
+		long workers = options->workers > 0 ? options->workers : sysconf(_SC_NPROCESSORS_ONLN);
+		if (workers < 1)
+		{
+			workers = 1;
+		}
+		if ((size_t)workers > batch.job_count)
+		{
+			workers = (long)batch.job_count;
+		}
+
+		ok = ordered_init(&batch.order, batch.job_count, write_job_output, &batch);
+		if (ok)
+		{
+			ordered_run(&batch.order, workers, batch_worker, &batch);
+
+			// Workers that could not set up leave their share undone
+			for (size_t i = 0; i < batch.job_count; i++)
+			{
+				if (!batch.order.items[i].done)
+				{
+					batch.jobs[i].failed = true;
+				}
+				failed += batch.jobs[i].failed;
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Error: Could not allocate batch of %zu programs\n", batch.job_count);
+		}
+		// Anything held back behind an undone job still gets written
+		ordered_free(&batch.order);
+		if (fflush(stdout) != 0 || batch.write_failed)
+		{
+			fprintf(stderr, "Error: Could not write all of the output\n");
+			ok = false;
+		}
+	}
+
+	for (size_t i = 0; i < batch.job_count; i++)
+	{
+		free(batch.jobs[i].path);
+	}
+	free(batch.jobs);
+
+	if (failed)
+	{
+		fprintf(stderr, "%zu of %zu programs failed\n", failed, batch.job_count);
+	}
+	return ok && failed == 0 ? 0 : 1;
+}
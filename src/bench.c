@@ -0,0 +1,501 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "simulator.h"
+
+// BENCHMARKS
+//
+// Runs synthetic workloads on each engine and reports simulated MIPS, ns per
+// instruction and how the time splits between decoding and executing. The
+// workloads are built here as machine code, so the benchmark needs no
+// assembler:
+//
+//   memory_loop  listing 52's store and sum loops over 1000 words, repeated
+//   alu_loop     register add/sub/mov on word and byte registers
+//   branchy      data-dependent conditional jumps around short bodies
+//   copy_loop    word-by-word copies between two 32 KB buffers
+//   call_loop    near calls two deep with a push and pop in between
+//
+// Every run executes silently into a discarding sink and the best of
+// --repeat runs counts. Decode time is what it takes to decode each of the
+// workload's instructions once, which is all the decode cache ever does;
+// execute time is the rest of the run.
+//
+// Results can be written as a tab-separated file, and a file of that form
+// serves as the baseline: any workload and engine whose MIPS falls more than
+// --threshold below the baseline fails the run.
+
+#define WORKLOAD_MAX_SIZE 256
+#define BENCH_MAX_SCALE 16
+
+enum {
+	REG_AX_CODE = 0,
+	REG_CX_CODE,
+	REG_DX_CODE,
+	REG_BX_CODE,
+	REG_SP_CODE,
+	REG_BP_CODE,
+	REG_SI_CODE,
+	REG_DI_CODE,
+};
+
+typedef struct WorkloadImage {
+	uint8_t bytes[WORKLOAD_MAX_SIZE];
+	uint16_t size;
+} workload_image_t;
+
+typedef struct Workload {
+	const char *name;
+	void (*build)(workload_image_t *image, uint16_t scale);
+} workload_t;
+
+typedef struct BenchResult {
+	const char *workload;
+	const char *engine;
+	uint64_t instructions;
+	double run_ns; // Best of the repeats
+	double decode_ns;
+} bench_result_t;
+
+static void emit_bytes(workload_image_t *image, const uint8_t *bytes, size_t count) {
+	memcpy(image->bytes + image->size, bytes, count);
+	image->size += count;
+}
+
+#define EMIT(image, ...) \
+	emit_bytes(image, (const uint8_t[]){__VA_ARGS__}, sizeof((const uint8_t[]){__VA_ARGS__}))
+
+// mov reg16, imm16
+static void emit_mov_imm(workload_image_t *image, int reg, uint16_t value) {
+	EMIT(image, 0xB8 + reg, value & 0xFF, value >> 8);
+}
+
+// Jcc / loop back or forward to `target`, which must be within a rel8
+static void emit_branch(workload_image_t *image, uint8_t opcode, uint16_t target) {
+	EMIT(image, opcode, (uint8_t)(target - (image->size + 2)));
+}
+
+// Forward branch whose target is filled in by patch_branch
+static uint16_t emit_forward_branch(workload_image_t *image, uint8_t opcode) {
+	EMIT(image, opcode, 0);
+	return image->size;
+}
+
+static void patch_branch(workload_image_t *image, uint16_t after_branch) {
+	image->bytes[after_branch - 1] = (uint8_t)(image->size - after_branch);
+}
+
+// call rel16
+static void emit_call(workload_image_t *image, uint16_t target) {
+	uint16_t relative = target - (image->size + 3);
+	EMIT(image, 0xE8, relative & 0xFF, relative >> 8);
+}
+
+// About 9 million instructions per scale step
+static void build_memory_loop(workload_image_t *image, uint16_t scale) {
+	emit_mov_imm(image, REG_DI_CODE, 1000 * scale);
+	uint16_t pass = image->size;
+	emit_mov_imm(image, REG_DX_CODE, 2000);
+	emit_mov_imm(image, REG_BP_CODE, 1000);
+	emit_mov_imm(image, REG_SI_CODE, 0);
+	uint16_t store = image->size;
+	EMIT(image, 0x89, 0x32);       // mov [bp+si], si
+	EMIT(image, 0x83, 0xC6, 0x02); // add si, 2
+	EMIT(image, 0x39, 0xD6);       // cmp si, dx
+	emit_branch(image, 0x75, store);
+	emit_mov_imm(image, REG_BX_CODE, 0);
+	emit_mov_imm(image, REG_SI_CODE, 0);
+	uint16_t sum = image->size;
+	EMIT(image, 0x8B, 0x0A);       // mov cx, [bp+si]
+	EMIT(image, 0x01, 0xCB);       // add bx, cx
+	EMIT(image, 0x83, 0xC6, 0x02); // add si, 2
+	EMIT(image, 0x39, 0xD6);       // cmp si, dx
+	emit_branch(image, 0x75, sum);
+	EMIT(image, 0x83, 0xEF, 0x01); // sub di, 1
+	emit_branch(image, 0x75, pass);
+}
+
+// About 17 million instructions per scale step
+static void build_alu_loop(workload_image_t *image, uint16_t scale) {
+	emit_mov_imm(image, REG_DI_CODE, 40 * scale);
+	uint16_t pass = image->size;
+	emit_mov_imm(image, REG_CX_CODE, 60000);
+	uint16_t body = image->size;
+	EMIT(image, 0x01, 0xD8);       // add ax, bx
+	EMIT(image, 0x80, 0xC3, 0x03); // add bl, 3
+	EMIT(image, 0x29, 0xC6);       // sub si, ax
+	EMIT(image, 0x89, 0xF2);       // mov dx, si
+	EMIT(image, 0x00, 0xCF);       // add bh, cl
+	EMIT(image, 0x83, 0xE9, 0x01); // sub cx, 1
+	emit_branch(image, 0x75, body);
+	EMIT(image, 0x83, 0xEF, 0x01); // sub di, 1
+	emit_branch(image, 0x75, pass);
+}
+
+// About 14 million instructions per scale step
+static void build_branchy(workload_image_t *image, uint16_t scale) {
+	emit_mov_imm(image, REG_DI_CODE, 30 * scale);
+	uint16_t pass = image->size;
+	emit_mov_imm(image, REG_CX_CODE, 50000);
+	uint16_t body = image->size;
+	EMIT(image, 0x05, 0x37, 0x9E); // add ax, 0x9E37
+	EMIT(image, 0x3C, 0x80);       // cmp al, 0x80
+	uint16_t below = emit_forward_branch(image, 0x72);
+	EMIT(image, 0x83, 0xC3, 0x01); // add bx, 1
+	patch_branch(image, below);
+	EMIT(image, 0x80, 0xFC, 0x40); // cmp ah, 0x40
+	uint16_t not_below = emit_forward_branch(image, 0x73);
+	EMIT(image, 0x83, 0xEA, 0x03); // sub dx, 3
+	patch_branch(image, not_below);
+	EMIT(image, 0x01, 0xC6);       // add si, ax
+	uint16_t sign = emit_forward_branch(image, 0x78);
+	EMIT(image, 0x83, 0xC5, 0x01); // add bp, 1
+	patch_branch(image, sign);
+	emit_branch(image, 0xE2, body); // loop
+	EMIT(image, 0x83, 0xEF, 0x01);  // sub di, 1
+	emit_branch(image, 0x75, pass);
+}
+
+// About 16 million instructions per scale step
+static void build_copy_loop(workload_image_t *image, uint16_t scale) {
+	emit_mov_imm(image, REG_SI_CODE, 0);
+	emit_mov_imm(image, REG_CX_CODE, 16000);
+	uint16_t fill = image->size;
+	EMIT(image, 0x89, 0x34);       // mov [si], si
+	EMIT(image, 0x83, 0xC6, 0x02); // add si, 2
+	emit_branch(image, 0xE2, fill); // loop
+	emit_mov_imm(image, REG_BP_CODE, 200 * scale);
+	uint16_t pass = image->size;
+	emit_mov_imm(image, REG_SI_CODE, 0);
+	emit_mov_imm(image, REG_DI_CODE, 0x8000);
+	emit_mov_imm(image, REG_CX_CODE, 16000);
+	uint16_t copy = image->size;
+	EMIT(image, 0x8B, 0x04);       // mov ax, [si]
+	EMIT(image, 0x89, 0x05);       // mov [di], ax
+	EMIT(image, 0x83, 0xC6, 0x02); // add si, 2
+	EMIT(image, 0x83, 0xC7, 0x02); // add di, 2
+	emit_branch(image, 0xE2, copy); // loop
+	EMIT(image, 0x83, 0xED, 0x01);  // sub bp, 1
+	emit_branch(image, 0x75, pass);
+}
+
+// About 14 million instructions per scale step
+static void build_call_loop(workload_image_t *image, uint16_t scale) {
+	uint16_t start = emit_forward_branch(image, 0xE3); // jcxz, cx starts at 0
+	uint16_t bump = image->size;
+	EMIT(image, 0x83, 0xC2, 0x01); // add dx, 1
+	EMIT(image, 0xC3);             // ret
+	uint16_t add_pair = image->size;
+	EMIT(image, 0x50);             // push ax
+	EMIT(image, 0x01, 0xC3);       // add bx, ax
+	emit_call(image, bump);
+	EMIT(image, 0x58);             // pop ax
+	EMIT(image, 0xC3);             // ret
+	patch_branch(image, start);
+	emit_mov_imm(image, REG_DI_CODE, 30 * scale);
+	uint16_t pass = image->size;
+	emit_mov_imm(image, REG_CX_CODE, 50000);
+	uint16_t body = image->size;
+	emit_call(image, add_pair);
+	emit_branch(image, 0xE2, body); // loop
+	EMIT(image, 0x83, 0xEF, 0x01);  // sub di, 1
+	emit_branch(image, 0x75, pass);
+}
+
+static const workload_t workloads[] = {
+	{"memory_loop", build_memory_loop},
+	{"alu_loop", build_alu_loop},
+	{"branchy", build_branchy},
+	{"copy_loop", build_copy_loop},
+	{"call_loop", build_call_loop},
+};
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+static const char *const engine_names[] = {
+	[ENGINE_INTERPRETER] = "interpreter",
+	[ENGINE_THREADED] = "threaded",
+	[ENGINE_JIT] = "jit",
+};
+#define ENGINE_COUNT (sizeof(engine_names) / sizeof(engine_names[0]))
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static bool write_image(const workload_image_t *image, const char *path) {
+	FILE *file = fopen(path, "wb");
+	if (!file) {
+		fprintf(stderr, "Error: Could not create '%s'\n", path);
+		return false;
+	}
+	bool ok = fwrite(image->bytes, 1, image->size, file) == image->size;
+	ok = fclose(file) == 0 && ok;
+	if (!ok) {
+		fprintf(stderr, "Error: Could not write '%s'\n", path);
+	}
+	return ok;
+}
+
+// Time to decode every instruction of the loaded program once, averaged
+// over enough passes to be measurable
+static double measure_decode(simulator_t *simulator) {
+	int passes = 0;
+	double start = now_ns();
+	double elapsed;
+	do {
+		if (!init_decode_cache(simulator)) {
+			return 0;
+		}
+		for (simulator->cpu.instr_ptr = 0; simulator->cpu.instr_ptr < simulator->program_size - 1;) {
+			fetch_instruction(simulator);
+		}
+		free_decode_cache(simulator);
+		passes++;
+		elapsed = now_ns() - start;
+	} while (elapsed < 1e6);
+	simulator->cpu.instr_ptr = 0;
+	return elapsed / passes;
+}
+
+// Loads the workload afresh for each run, so every run starts from zeroed
+// memory and registers
+static bool run_workload(simulator_t *simulator, const char *path, engine_t engine, double *run_ns) {
+	if (!load_program(simulator, path, DEFAULT_LOAD_ADDRESS)) {
+		return false;
+	}
+	double start = now_ns();
+	run_engine(simulator, engine);
+	*run_ns = now_ns() - start;
+	bool ok = simulator->status == SIMULATION_OK;
+	unload_program(simulator);
+	return ok;
+}
+
+static double mips(const bench_result_t *result) {
+	return result->instructions / result->run_ns * 1e3;
+}
+
+static bool write_results(const bench_result_t *results, size_t count, const char *path) {
+	FILE *file = fopen(path, "w");
+	if (!file) {
+		fprintf(stderr, "Error: Could not create '%s'\n", path);
+		return false;
+	}
+	fprintf(file, "# workload\tengine\tinstructions\tmips\tns_per_instruction\tdecode_ms\texecute_ms\n");
+	for (size_t i = 0; i < count; i++) {
+		const bench_result_t *result = &results[i];
+		double execute_ns = result->run_ns > result->decode_ns ? result->run_ns - result->decode_ns : 0;
+		fprintf(file, "%s\t%s\t%llu\t%.2f\t%.3f\t%.4f\t%.3f\n", result->workload, result->engine,
+			(unsigned long long)result->instructions, mips(result),
+			result->run_ns / result->instructions, result->decode_ns / 1e6, execute_ns / 1e6);
+	}
+	bool ok = fclose(file) == 0;
+	if (!ok) {
+		fprintf(stderr, "Error: Could not write '%s'\n", path);
+	}
+	return ok;
+}
+
+// Compares the results with a file written by --output. Returns the number
+// of regressions, or -1 if the baseline cannot be read.
+static int check_baseline(const bench_result_t *results, size_t count, const char *path, double threshold) {
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		fprintf(stderr, "Error: Could not open baseline '%s'\n", path);
+		return -1;
+	}
+
+	int regressions = 0;
+	char line[512];
+	char workload[128];
+	char engine[32];
+	double baseline_mips;
+	while (fgets(line, sizeof(line), file)) {
+		if (line[0] == '#' || sscanf(line, "%127s %31s %*s %lf", workload, engine, &baseline_mips) != 3) {
+			continue;
+		}
+		for (size_t i = 0; i < count; i++) {
+			if (strcmp(results[i].workload, workload) != 0 || strcmp(results[i].engine, engine) != 0) {
+				continue;
+			}
+			double measured = mips(&results[i]);
+			if (measured < baseline_mips * (1 - threshold)) {
+				printf("REGRESSION %s on %s: %.2f MIPS, baseline %.2f (%.0f%% slower)\n", workload, engine,
+				       measured, baseline_mips, (1 - measured / baseline_mips) * 100);
+				regressions++;
+			}
+		}
+	}
+	fclose(file);
+	return regressions;
+}
+
+// A whole decimal argument, or 0 (which no count accepts) for anything else,
+// including values out of long's range
+static long parse_count(const char *text) {
+	char *end;
+	errno = 0;
+	long value = strtol(text, &end, 10);
+	return errno != 0 || end == text || *end != '\0' ? 0 : value;
+}
+
+int main(int argc, char *argv[]) {
+	long repeat = 5;
+	long scale = 1;
+	bool engines[ENGINE_COUNT] = {true, true, true};
+	const char *output_path = NULL;
+	const char *baseline_path = NULL;
+	const char *write_dir = NULL;
+	double threshold = 0.25;
+	bool selected[WORKLOAD_COUNT] = {0};
+	bool any_selected = false;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+			repeat = parse_count(argv[++i]);
+		} else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+			scale = parse_count(argv[++i]);
+		} else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+			const char *name = argv[++i];
+			for (size_t e = 0; e < ENGINE_COUNT; e++) {
+				engines[e] = strcmp(name, "all") == 0 || strcmp(name, engine_names[e]) == 0;
+			}
+		} else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+			output_path = argv[++i];
+		} else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+			baseline_path = argv[++i];
+		} else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+			threshold = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--write-workloads") == 0 && i + 1 < argc) {
+			write_dir = argv[++i];
+		} else {
+			size_t w = 0;
+			while (w < WORKLOAD_COUNT && strcmp(argv[i], workloads[w].name) != 0) {
+				w++;
+			}
+			if (w == WORKLOAD_COUNT) {
+				printf("Usage: %s [--engine interpreter|threaded|jit|all] [--repeat <n>] [--scale <n>] [--output <path>]\n"
+				       "          [--baseline <path> [--threshold <fraction>]] [--write-workloads <dir>] [workload...]\n"
+				       "Workloads: memory_loop alu_loop branchy copy_loop call_loop\n", argv[0]);
+				return 1;
+			}
+			selected[w] = true;
+			any_selected = true;
+		}
+	}
+	if (repeat < 1 || repeat > INT_MAX || scale < 1 || scale > BENCH_MAX_SCALE) {
+		fprintf(stderr, "Error: --repeat must be at least 1 and --scale between 1 and %d\n", BENCH_MAX_SCALE);
+		return 1;
+	}
+
+	// Workload images go to files because programs are loaded from files
+	char dir_template[] = "/tmp/bench8086.XXXXXX";
+	const char *dir = write_dir;
+	if (!dir) {
+		dir = mkdtemp(dir_template);
+		if (!dir) {
+			fprintf(stderr, "Error: Could not create a directory for the workloads\n");
+			return 1;
+		}
+	} else if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Error: Could not create '%s'\n", dir);
+		return 1;
+	}
+
+	decoder_t decoder = {};
+	simulator_t simulator = {
+			.decoder = &decoder,
+			.verbosity = VERBOSITY_SILENT,
+	};
+	if (!memory_init(&simulator.memory)) {
+		return 1;
+	}
+	if (!output_init(&simulator.output, OUTPUT_DISCARD, NULL, 0)) {
+		memory_free(&simulator.memory);
+		return 1;
+	}
+
+	bench_result_t results[WORKLOAD_COUNT * ENGINE_COUNT];
+	size_t result_count = 0;
+	bool ok = true;
+	printf("%-12s %-12s %14s %10s %10s %10s %11s\n", "workload", "engine", "instructions", "MIPS", "ns/instr",
+	       "decode ms", "execute ms");
+	for (size_t w = 0; ok && w < WORKLOAD_COUNT; w++) {
+		if (any_selected && !selected[w]) {
+			continue;
+		}
+		workload_image_t image = {0};
+		workloads[w].build(&image, (uint16_t)scale);
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s.bin", dir, workloads[w].name);
+		if (!write_image(&image, path)) {
+			ok = false;
+			break;
+		}
+
+		// Translated code does not count instructions without run controls,
+		// so the count comes from an interpreter run, which also warms up
+		double run_ns;
+		ok = run_workload(&simulator, path, ENGINE_INTERPRETER, &run_ns);
+		uint64_t instructions = instructions_run(&simulator);
+		double decode_ns = 0;
+		if (ok && load_program(&simulator, path, DEFAULT_LOAD_ADDRESS)) {
+			decode_ns = measure_decode(&simulator);
+			unload_program(&simulator);
+		}
+
+		for (size_t e = 0; ok && e < ENGINE_COUNT; e++) {
+			if (!engines[e]) {
+				continue;
+			}
+			bench_result_t *result = &results[result_count++];
+			*result = (bench_result_t){workloads[w].name, engine_names[e], instructions, 0, decode_ns};
+			for (int r = 0; ok && r < repeat; r++) {
+				ok = run_workload(&simulator, path, (engine_t)e, &run_ns);
+				if (r == 0 || run_ns < result->run_ns) {
+					result->run_ns = run_ns;
+				}
+			}
+			double execute_ns = result->run_ns > decode_ns ? result->run_ns - decode_ns : 0;
+			printf("%-12s %-12s %14llu %10.2f %10.3f %10.4f %11.3f\n", result->workload, result->engine,
+			       (unsigned long long)instructions, mips(result), result->run_ns / instructions,
+			       decode_ns / 1e6, execute_ns / 1e6);
+			fflush(stdout);
+		}
+		if (!ok) {
+			fprintf(stderr, "Error: Workload %s did not run to its end\n", workloads[w].name);
+		}
+		if (!write_dir) {
+			unlink(path);
+		}
+	}
+	if (!write_dir) {
+		rmdir(dir);
+	}
+	output_free(&simulator.output);
+	memory_free(&simulator.memory);
+
+	if (ok && output_path) {
+		ok = write_results(results, result_count, output_path);
+	}
+	if (ok && baseline_path) {
+		int regressions = check_baseline(results, result_count, baseline_path, threshold);
+		if (regressions != 0) {
+			if (regressions > 0) {
+				printf("%d of %zu results regressed more than %.0f%% against %s\n", regressions, result_count,
+				       threshold * 100, baseline_path);
+			}
+			return 1;
+		}
+		printf("No regressions beyond %.0f%% against %s\n", threshold * 100, baseline_path);
+	}
+	return ok ? 0 : 1;
+}
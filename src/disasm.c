@@ -0,0 +1,1292 @@
+#include "simulator.h"
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// DISASSEMBLER
+//
+// --disasm decodes a whole image in one linear sweep, with the same decoder
+// the engines use but without running anything, so code that execution never
+// reaches still comes out, and writes NASM source with a label at every jump
+// target that starts an instruction.
+//
+// Every jump the decoder knows is short, and calls only get a label when
+// their target is as close, so whether an instruction needs a label, and
+// whether a jump can name one, only depends on the instructions within 128
+// bytes or so. The decoder runs DISASM_LOOKAHEAD bytes ahead of
+// the writer and keeps what it decoded in a small ring, which takes at most
+// one decode per instruction and no memory in proportion to the image. An
+// instruction whose bytes were written recently isn't decoded or encoded
+// again; what was found out about it comes from a small cache.
+//
+// The output assembles back to the same bytes. Each instruction is encoded
+// again the way NASM encodes what we print, and anything that would come out
+// differently (a non-minimal encoding, a form the decoder only approximates,
+// an undecoded opcode) is written as `db` instead.
+//
+// Large images are split into chunks for a pool of workers, in two rounds.
+// First every chunk is swept from its first byte, and again from each of the
+// next DECODE_MAX_LENGTH - 1 bytes until that sweep lands on a start the first
+// one found; linear sweeps fall into step after a few instructions. Walking
+// the chunks in order then picks the sweep the previous chunk's last
+// instruction leads into, so the starts are exactly those of one sweep over
+// the whole image; a chunk whose sweeps never meet is swept again from the
+// right byte. Then every chunk is written the same way as a single sweep
+// would write it, and the texts go out in chunk order.
+
+// Longest encoding the re-encoder produces: prefix, opcode, mod/reg/r/m,
+// 16-bit displacement and 16-bit immediate
+#define ENCODE_MAX_LENGTH 7
+
+// Longest line the formatter writes
+#define DISASM_LINE_SIZE 128
+
+// How far the decoder runs ahead of the writer. A short jump reaches 130
+// bytes past its own start, and by the time one is decoded the writer has to
+// still be behind everything it can land on, so this has to cover a jump's
+// reach plus the longest instruction either way.
+#define DISASM_LOOKAHEAD 256
+// Slots in the ring, one per byte offset; a power of two comfortably past
+// the lookahead so the writer's instructions are never overwritten
+#define DISASM_WINDOW 1024
+
+// Bytes per chunk when the image is disassembled on several threads. A
+// multiple of 8, so each chunk's starts fill whole bytes of the bitmap.
+#ifndef DISASM_CHUNK_SIZE
+#define DISASM_CHUNK_SIZE (1 << 20)
+#endif
+_Static_assert(DISASM_CHUNK_SIZE % 8 == 0, "DISASM_CHUNK_SIZE must be a multiple of 8");
+// Starts a sweep from inside a chunk may find before meeting the sweep from
+// its first byte; one that takes longer is not kept
+#define DISASM_RESYNC_LIMIT 32
+
+// log2 of the entries in the instruction cache
+#define DISASM_CACHE_BITS 12
+// Longest instruction that is cached; the key holds its bytes and length
+#define DISASM_CACHED_LENGTH 7
+// Longest line an entry holds; anything longer is formatted every time
+#define DISASM_CACHED_TEXT 61
+
+// What the sweep knows about one byte offset. The offsets recorded say which
+// byte last used the slot, so slots need no clearing as the sweep moves on.
+typedef struct DisasmSlot {
+	size_t start;  // This offset, when an instruction starts here
+	size_t target; // This offset, when a jump lands here
+	uint32_t length;
+	uint64_t key;   // What the instruction is cached under, 0 if it can't be
+	bool decoded;   // instruction is set; a cache hit only sets it for a jump
+	instruction_t instruction;
+} disasm_slot_t;
+
+// What is known about one instruction, under its length and bytes. A line
+// that is kept needs only the first cache line of the entry.
+typedef struct DisasmLine {
+	uint64_t key;
+	bool encodes;   // Encodes back to its own bytes, so it isn't written as `db`
+	bool labelled;  // Names a label, so the line depends on where it is
+	uint8_t length; // Of text; 0 for a labelled line or one too long to keep
+	char text[DISASM_CACHED_TEXT];
+	instruction_t instruction; // Only set when the line isn't kept
+} disasm_line_t;
+
+typedef struct Disassembly {
+	const uint8_t *image;
+	size_t size;
+	decoder_t decoder;
+	simulator_t simulator;
+	disasm_slot_t slots[DISASM_WINDOW];
+	uint8_t lengths[1 << 16];    // Last length decoded after each first two bytes, 0 if none
+	disasm_line_t lines[1 << DISASM_CACHE_BITS];
+} disassembly_t;
+
+// A sweep from one of the first bytes of a chunk, up to where it meets the
+// sweep from the chunk's first byte
+typedef struct DisasmResync {
+	size_t join; // First start shared with the sweep from the first byte; SIZE_MAX if none
+	uint32_t count;
+	size_t starts[DISASM_RESYNC_LIMIT];
+} disasm_resync_t;
+
+typedef struct DisasmChunk {
+	size_t entry;  // First instruction start in the chunk, once stitched
+	size_t exit;   // First instruction start after the chunk
+	disasm_resync_t resyncs[DECODE_MAX_LENGTH]; // By distance from the first byte
+} disasm_chunk_t;
+
+typedef struct DisasmJob {
+	const uint8_t *image;
+	size_t size;
+	uint8_t *starts; // One bit per byte that starts an instruction
+	disasm_chunk_t *chunks;
+	size_t chunk_count;
+	ordered_output_t order; // One item per chunk
+	atomic_bool failed;
+} disasm_job_t;
+
+static inline disasm_slot_t *slot_at(disassembly_t *disasm, size_t offset)
+{
+	return &disasm->slots[offset & (DISASM_WINDOW - 1)];
+}
+
+static bool is_jump(operation_t op)
+{
+	return op >= OP_JMP && op <= LOOP_LOOPNZ;
+}
+
+// Decodes the instruction at offset. The decoder works with 16-bit offsets
+// into its buffer, so it is pointed at the instruction itself; the image is
+// padded with zeroes so decoders that read ahead stay inside it. Returns the
+// length, which can run past the end of the image.
+static uint32_t decode_at(disassembly_t *disasm, size_t offset, instruction_t *instruction)
+{
+	size_t remaining = disasm->size - offset;
+	disasm->decoder.bin_buffer = disasm->image + offset;
+	disasm->simulator.program_size = remaining < DECODE_MAX_LENGTH ? remaining : DECODE_MAX_LENGTH;
+	disasm->simulator.cpu.instr_ptr = 0;
+	*instruction = parse_instruction(&disasm->simulator);
+	return disasm->simulator.cpu.instr_ptr;
+}
+
+// ENCODER
+
+static bool is_byte_register(cpu_reg_t reg)
+{
+	return reg >= REG_AH && reg <= REG_DL;
+}
+
+static bool is_general_register(cpu_reg_t reg)
+{
+	return reg >= REG_AX && reg <= REG_DL;
+}
+
+static bool is_segment_register(cpu_reg_t reg)
+{
+	return reg >= REG_ES && reg <= REG_DS;
+}
+
+static bool fits_signed_byte(int32_t value)
+{
+	return value >= -128 && value <= 127;
+}
+
+// The reg field for a register, in the 8086 encoding order
+static uint8_t register_code(cpu_reg_t reg)
+{
+	static const uint8_t codes[REG_COUNT] = {
+		[REG_AX] = 0, [REG_CX] = 1, [REG_DX] = 2, [REG_BX] = 3,
+		[REG_SP] = 4, [REG_BP] = 5, [REG_SI] = 6, [REG_DI] = 7,
+		[REG_AL] = 0, [REG_CL] = 1, [REG_DL] = 2, [REG_BL] = 3,
+		[REG_AH] = 4, [REG_CH] = 5, [REG_DH] = 6, [REG_BH] = 7,
+		[REG_ES] = 0, [REG_CS] = 1, [REG_SS] = 2, [REG_DS] = 3,
+	};
+	return codes[reg];
+}
+
+static bool is_direct_address(const operand_t *operand)
+{
+	return operand->type == OPERAND_MEMORY && !operand->value.memory.has_base &&
+	       !operand->value.memory.has_index;
+}
+
+static uint8_t *encode_word(uint8_t *p, uint16_t value)
+{
+	p[0] = (uint8_t)value;
+	p[1] = (uint8_t)(value >> 8);
+	return p + 2;
+}
+
+// Writes the mod/reg/r/m byte and displacement for `rm`, with the shortest
+// displacement that reaches it, as NASM picks it. Returns NULL when rm is not
+// a register or memory operand.
+static uint8_t *encode_modrm(uint8_t *p, uint8_t reg, const operand_t *rm)
+{
+	if (rm->type == OPERAND_REGISTER && is_general_register(rm->value.reg))
+	{
+		*p++ = 0xC0 | reg << 3 | register_code(rm->value.reg);
+		return p;
+	}
+	if (rm->type != OPERAND_MEMORY)
+	{
+		return NULL;
+	}
+
+	const memory_address_t *memory = &rm->value.memory;
+	int16_t displacement = memory->has_displacement ? memory->displacement : 0;
+	if (!memory->has_base && !memory->has_index)
+	{
+		*p++ = reg << 3 | 0b110;
+		return encode_word(p, (uint16_t)displacement);
+	}
+
+	uint8_t code;
+	if (memory->has_base && memory->has_index)
+	{
+		code = (memory->base_reg == REG_BP ? 0b010 : 0b000) | (memory->index_reg == REG_DI);
+	}
+	else if (memory->has_index)
+	{
+		code = memory->index_reg == REG_SI ? 0b100 : 0b101;
+	}
+	else
+	{
+		code = memory->base_reg == REG_BP ? 0b110 : 0b111;
+	}
+
+	// [bp] has no encoding without a displacement
+	if (displacement == 0 && code != 0b110)
+	{
+		*p++ = reg << 3 | code;
+	}
+	else if (fits_signed_byte(displacement))
+	{
+		*p++ = 0x40 | reg << 3 | code;
+		*p++ = (uint8_t)displacement;
+	}
+	else
+	{
+		*p++ = 0x80 | reg << 3 | code;
+		p = encode_word(p, (uint16_t)displacement);
+	}
+	return p;
+}
+
+static const uint8_t jump_opcodes[] = {
+	[OP_JO] = 0x70,  [OP_JNO] = 0x71, [OP_JB] = 0x72,  [OP_JNB] = 0x73,
+	[OP_JE] = 0x74,  [OP_JNZ] = 0x75, [OP_JBE] = 0x76, [OP_JA] = 0x77,
+	[OP_JS] = 0x78,  [OP_JNS] = 0x79, [OP_JP] = 0x7A,  [OP_JNP] = 0x7B,
+	[OP_JL] = 0x7C,  [OP_JNL] = 0x7D, [OP_JLE] = 0x7E, [OP_JG] = 0x7F,
+	[LOOP_LOOPNZ] = 0xE0, [LOOP_LOOPZ] = 0xE1, [LOOP_LOOP] = 0xE2, [OP_JCXZ] = 0xE3,
+};
+
+static const uint8_t string_opcodes[] = {
+	[OP_MOVS] = 0xA4, [OP_CMPS] = 0xA6, [OP_STOS] = 0xAA, [OP_LODS] = 0xAC, [OP_SCAS] = 0xAE,
+};
+
+// The prefix and opcode of a string instruction. Segment overrides are left
+// to db, as the decoder does not keep where they came among the prefixes,
+// and so is repnz on anything but cmps and scas.
+static uint32_t encode_string(const instruction_t *instr, uint8_t *bytes)
+{
+	const operand_t *operands[] = {&instr->dest, &instr->src};
+	for (int i = 0; i < 2; i++)
+	{
+		const operand_t *operand = operands[i];
+		if (operand->type == OPERAND_MEMORY && operand->value.memory.index_reg == REG_SI &&
+		    operand->value.memory.segment != REG_NONE)
+		{
+			return 0;
+		}
+	}
+	uint8_t *p = bytes;
+	if (instr->rep == REP_NZ)
+	{
+		if (instr->op != OP_CMPS && instr->op != OP_SCAS)
+		{
+			return 0;
+		}
+		*p++ = 0xF2;
+	}
+	else if (instr->rep == REP_Z)
+	{
+		*p++ = 0xF3;
+	}
+	*p++ = string_opcodes[instr->op] | (instr->w_bit != 0);
+	return (uint32_t)(p - bytes);
+}
+
+// push/pop/pushf/popf/call/ret, after any segment override of a memory
+// operand. Registers use the one-byte forms NASM picks; there is no pop cs.
+static uint32_t encode_stack(const instruction_t *instr, uint8_t *bytes, uint8_t *p)
+{
+	const operand_t *operand = &instr->dest;
+	switch (instr->op)
+	{
+	case OP_PUSHF:
+		*p++ = 0x9C;
+		break;
+	case OP_POPF:
+		*p++ = 0x9D;
+		break;
+	case OP_RET:
+		if (operand->type == OPERAND_IMMEDIATE)
+		{
+			*p++ = 0xC2;
+			p = encode_word(p, (uint16_t)operand->value.immediate);
+		}
+		else
+		{
+			*p++ = 0xC3;
+		}
+		break;
+	case OP_CALL:
+		if (operand->type == OPERAND_IMMEDIATE)
+		{
+			*p++ = 0xE8;
+			p = encode_word(p, (uint16_t)operand->value.immediate);
+		}
+		else if (operand->type == OPERAND_MEMORY ||
+			 (is_general_register(operand->value.reg) && !is_byte_register(operand->value.reg)))
+		{
+			*p++ = 0xFF;
+			p = encode_modrm(p, 2, operand);
+		}
+		else
+		{
+			return 0;
+		}
+		break;
+	default:
+	{
+		bool push = instr->op == OP_PUSH;
+		if (operand->type == OPERAND_MEMORY)
+		{
+			*p++ = push ? 0xFF : 0x8F;
+			p = encode_modrm(p, push ? 6 : 0, operand);
+		}
+		else if (is_segment_register(operand->value.reg) && (push || operand->value.reg != REG_CS))
+		{
+			*p++ = (push ? 0x06 : 0x07) | register_code(operand->value.reg) << 3;
+		}
+		else if (is_general_register(operand->value.reg) && !is_byte_register(operand->value.reg))
+		{
+			*p++ = (push ? 0x50 : 0x58) | register_code(operand->value.reg);
+		}
+		else
+		{
+			return 0;
+		}
+		break;
+	}
+	}
+	return p ? (uint32_t)(p - bytes) : 0;
+}
+
+// Encodes an instruction the way NASM assembles the text put_instruction writes
+// for it. Returns the length, or 0 when the text would not assemble to an
+// instruction of its own.
+static uint32_t encode_instruction(const instruction_t *instr, uint8_t *bytes)
+{
+	const operand_t *dest = &instr->dest;
+	const operand_t *src = &instr->src;
+	uint8_t *p = bytes;
+
+	if (is_jump(instr->op))
+	{
+		if (!jump_opcodes[instr->op] || dest->type != OPERAND_IMMEDIATE)
+		{
+			return 0;
+		}
+		*p++ = jump_opcodes[instr->op];
+		*p++ = (uint8_t)dest->value.immediate;
+		return (uint32_t)(p - bytes);
+	}
+	if (is_string_operation(instr->op))
+	{
+		return encode_string(instr, bytes);
+	}
+	if (instr->op == OP_CLD || instr->op == OP_STD)
+	{
+		*p++ = instr->op == OP_CLD ? 0xFC : 0xFD;
+		return (uint32_t)(p - bytes);
+	}
+
+	// Assemblers may drop an override of the segment the address uses
+	// anyway, so those are left to db
+	const operand_t *memory = dest->type == OPERAND_MEMORY ? dest : src->type == OPERAND_MEMORY ? src : NULL;
+	if (memory && memory->value.memory.segment != REG_NONE)
+	{
+		const memory_address_t *address = &memory->value.memory;
+		cpu_reg_t standard = address->has_base && address->base_reg == REG_BP ? REG_SS : REG_DS;
+		if (address->segment == standard)
+		{
+			return 0;
+		}
+		*p++ = 0x26 | register_code(address->segment) << 3;
+	}
+	if (is_stack_operation(instr->op))
+	{
+		return encode_stack(instr, bytes, p);
+	}
+
+	// Register operands decide the width, as they do for NASM; the decoded
+	// w bit only matters next to an immediate and memory
+	cpu_reg_t reg = dest->type == OPERAND_REGISTER ? dest->value.reg
+			: src->type == OPERAND_REGISTER ? src->value.reg
+			: REG_NONE;
+	uint8_t w = reg != REG_NONE ? !is_byte_register(reg) : instr->w_bit != 0;
+
+	if (src->type == OPERAND_IMMEDIATE)
+	{
+		int32_t value = w ? src->value.immediate : (uint8_t)src->value.immediate;
+		if (dest->type == OPERAND_REGISTER && !is_general_register(dest->value.reg))
+		{
+			return 0;
+		}
+		if (instr->op == OP_MOV)
+		{
+			if (dest->type == OPERAND_REGISTER)
+			{
+				*p++ = 0xB0 | w << 3 | register_code(dest->value.reg);
+			}
+			else
+			{
+				*p++ = 0xC6 | w;
+				if (!(p = encode_modrm(p, 0, dest)))
+				{
+					return 0;
+				}
+			}
+			if (w)
+			{
+				p = encode_word(p, (uint16_t)value);
+			}
+			else
+			{
+				*p++ = (uint8_t)value;
+			}
+			return (uint32_t)(p - bytes);
+		}
+
+		uint8_t alu = instr->op == OP_ADD ? 0 : instr->op == OP_SUB ? 5 : 7;
+		bool accumulator = dest->type == OPERAND_REGISTER && register_code(dest->value.reg) == 0;
+		if (w && fits_signed_byte(value))
+		{
+			*p++ = 0x83;
+			p = encode_modrm(p, alu, dest);
+			if (!p)
+			{
+				return 0;
+			}
+			*p++ = (uint8_t)value;
+		}
+		else if (accumulator)
+		{
+			*p++ = alu << 3 | 0b100 | w;
+			if (w)
+			{
+				p = encode_word(p, (uint16_t)value);
+			}
+			else
+			{
+				*p++ = (uint8_t)value;
+			}
+		}
+		else
+		{
+			*p++ = 0x80 | w;
+			if (!(p = encode_modrm(p, alu, dest)))
+			{
+				return 0;
+			}
+			if (w)
+			{
+				p = encode_word(p, (uint16_t)value);
+			}
+			else
+			{
+				*p++ = (uint8_t)value;
+			}
+		}
+		return (uint32_t)(p - bytes);
+	}
+
+	if (dest->type == OPERAND_REGISTER && is_segment_register(dest->value.reg))
+	{
+		if (instr->op != OP_MOV || (src->type == OPERAND_REGISTER &&
+					    (!is_general_register(src->value.reg) || is_byte_register(src->value.reg))))
+		{
+			return 0;
+		}
+		*p++ = 0x8E;
+		p = encode_modrm(p, register_code(dest->value.reg), src);
+		return p ? (uint32_t)(p - bytes) : 0;
+	}
+	if (src->type == OPERAND_REGISTER && is_segment_register(src->value.reg))
+	{
+		if (instr->op != OP_MOV || (dest->type == OPERAND_REGISTER &&
+					    (!is_general_register(dest->value.reg) || is_byte_register(dest->value.reg))))
+		{
+			return 0;
+		}
+		*p++ = 0x8C;
+		p = encode_modrm(p, register_code(src->value.reg), dest);
+		return p ? (uint32_t)(p - bytes) : 0;
+	}
+
+	// Register with register or memory. Register pairs use the r/m-first
+	// form, and mov between the accumulator and a direct address its own
+	// opcodes.
+	if (reg == REG_NONE || !is_general_register(reg) ||
+	    (dest->type != OPERAND_REGISTER && dest->type != OPERAND_MEMORY) ||
+	    (src->type != OPERAND_REGISTER && src->type != OPERAND_MEMORY) ||
+	    (src->type == OPERAND_REGISTER && !is_general_register(src->value.reg)) ||
+	    (dest->type == OPERAND_REGISTER && !is_general_register(dest->value.reg)) ||
+	    (src->type == OPERAND_REGISTER && dest->type == OPERAND_REGISTER &&
+	     is_byte_register(src->value.reg) != is_byte_register(dest->value.reg)))
+	{
+		return 0;
+	}
+	uint8_t opcode = instr->op == OP_MOV ? 0x88 : instr->op == OP_ADD ? 0x00 : instr->op == OP_SUB ? 0x28 : 0x38;
+	if (dest->type == OPERAND_MEMORY)
+	{
+		if (instr->op == OP_MOV && register_code(src->value.reg) == 0 && is_direct_address(dest))
+		{
+			*p++ = 0xA2 | w;
+			p = encode_word(p, (uint16_t)dest->value.memory.displacement);
+			return (uint32_t)(p - bytes);
+		}
+		*p++ = opcode | w;
+		p = encode_modrm(p, register_code(src->value.reg), dest);
+	}
+	else if (src->type == OPERAND_MEMORY)
+	{
+		if (instr->op == OP_MOV && register_code(dest->value.reg) == 0 && is_direct_address(src))
+		{
+			*p++ = 0xA0 | w;
+			p = encode_word(p, (uint16_t)src->value.memory.displacement);
+			return (uint32_t)(p - bytes);
+		}
+		*p++ = opcode | 0b10 | w;
+		p = encode_modrm(p, register_code(dest->value.reg), src);
+	}
+	else
+	{
+		*p++ = opcode | w;
+		p = encode_modrm(p, register_code(src->value.reg), dest);
+	}
+	return p ? (uint32_t)(p - bytes) : 0;
+}
+
+// FORMATTER
+
+static char *put_text(char *p, const char *text)
+{
+	while (*text)
+	{
+		*p++ = *text++;
+	}
+	return p;
+}
+
+static char *put_decimal(char *p, int32_t value)
+{
+	char digits[12];
+	int count = 0;
+	uint32_t magnitude = value < 0 ? -(uint32_t)value : (uint32_t)value;
+	if (value < 0)
+	{
+		*p++ = '-';
+	}
+	do
+	{
+		digits[count++] = (char)('0' + magnitude % 10);
+		magnitude /= 10;
+	} while (magnitude);
+	while (count)
+	{
+		*p++ = digits[--count];
+	}
+	return p;
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+// At least `width` lowercase hex digits
+static char *put_hex(char *p, size_t value, int width)
+{
+	int digits = width;
+	while (digits < 16 && value >> (4 * digits))
+	{
+		digits++;
+	}
+	for (int i = digits - 1; i >= 0; i--)
+	{
+		*p++ = hex_digits[(value >> (4 * i)) & 0xF];
+	}
+	return p;
+}
+
+static char *put_label(char *p, size_t offset)
+{
+	p = put_text(p, "label_");
+	return put_hex(p, offset, 4);
+}
+
+static char *put_memory(char *p, const memory_address_t *memory)
+{
+	*p++ = '[';
+	if (memory->segment != REG_NONE)
+	{
+		p = put_text(p, reg_names[memory->segment]);
+		*p++ = ':';
+	}
+	int16_t displacement = memory->has_displacement ? memory->displacement : 0;
+	if (!memory->has_base && !memory->has_index)
+	{
+		p = put_decimal(p, (uint16_t)displacement);
+	}
+	else
+	{
+		p = put_text(p, reg_names[memory->has_base ? memory->base_reg : memory->index_reg]);
+		if (memory->has_base && memory->has_index)
+		{
+			*p++ = '+';
+			p = put_text(p, reg_names[memory->index_reg]);
+		}
+		if (displacement)
+		{
+			*p++ = displacement < 0 ? '-' : '+';
+			p = put_decimal(p, displacement < 0 ? -(int32_t)displacement : displacement);
+		}
+	}
+	*p++ = ']';
+	return p;
+}
+
+static char *put_operand(char *p, const operand_t *operand, uint8_t w)
+{
+	switch (operand->type)
+	{
+	case OPERAND_REGISTER:
+		return put_text(p, reg_names[operand->value.reg]);
+	case OPERAND_MEMORY:
+		return put_memory(p, &operand->value.memory);
+	case OPERAND_IMMEDIATE:
+		return put_decimal(p, w ? operand->value.immediate : (uint8_t)operand->value.immediate);
+	default:
+		return p;
+	}
+}
+
+// Writes `db` for bytes that cannot be written as an instruction
+static char *put_bytes(char *p, const uint8_t *bytes, size_t count)
+{
+	p = put_text(p, "db ");
+	for (size_t i = 0; i < count; i++)
+	{
+		if (i)
+		{
+			*p++ = ',';
+			*p++ = ' ';
+		}
+		*p++ = '0';
+		*p++ = 'x';
+		*p++ = hex_digits[bytes[i] >> 4];
+		*p++ = hex_digits[bytes[i] & 0xF];
+	}
+	return p;
+}
+
+// Whether the target of a jump or call gets a label. A call can reach the
+// whole segment, so only one as close as a short jump gets one; that keeps
+// labels depending on nearby instructions only.
+static bool has_label_target(const instruction_t *instr)
+{
+	return instr->dest.type == OPERAND_IMMEDIATE &&
+	       (is_jump(instr->op) || (instr->op == OP_CALL && fits_signed_byte(instr->dest.value.immediate)));
+}
+
+// Writes the NASM text for an instruction encode_instruction accepted
+static char *put_instruction(char *p, disassembly_t *disasm, const instruction_t *instr,
+			     size_t offset, uint32_t length)
+{
+	if (is_string_operation(instr->op))
+	{
+		if (instr->rep != REP_NONE)
+		{
+			p = put_text(p, instr->rep == REP_NZ ? "repnz " :
+				     instr->op == OP_CMPS || instr->op == OP_SCAS ? "repz " : "rep ");
+		}
+		p = put_text(p, op_names[instr->op]);
+		*p++ = instr->w_bit ? 'w' : 'b';
+		return p;
+	}
+	if (instr->op == OP_CLD || instr->op == OP_STD || instr->dest.type == OPERAND_NONE)
+	{
+		return put_text(p, op_names[instr->op]);
+	}
+	p = put_text(p, op_names[instr->op]);
+	*p++ = ' ';
+	if (is_jump(instr->op) || (instr->op == OP_CALL && instr->dest.type == OPERAND_IMMEDIATE))
+	{
+		// Only the conditional jumps have a near form to tell apart
+		if (is_jump(instr->op) && instr->op < LOOP_LOOP && instr->op != OP_JCXZ)
+		{
+			p = put_text(p, "short ");
+		}
+		int64_t target = (int64_t)offset + length + instr->dest.value.immediate;
+		if (has_label_target(instr) && target >= 0 && (size_t)target < disasm->size &&
+		    slot_at(disasm, (size_t)target)->start == (size_t)target)
+		{
+			return put_label(p, (size_t)target);
+		}
+		*p++ = '$';
+		int32_t relative = (int32_t)length + instr->dest.value.immediate;
+		if (relative >= 0)
+		{
+			*p++ = '+';
+		}
+		return put_decimal(p, relative);
+	}
+
+	if (is_stack_operation(instr->op))
+	{
+		if (instr->dest.type == OPERAND_IMMEDIATE)
+		{
+			return put_decimal(p, (uint16_t)instr->dest.value.immediate);
+		}
+		if (instr->dest.type == OPERAND_MEMORY)
+		{
+			p = put_text(p, "word ");
+		}
+		return put_operand(p, &instr->dest, 1);
+	}
+
+	const operand_t *dest = &instr->dest;
+	const operand_t *src = &instr->src;
+	uint8_t w = instr->w_bit != 0;
+	if (dest->type == OPERAND_REGISTER)
+	{
+		w = !is_byte_register(dest->value.reg);
+	}
+	if (src->type == OPERAND_IMMEDIATE && dest->type == OPERAND_MEMORY)
+	{
+		p = put_text(p, w ? "word " : "byte ");
+	}
+	p = put_operand(p, dest, w);
+	*p++ = ',';
+	*p++ = ' ';
+	return put_operand(p, src, w);
+}
+
+// CACHE
+//
+// The decoder only reads an instruction's own bytes, so the instruction, and
+// whether it encodes back to them, is the same wherever those bytes turn up
+// again. Each entry keeps both, plus the finished line unless the line names
+// a label, which depends on where the instruction is; such a line is
+// formatted from the cached instruction every time. The first two bytes pick
+// the length to try and the key holds that many bytes, so a wrong guess only
+// misses. Instructions near enough to the end of the image for the decoder
+// to be cut short are never cached.
+
+// The bytes go in the low seven bytes and the length in the top one. There
+// are always DECODE_MAX_LENGTH bytes to read past anything cached.
+static uint64_t line_key(const uint8_t *bytes, uint32_t length)
+{
+	uint64_t word;
+	memcpy(&word, bytes, sizeof(word));
+	return (word & ((UINT64_C(1) << (8 * length)) - 1)) | (uint64_t)length << 56;
+}
+
+static disasm_line_t *line_entry(disassembly_t *disasm, uint64_t key)
+{
+	return &disasm->lines[(key * 0x9E3779B97F4A7C15u) >> (64 - DISASM_CACHE_BITS)];
+}
+
+// The entry for the instruction at offset, with the key it is under; NULL
+// when it isn't cached
+static const disasm_line_t *cached_line(disassembly_t *disasm, size_t offset, uint64_t *key)
+{
+	*key = 0;
+	if (disasm->size - offset < DECODE_MAX_LENGTH)
+	{
+		return NULL;
+	}
+	const uint8_t *bytes = disasm->image + offset;
+	uint32_t length = disasm->lengths[bytes[0] | bytes[1] << 8];
+	if (!length)
+	{
+		return NULL;
+	}
+	uint64_t guess = line_key(bytes, length);
+	const disasm_line_t *entry = line_entry(disasm, guess);
+	if (entry->key != guess)
+	{
+		return NULL;
+	}
+	*key = guess;
+	return entry;
+}
+
+// The key to cache a decoded instruction under, 0 if it can't be. Its length
+// becomes the guess for the next instruction with the same first two bytes.
+static uint64_t cache_key(disassembly_t *disasm, size_t offset, uint32_t length)
+{
+	if (disasm->size - offset < DECODE_MAX_LENGTH || length > DISASM_CACHED_LENGTH)
+	{
+		return 0;
+	}
+	const uint8_t *bytes = disasm->image + offset;
+	disasm->lengths[bytes[0] | bytes[1] << 8] = (uint8_t)length;
+	return line_key(bytes, length);
+}
+
+// SWEEP
+
+// Decodes the instruction at offset into its slot and marks where it jumps.
+// A cached instruction is only measured, unless it is a jump whose target
+// needs marking. Returns the offset of the next instruction.
+static size_t decode_next(disassembly_t *disasm, size_t offset)
+{
+	disasm_slot_t *slot = slot_at(disasm, offset);
+	slot->start = offset;
+	const disasm_line_t *entry = cached_line(disasm, offset, &slot->key);
+	if (entry)
+	{
+		slot->length = (uint32_t)(slot->key >> 56);
+		slot->decoded = entry->labelled;
+		if (!entry->labelled)
+		{
+			return offset + slot->length;
+		}
+		slot->instruction = entry->instruction;
+	}
+	else
+	{
+		slot->decoded = true;
+		slot->length = decode_at(disasm, offset, &slot->instruction);
+		if (slot->length > disasm->size - offset)
+		{
+			// Runs off the end, so only the bytes that are there get written
+			slot->length = (uint32_t)(disasm->size - offset);
+			slot->instruction = (instruction_t){};
+			return disasm->size;
+		}
+		slot->key = cache_key(disasm, offset, slot->length);
+	}
+
+	const instruction_t *instr = &slot->instruction;
+	if (has_label_target(instr))
+	{
+		int64_t target = (int64_t)offset + slot->length + instr->dest.value.immediate;
+		if (target >= 0 && (size_t)target < disasm->size)
+		{
+			slot_at(disasm, (size_t)target)->target = (size_t)target;
+		}
+	}
+	return offset + slot->length;
+}
+
+static void clear_slots(disassembly_t *disasm)
+{
+	for (size_t i = 0; i < DISASM_WINDOW; i++)
+	{
+		disasm->slots[i].start = SIZE_MAX;
+		disasm->slots[i].target = SIZE_MAX;
+	}
+}
+
+// Writes the line for an instruction, as `db` unless it encodes back to its
+// own bytes
+static char *put_line(char *p, disassembly_t *disasm, const instruction_t *instr, bool encodes,
+		      size_t offset, uint32_t length)
+{
+	if (encodes)
+	{
+		p = put_instruction(p, disasm, instr, offset, length);
+	}
+	else
+	{
+		p = put_bytes(p, disasm->image + offset, length);
+	}
+	*p++ = '\n';
+	return p;
+}
+
+// Writes the line for an instruction the cache doesn't have, checking that
+// it encodes back to its bytes, and caches it when it can be
+static char *put_slot(char *p, disassembly_t *disasm, const disasm_slot_t *slot, size_t offset)
+{
+	instruction_t instruction;
+	const instruction_t *instr = &slot->instruction;
+	if (!slot->decoded)
+	{
+		// The entry the sweep found was pushed out of the cache since
+		decode_at(disasm, offset, &instruction);
+		instr = &instruction;
+	}
+
+	uint8_t encoded[ENCODE_MAX_LENGTH];
+	bool encodes = encode_instruction(instr, encoded) == slot->length &&
+		       memcmp(encoded, disasm->image + offset, slot->length) == 0;
+	char *text = p;
+	p = put_line(p, disasm, instr, encodes, offset, slot->length);
+	if (slot->key)
+	{
+		disasm_line_t *entry = line_entry(disasm, slot->key);
+		size_t length = (size_t)(p - text);
+		entry->key = slot->key;
+		entry->encodes = encodes;
+		entry->labelled = has_label_target(instr);
+		entry->length = entry->labelled || length > DISASM_CACHED_TEXT ? 0 : (uint8_t)length;
+		if (entry->length)
+		{
+			memcpy(entry->text, text, entry->length);
+		}
+		else
+		{
+			entry->instruction = *instr;
+		}
+	}
+	return p;
+}
+
+// Writes the instructions starting in [from, to). Decoding starts at
+// `decoded`, an instruction start far enough before `from` to have seen
+// every jump that can land at or after it.
+static void write_instructions(disassembly_t *disasm, size_t decoded, size_t from, size_t to, output_sink_t *out)
+{
+	char line[DISASM_LINE_SIZE];
+	for (size_t offset = from; offset < to;)
+	{
+		while (decoded < disasm->size && decoded < offset + DISASM_LOOKAHEAD)
+		{
+			decoded = decode_next(disasm, decoded);
+		}
+
+		const disasm_slot_t *slot = slot_at(disasm, offset);
+		if (slot->target == offset)
+		{
+			char *p = put_label(line, offset);
+			*p++ = ':';
+			*p++ = '\n';
+			output_write(out, line, (size_t)(p - line));
+		}
+		const disasm_line_t *entry = slot->key ? line_entry(disasm, slot->key) : NULL;
+		if (entry && entry->key != slot->key)
+		{
+			entry = NULL;
+		}
+		if (entry && entry->length)
+		{
+			output_write(out, entry->text, entry->length);
+		}
+		else
+		{
+			char *p = entry ? put_line(line, disasm, &entry->instruction, entry->encodes, offset, slot->length)
+					: put_slot(line, disasm, slot, offset);
+			output_write(out, line, (size_t)(p - line));
+		}
+		offset += slot->length;
+	}
+}
+
+static disassembly_t *create_disassembly(const uint8_t *image, size_t size)
+{
+	// Zeroed, so the cache starts out empty
+	disassembly_t *disasm = calloc(1, sizeof(disassembly_t));
+	if (!disasm)
+	{
+		fprintf(stderr, "Error: Could not allocate disassembler\n");
+		return NULL;
+	}
+	disasm->image = image;
+	disasm->size = size;
+	disasm->simulator.decoder = &disasm->decoder;
+	clear_slots(disasm);
+	return disasm;
+}
+
+// CHUNKS
+
+static inline bool test_bit(const uint8_t *bits, size_t index)
+{
+	return (bits[index / 8] >> (index % 8)) & 1;
+}
+
+static inline void set_bit(uint8_t *bits, size_t index)
+{
+	bits[index / 8] |= (uint8_t)(1 << (index % 8));
+}
+
+static inline void clear_bit(uint8_t *bits, size_t index)
+{
+	bits[index / 8] &= (uint8_t)~(1 << (index % 8));
+}
+
+static size_t chunk_end(const disasm_job_t *job, size_t index)
+{
+	size_t end = (index + 1) * DISASM_CHUNK_SIZE;
+	return end < job->size ? end : job->size;
+}
+
+// Where the instruction after the one at offset starts, the same way
+// decode_next steps, but without keeping the instruction
+static size_t skip_instruction(disassembly_t *disasm, size_t offset)
+{
+	instruction_t instruction;
+	uint32_t length = decode_at(disasm, offset, &instruction);
+	return length <= disasm->size - offset ? offset + length : disasm->size;
+}
+
+// Marks the starts of a sweep from offset up to end. Returns the first start
+// at or after end.
+static size_t sweep_starts(disassembly_t *disasm, uint8_t *starts, size_t offset, size_t end)
+{
+	while (offset < end)
+	{
+		set_bit(starts, offset);
+		offset = skip_instruction(disasm, offset);
+	}
+	return offset;
+}
+
+// Sweeps a chunk from its first byte, then from each of the next bytes until
+// that sweep meets the first
+static void find_chunk_starts(disassembly_t *disasm, disasm_job_t *job, size_t index)
+{
+	disasm_chunk_t *chunk = &job->chunks[index];
+	size_t begin = index * DISASM_CHUNK_SIZE;
+	size_t end = chunk_end(job, index);
+	chunk->exit = sweep_starts(disasm, job->starts, begin, end);
+
+	for (size_t phase = 1; phase < DECODE_MAX_LENGTH; phase++)
+	{
+		disasm_resync_t *resync = &chunk->resyncs[phase];
+		resync->join = SIZE_MAX;
+		resync->count = 0;
+		for (size_t offset = begin + phase; offset < end && resync->count < DISASM_RESYNC_LIMIT;)
+		{
+			if (test_bit(job->starts, offset))
+			{
+				resync->join = offset;
+				break;
+			}
+			resync->starts[resync->count++] = offset;
+			offset = skip_instruction(disasm, offset);
+		}
+	}
+}
+
+// Follows the instruction boundary from chunk to chunk. Where a chunk is
+// entered past its first byte, the starts before the join are replaced with
+// those of the matching sweep.
+static void stitch_chunks(disassembly_t *disasm, disasm_job_t *job)
+{
+	size_t entry = 0;
+	for (size_t index = 0; index < job->chunk_count; index++)
+	{
+		disasm_chunk_t *chunk = &job->chunks[index];
+		size_t begin = index * DISASM_CHUNK_SIZE;
+		size_t end = chunk_end(job, index);
+		size_t phase = entry - begin;
+		chunk->entry = entry;
+		if (phase > 0 && phase < DECODE_MAX_LENGTH && chunk->resyncs[phase].join != SIZE_MAX)
+		{
+			const disasm_resync_t *resync = &chunk->resyncs[phase];
+			for (size_t offset = begin; offset < resync->join; offset++)
+			{
+				clear_bit(job->starts, offset);
+			}
+			for (uint32_t i = 0; i < resync->count; i++)
+			{
+				set_bit(job->starts, resync->starts[i]);
+			}
+		}
+		else if (phase > 0)
+		{
+			// The sweeps never met, or the chunk is entered too far in
+			for (size_t offset = begin; offset < end; offset++)
+			{
+				clear_bit(job->starts, offset);
+			}
+			chunk->exit = sweep_starts(disasm, job->starts, entry, end);
+		}
+		entry = chunk->exit;
+	}
+}
+
+// Writes a chunk's instructions, decoding from far enough back to see every
+// jump into the chunk
+static void write_chunk(disassembly_t *disasm, const disasm_job_t *job, const disasm_chunk_t *chunk,
+			output_sink_t *out)
+{
+	size_t decoded = chunk->entry > DISASM_LOOKAHEAD ? chunk->entry - DISASM_LOOKAHEAD : 0;
+	while (decoded < chunk->entry && !test_bit(job->starts, decoded))
+	{
+		decoded++;
+	}
+	clear_slots(disasm);
+	write_instructions(disasm, decoded, chunk->entry, chunk->exit, out);
+}
+
+static void *find_starts_worker(void *arg)
+{
+	disasm_job_t *job = arg;
+	disassembly_t *disasm = create_disassembly(job->image, job->size);
+	if (!disasm)
+	{
+		return NULL;
+	}
+	for (size_t i; ordered_claim(&job->order, &i);)
+	{
+		find_chunk_starts(disasm, job, i);
+	}
+	free(disasm);
+	return NULL;
+}
+
+static void *write_chunks_worker(void *arg)
+{
+	disasm_job_t *job = arg;
+	disassembly_t *disasm = create_disassembly(job->image, job->size);
+	output_sink_t out;
+	if (!disasm || !output_init(&out, OUTPUT_MEMORY, NULL, DISASM_OUTPUT_SIZE))
+	{
+		free(disasm);
+		return NULL;
+	}
+
+	for (size_t i; ordered_claim(&job->order, &i);)
+	{
+		write_chunk(disasm, job, &job->chunks[i], &out);
+		if (!ordered_finish(&job->order, i, &out))
+		{
+			fprintf(stderr, "Error: Could not keep the disassembly of chunk %zu\n", i);
+			job->failed = true;
+		}
+	}
+
+	if (!output_free(&out))
+	{
+		job->failed = true;
+	}
+	free(disasm);
+	return NULL;
+}
+
+// Chunk texts go out in chunk order
+static void write_chunk_text(void *context, size_t index, const char *text, size_t length)
+{
+	output_write(context, text, length);
+}
+
+static bool disassemble_chunks(const uint8_t *image, size_t size, long workers, output_sink_t *out)
+{
+	disasm_job_t job = {
+		.image = image,
+		.size = size,
+		.starts = calloc(size / 8 + 1, 1),
+		.chunk_count = (size + DISASM_CHUNK_SIZE - 1) / DISASM_CHUNK_SIZE,
+	};
+	job.chunks = calloc(job.chunk_count, sizeof(disasm_chunk_t));
+	disassembly_t *disasm = create_disassembly(image, size);
+	bool ok = ordered_init(&job.order, job.chunk_count, write_chunk_text, out);
+	if (!ok || !job.starts || !job.chunks || !disasm)
+	{
+		fprintf(stderr, "Error: Could not allocate disassembly of %zu chunks\n", job.chunk_count);
+		ordered_free(&job.order);
+		free(job.starts);
+		free(job.chunks);
+		free(disasm);
+		return false;
+	}
+
+	// The first round only claims chunks; the second hands their text over
+	ok = ordered_run(&job.order, workers, find_starts_worker, &job);
+	if (ok)
+	{
+		stitch_chunks(disasm, &job);
+		ok = ordered_run(&job.order, workers, write_chunks_worker, &job) && !job.failed;
+	}
+
+	ordered_free(&job.order);
+	free(job.starts);
+	free(job.chunks);
+	free(disasm);
+	return ok;
+}
+
+// Reads the whole file with DECODE_MAX_LENGTH zeroes after it
+static uint8_t *read_image(const char *path, size_t *size)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Error: Could not open file '%s'\n", path);
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		fprintf(stderr, "Error: Could not determine size of file '%s'\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	*size = (size_t)st.st_size;
+	uint8_t *image = calloc(*size + DECODE_MAX_LENGTH, 1);
+	if (!image)
+	{
+		fprintf(stderr, "Error: Could not allocate %zu bytes for '%s'\n", *size, path);
+		close(fd);
+		return NULL;
+	}
+	size_t done = 0;
+	while (done < *size)
+	{
+		ssize_t got = read(fd, image + done, *size - done);
+		if (got <= 0)
+		{
+			fprintf(stderr, "Error: Could not read complete file '%s' (read %zu of %zu bytes)\n",
+				path, done, *size);
+			free(image);
+			close(fd);
+			return NULL;
+		}
+		done += (size_t)got;
+	}
+	close(fd);
+	return image;
+}
+
+// Writes NASM source for the file at path. workers is the number of threads
+// to spread a large image over, 0 for one per CPU; the text is the same for
+// any number.
+int disassemble_file(const char *path, int workers, output_sink_t *out)
+{
+	size_t size;
+	uint8_t *image = read_image(path, &size);
+	if (!image)
+	{
+		return 1;
+	}
+
+	size_t chunk_count = (size + DISASM_CHUNK_SIZE - 1) / DISASM_CHUNK_SIZE;
+	long threads = workers > 0 ? workers : sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1)
+	{
+		threads = 1;
+	}
+	if ((size_t)threads > chunk_count)
+	{
+		threads = (long)chunk_count;
+	}
+
+	output_write(out, "bits 16\n\n", 9);
+	bool ok;
+	if (threads > 1)
+	{
+		ok = disassemble_chunks(image, size, threads, out);
+	}
+	else
+	{
+		disassembly_t *disasm = create_disassembly(image, size);
+		ok = disasm != NULL;
+		if (ok)
+		{
+			write_instructions(disasm, 0, 0, size, out);
+		}
+		free(disasm);
+	}
+	ok = output_flush(out) && ok;
+
+	free(image);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,755 @@
+#include "simulator.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// JIT EXECUTION ENGINE
+//
+// Runs the program on the interpreter while counting how often each basic
+// block is entered. A block that reaches JIT_HOT_THRESHOLD entries is
+// translated into x86-64 code: straight-line register mov/add/sub/cmp up to
+// the conditional jump or loop that ends it. While translated code runs the
+// guest registers stay in fixed host registers and the 8086 arithmetic flags
+// stay in the host flags, which add/sub/cmp compute identically on both.
+// Block exits are patched to jump straight into their target once that is
+// translated too, so a hot loop never comes back to C. Anything else (memory
+// operands, segment registers, the stack, undecoded bytes) ends the block and
+// runs on the interpreter.
+//
+// Translated code produces no per-instruction output and keeps no cycle or
+// profile counts, so traced, --cycles and --profile runs are handed to
+// run_simulation. Under run controls every block starts by counting itself
+// off a budget of whole blocks in r12 and adding its instructions to r13,
+// which the exit stub takes off the fuel; blocks end before breakpoints and
+// never start at one.
+//
+// The code arena is never writable and executable at the same time, which
+// hardened kernels refuse: it is made writable to translate and link a block
+// and executable again before any of it runs.
+
+#ifndef JIT_HOT_THRESHOLD
+#define JIT_HOT_THRESHOLD 50
+#endif
+
+#define JIT_ARENA_SIZE (4 << 20)
+#define JIT_MAX_BLOCK_INSTRUCTIONS 64
+#define JIT_BLOCK_SPACE 1024 // Bytes a block needs at most, exits included
+#define JIT_MAX_BLOCK_EXITS 4
+#define JIT_NEVER UINT16_MAX // Entry count of a block that cannot be translated
+
+#if defined(__x86_64__)
+
+// Loads the guest registers and flags, jumps to `block` and returns the guest
+// instr_ptr execution left translated code at. Under run controls at most
+// `blocks` blocks are entered before leaving.
+typedef uint16_t (*jit_entry_t)(cpu_state_t *cpu, const uint8_t *block, uint64_t blocks);
+
+// The exit stub reaches the run controls through the cpu_state_t pointer
+_Static_assert(offsetof(simulator_t, cpu) == 0, "cpu must start simulator_t");
+
+typedef struct JitExit {
+	uint8_t *site;   // rel32 of the jump that leaves a block
+	uint16_t target; // Guest instr_ptr the jump leads to
+} jit_exit_t;
+
+struct Jit {
+	uint8_t *arena; // JIT_ARENA_SIZE bytes of code, either writable or executable
+	size_t used;
+	bool disabled;  // The arena could not be made executable, so nothing translated runs
+	size_t stubs_size; // The entry and exit stubs at the start of the arena
+	jit_entry_t enter;
+	const uint8_t *exit_stub;
+	size_t program_size;
+	bool counted;     // Blocks count themselves against the run controls
+	uint8_t **blocks; // Translated code per guest instr_ptr, NULL if none
+	uint16_t *counts; // Entries per guest instr_ptr until it is translated
+	jit_exit_t *pending; // Exits whose target is not translated yet
+	size_t pending_count;
+	size_t pending_capacity;
+};
+
+// x86 register numbers of the guest registers. The word registers map ax..bx
+// to rax..rbx and sp..di to r8..r11; the byte registers keep their 8086
+// encoding, which is al..bh on x86-64 as long as no REX prefix is used.
+static const int8_t host_words[REG_COUNT] = {
+	[REG_NONE] = -1,
+	[REG_AX] = 0, [REG_BX] = 3, [REG_CX] = 1, [REG_DX] = 2,
+	[REG_SP] = 8, [REG_BP] = 9, [REG_SI] = 10, [REG_DI] = 11,
+	[REG_AH] = -1, [REG_BH] = -1, [REG_CH] = -1, [REG_DH] = -1,
+	[REG_AL] = -1, [REG_BL] = -1, [REG_CL] = -1, [REG_DL] = -1,
+	[REG_ES] = -1, [REG_CS] = -1, [REG_SS] = -1, [REG_DS] = -1,
+};
+
+static const int8_t host_bytes[REG_COUNT] = {
+	[REG_NONE] = -1,
+	[REG_AX] = -1, [REG_BX] = -1, [REG_CX] = -1, [REG_DX] = -1,
+	[REG_SP] = -1, [REG_BP] = -1, [REG_SI] = -1, [REG_DI] = -1,
+	[REG_AH] = 4, [REG_BH] = 7, [REG_CH] = 5, [REG_DH] = 6,
+	[REG_AL] = 0, [REG_BL] = 3, [REG_CL] = 1, [REG_DL] = 2,
+	[REG_ES] = -1, [REG_CS] = -1, [REG_SS] = -1, [REG_DS] = -1,
+};
+
+static int host_register(const operand_t *operand, uint8_t w_bit)
+{
+	if (operand->type != OPERAND_REGISTER)
+	{
+		return -1;
+	}
+	return w_bit ? host_words[operand->value.reg] : host_bytes[operand->value.reg];
+}
+
+// x86 condition code of each conditional jump, the low nibble of Jcc
+static int condition_code(operation_t op)
+{
+	switch (op)
+	{
+	case OP_JO:
+		return 0x0;
+	case OP_JNO:
+		return 0x1;
+	case OP_JB:
+		return 0x2;
+	case OP_JNB:
+		return 0x3;
+	case OP_JE:
+		return 0x4;
+	case OP_JNE:
+	case OP_JNZ:
+		return 0x5;
+	case OP_JBE:
+		return 0x6;
+	case OP_JA:
+		return 0x7;
+	case OP_JS:
+		return 0x8;
+	case OP_JNS:
+		return 0x9;
+	case OP_JP:
+		return 0xA;
+	case OP_JNP:
+		return 0xB;
+	case OP_JL:
+		return 0xC;
+	case OP_JNL:
+	case OP_JGE:
+		return 0xD;
+	case OP_JLE:
+		return 0xE;
+	case OP_JG:
+		return 0xF;
+	default:
+		return -1;
+	}
+}
+
+static bool is_block_end(operation_t op)
+{
+	return condition_code(op) >= 0 || op == OP_JMP || op == OP_JCXZ ||
+	       op == LOOP_LOOP || op == LOOP_LOOPZ || op == LOOP_LOOPNZ;
+}
+
+// Whether the body of a block can hold this instruction: mov/add/sub/cmp
+// into a register from a register or an immediate
+static bool is_translatable(const instruction_t *instr)
+{
+	if (instr->op != OP_MOV && instr->op != OP_ADD && instr->op != OP_SUB && instr->op != OP_CMP)
+	{
+		return false;
+	}
+	if (host_register(&instr->dest, instr->w_bit) < 0)
+	{
+		return false;
+	}
+	return instr->src.type == OPERAND_IMMEDIATE || host_register(&instr->src, instr->w_bit) >= 0;
+}
+
+// CODE EMISSION
+
+static inline void emit8(jit_t *jit, uint8_t value)
+{
+	jit->arena[jit->used++] = value;
+}
+
+static inline void emit16(jit_t *jit, uint16_t value)
+{
+	memcpy(jit->arena + jit->used, &value, sizeof(value));
+	jit->used += sizeof(value);
+}
+
+static inline void emit32(jit_t *jit, uint32_t value)
+{
+	memcpy(jit->arena + jit->used, &value, sizeof(value));
+	jit->used += sizeof(value);
+}
+
+static void patch_rel32(uint8_t *site, const uint8_t *target)
+{
+	int32_t rel = (int32_t)(target - (site + 4));
+	memcpy(site, &rel, sizeof(rel));
+}
+
+// [rex] op reg, [rdi + disp32] for the cpu_state_t field at `offset`
+static void emit_cpu_access(jit_t *jit, uint8_t prefix, uint8_t opcode, int reg, uint16_t offset)
+{
+	if (prefix)
+	{
+		emit8(jit, prefix);
+	}
+	if (reg & 8)
+	{
+		emit8(jit, 0x44);
+	}
+	if (opcode == 0xB7)
+	{
+		emit8(jit, 0x0F);
+	}
+	emit8(jit, opcode);
+	emit8(jit, 0x80 | ((reg & 7) << 3) | 7);
+	emit32(jit, offset);
+}
+
+// op dest, src between two registers. `opcode` is the byte form of the
+// r/m, reg encoding (00 add, 28 sub, 38 cmp, 88 mov); the word form is +1.
+static void emit_reg_reg(jit_t *jit, uint8_t opcode, int dest, int src, uint8_t w_bit)
+{
+	if (w_bit)
+	{
+		emit8(jit, 0x66);
+		if ((dest | src) & 8)
+		{
+			emit8(jit, 0x40 | ((src & 8) >> 1) | ((dest & 8) >> 3));
+		}
+		opcode |= 1;
+	}
+	emit8(jit, opcode);
+	emit8(jit, 0xC0 | ((src & 7) << 3) | (dest & 7));
+}
+
+// Group 1 op dest, imm with `digit` selecting add (0), sub (5) or cmp (7)
+static void emit_alu_imm(jit_t *jit, uint8_t digit, int dest, uint16_t imm, uint8_t w_bit)
+{
+	if (w_bit)
+	{
+		emit8(jit, 0x66);
+		if (dest & 8)
+		{
+			emit8(jit, 0x41);
+		}
+	}
+	emit8(jit, w_bit ? 0x81 : 0x80);
+	emit8(jit, 0xC0 | (digit << 3) | (dest & 7));
+	if (w_bit)
+	{
+		emit16(jit, imm);
+	}
+	else
+	{
+		emit8(jit, (uint8_t)imm);
+	}
+}
+
+static void emit_mov_imm(jit_t *jit, int dest, uint16_t imm, uint8_t w_bit)
+{
+	if (w_bit)
+	{
+		emit8(jit, 0x66);
+		if (dest & 8)
+		{
+			emit8(jit, 0x41);
+		}
+		emit8(jit, 0xB8 + (dest & 7));
+		emit16(jit, imm);
+	}
+	else
+	{
+		emit8(jit, 0xB0 + dest);
+		emit8(jit, (uint8_t)imm);
+	}
+}
+
+static void emit_instruction(jit_t *jit, const instruction_t *instr)
+{
+	static const uint8_t reg_opcodes[] = {[OP_MOV] = 0x88, [OP_ADD] = 0x00, [OP_SUB] = 0x28, [OP_CMP] = 0x38};
+	static const uint8_t imm_digits[] = {[OP_ADD] = 0, [OP_SUB] = 5, [OP_CMP] = 7};
+
+	int dest = host_register(&instr->dest, instr->w_bit);
+	if (instr->src.type == OPERAND_REGISTER)
+	{
+		emit_reg_reg(jit, reg_opcodes[instr->op], dest, host_register(&instr->src, instr->w_bit), instr->w_bit);
+	}
+	else if (instr->op == OP_MOV)
+	{
+		emit_mov_imm(jit, dest, (uint16_t)instr->src.value.immediate, instr->w_bit);
+	}
+	else
+	{
+		emit_alu_imm(jit, imm_digits[instr->op], dest, (uint16_t)instr->src.value.immediate, instr->w_bit);
+	}
+}
+
+// A jump out of the block: jmp rel32 when `cc` is negative, otherwise jcc
+// rel32. Where it lands is filled in once the block is complete.
+static void emit_exit(jit_t *jit, int cc, uint16_t target, jit_exit_t *exits, int *exit_count)
+{
+	if (cc < 0)
+	{
+		emit8(jit, 0xE9);
+	}
+	else
+	{
+		emit8(jit, 0x0F);
+		emit8(jit, 0x80 | cc);
+	}
+	exits[(*exit_count)++] = (jit_exit_t){jit->arena + jit->used, target};
+	emit32(jit, 0);
+}
+
+// loop/loopz/loopnz/jcxz. CX is decremented with lea and tested with jrcxz so
+// the guest flags held in the host flags survive.
+static void emit_loop(jit_t *jit, operation_t op, uint16_t taken, uint16_t next,
+		      jit_exit_t *exits, int *exit_count)
+{
+	if (op != OP_JCXZ)
+	{
+		emit8(jit, 0x8D); // lea ecx, [rcx - 1]
+		emit8(jit, 0x49);
+		emit8(jit, 0xFF);
+	}
+	emit8(jit, 0x0F); // movzx ecx, cx
+	emit8(jit, 0xB7);
+	emit8(jit, 0xC9);
+
+	if (op == OP_JCXZ)
+	{
+		emit8(jit, 0xE3); // jrcxz over the not-taken exit
+		emit8(jit, 5);
+		emit_exit(jit, -1, next, exits, exit_count);
+		emit_exit(jit, -1, taken, exits, exit_count);
+		return;
+	}
+
+	emit8(jit, 0xE3); // jrcxz to the not-taken exit
+	emit8(jit, op == LOOP_LOOP ? 5 : 11);
+	if (op == LOOP_LOOPZ)
+	{
+		emit_exit(jit, condition_code(OP_JNZ), next, exits, exit_count);
+	}
+	else if (op == LOOP_LOOPNZ)
+	{
+		emit_exit(jit, condition_code(OP_JE), next, exits, exit_count);
+	}
+	emit_exit(jit, -1, taken, exits, exit_count);
+	emit_exit(jit, -1, next, exits, exit_count);
+}
+
+// Entry: saves rbx, r12 and r13, takes the block budget into r12 and zeroes
+// the instruction count in r13, loads the arithmetic flags into the host
+// flags and the guest registers into their host registers, then jumps to the
+// block in rsi.
+// Exit: stores them all back, marks the flags as up to date, takes the
+// instructions run off the fuel and returns the guest instr_ptr left in esi.
+static void emit_stubs(jit_t *jit)
+{
+	uint16_t flags_offset = offsetof(cpu_state_t, flags);
+
+	jit->enter = (jit_entry_t)(jit->arena + jit->used);
+	emit8(jit, 0x53); // push rbx
+	emit8(jit, 0x41); // push r12
+	emit8(jit, 0x54);
+	emit8(jit, 0x41); // push r13
+	emit8(jit, 0x55);
+	emit8(jit, 0x49); // mov r12, rdx
+	emit8(jit, 0x89);
+	emit8(jit, 0xD4);
+	emit8(jit, 0x45); // xor r13d, r13d
+	emit8(jit, 0x31);
+	emit8(jit, 0xED);
+	emit_cpu_access(jit, 0, 0xB7, 0, flags_offset); // movzx eax, word [rdi + flags]
+	emit8(jit, 0x25); // and eax, FLAGS_ARITHMETIC
+	emit32(jit, FLAGS_ARITHMETIC);
+	emit8(jit, 0x50); // push rax
+	emit8(jit, 0x9D); // popfq
+	for (cpu_reg_t reg = REG_AX; reg <= REG_DI; reg++)
+	{
+		emit_cpu_access(jit, 0, 0xB7, host_words[reg], register_accessors[reg].offset);
+	}
+	emit8(jit, 0xFF); // jmp rsi
+	emit8(jit, 0xE6);
+
+	jit->exit_stub = jit->arena + jit->used;
+	for (cpu_reg_t reg = REG_AX; reg <= REG_DI; reg++)
+	{
+		emit_cpu_access(jit, 0x66, 0x89, host_words[reg], register_accessors[reg].offset);
+	}
+	emit8(jit, 0x9C); // pushfq
+	emit8(jit, 0x58); // pop rax
+	emit8(jit, 0x25); // and eax, FLAGS_ARITHMETIC
+	emit32(jit, FLAGS_ARITHMETIC);
+	emit_cpu_access(jit, 0, 0xB7, 2, flags_offset); // movzx edx, word [rdi + flags]
+	emit8(jit, 0x81); // and edx, ~FLAGS_ARITHMETIC
+	emit8(jit, 0xE2);
+	emit32(jit, (uint16_t)~FLAGS_ARITHMETIC);
+	emit8(jit, 0x09); // or eax, edx
+	emit8(jit, 0xD0);
+	emit_cpu_access(jit, 0x66, 0x89, 0, flags_offset); // mov [rdi + flags], ax
+	emit8(jit, 0xC6); // mov byte [rdi + lazy_flags.op], LAZY_FLAGS_NONE
+	emit8(jit, 0x87);
+	emit32(jit, offsetof(cpu_state_t, lazy_flags.op));
+	emit8(jit, LAZY_FLAGS_NONE);
+	emit8(jit, 0x4C); // sub [rdi + control.fuel], r13
+	emit8(jit, 0x29);
+	emit8(jit, 0xAF);
+	emit32(jit, offsetof(simulator_t, control.fuel));
+	emit8(jit, 0x89); // mov eax, esi
+	emit8(jit, 0xF0);
+	emit8(jit, 0x41); // pop r13
+	emit8(jit, 0x5D);
+	emit8(jit, 0x41); // pop r12
+	emit8(jit, 0x5C);
+	emit8(jit, 0x5B); // pop rbx
+	emit8(jit, 0xC3); // ret
+
+	jit->stubs_size = jit->used;
+}
+
+// Counts a block off the budget in r12, leaving for the exit stub with
+// instr_ptr at `start` once it is spent, and adds the block's instructions to
+// r13. xchg, jrcxz and lea keep the guest flags intact. Returns where the
+// instruction count goes, to be filled in once the block is translated.
+static uint8_t *emit_block_count(jit_t *jit, uint16_t start)
+{
+	static const uint8_t prologue[] = {
+		0x4C, 0x87, 0xE1,       // xchg rcx, r12
+		0xE3, 0x0D,             // jrcxz spent
+		0x48, 0x8D, 0x49, 0xFF, // lea rcx, [rcx - 1]
+		0x4C, 0x87, 0xE1,       // xchg rcx, r12
+		0x4D, 0x8D, 0x6D, 0x00, // lea r13, [r13 + count]
+		0xEB, 0x0D,             // jmp body
+		0x4C, 0x87, 0xE1,       // spent: xchg rcx, r12
+	};
+	uint8_t *code = jit->arena + jit->used;
+	memcpy(code, prologue, sizeof(prologue));
+	jit->used += sizeof(prologue);
+	emit8(jit, 0xBE); // mov esi, start
+	emit32(jit, start);
+	emit8(jit, 0xE9); // jmp exit_stub
+	emit32(jit, 0);
+	patch_rel32(jit->arena + jit->used - 4, jit->exit_stub);
+	return code + 15;
+}
+
+// TRANSLATION
+
+// Points a block exit at its target if that is translated, otherwise at a
+// trampoline that leaves translated code with the target in esi
+static bool link_exit(jit_t *jit, const jit_exit_t *exit)
+{
+	if (exit->target < jit->program_size && jit->blocks[exit->target])
+	{
+		patch_rel32(exit->site, jit->blocks[exit->target]);
+		return true;
+	}
+
+	patch_rel32(exit->site, jit->arena + jit->used);
+	emit8(jit, 0xBE); // mov esi, target
+	emit32(jit, exit->target);
+	emit8(jit, 0xE9); // jmp exit_stub
+	emit32(jit, 0);
+	patch_rel32(jit->arena + jit->used - 4, jit->exit_stub);
+
+	if (jit->pending_count == jit->pending_capacity)
+	{
+		size_t capacity = jit->pending_capacity ? jit->pending_capacity * 2 : 64;
+		jit_exit_t *pending = realloc(jit->pending, capacity * sizeof(jit_exit_t));
+		if (!pending)
+		{
+			// Stays on its trampoline, which is still correct
+			return false;
+		}
+		jit->pending = pending;
+		jit->pending_capacity = capacity;
+	}
+	jit->pending[jit->pending_count++] = *exit;
+	return false;
+}
+
+// Chains every exit still going through a trampoline to `ip` into the block
+// just translated there
+static void link_pending_exits(jit_t *jit, uint16_t ip)
+{
+	for (size_t i = 0; i < jit->pending_count;)
+	{
+		if (jit->pending[i].target == ip)
+		{
+			patch_rel32(jit->pending[i].site, jit->blocks[ip]);
+			jit->pending[i] = jit->pending[--jit->pending_count];
+		}
+		else
+		{
+			i++;
+		}
+	}
+}
+
+// Translates the block starting at `start`. Returns NULL if its first
+// instruction cannot be translated or is a breakpoint.
+static uint8_t *translate_block(simulator_t *simulator, jit_t *jit, uint16_t start)
+{
+	if (is_breakpoint(simulator, start))
+	{
+		return NULL;
+	}
+	if (JIT_ARENA_SIZE - jit->used < JIT_BLOCK_SPACE)
+	{
+		jit_flush(jit);
+	}
+
+	uint8_t *code = jit->arena + jit->used;
+	uint8_t *count_site = jit->counted ? emit_block_count(jit, start) : NULL;
+	jit_exit_t exits[JIT_MAX_BLOCK_EXITS];
+	int exit_count = 0;
+	int executed = 0;
+	uint16_t saved_ip = simulator->cpu.instr_ptr;
+	uint16_t ip = start;
+	for (int count = 0;; count++)
+	{
+		executed = count;
+		if (ip >= simulator->program_size - 1 || count == JIT_MAX_BLOCK_INSTRUCTIONS ||
+		    (count > 0 && is_breakpoint(simulator, ip)))
+		{
+			emit_exit(jit, -1, ip, exits, &exit_count);
+			break;
+		}
+
+		simulator->cpu.instr_ptr = ip;
+		const instruction_t *instr = &fetch_instruction(simulator)->instruction;
+		uint16_t next = simulator->cpu.instr_ptr;
+		uint16_t taken = next + instr->dest.value.immediate;
+		if (is_translatable(instr))
+		{
+			emit_instruction(jit, instr);
+			ip = next;
+			continue;
+		}
+
+		int cc = condition_code(instr->op);
+		if (cc >= 0)
+		{
+			emit_exit(jit, cc, taken, exits, &exit_count);
+			emit_exit(jit, -1, next, exits, &exit_count);
+			executed++;
+		}
+		else if (instr->op == OP_JCXZ || instr->op == LOOP_LOOP ||
+			 instr->op == LOOP_LOOPZ || instr->op == LOOP_LOOPNZ)
+		{
+			emit_loop(jit, instr->op, taken, next, exits, &exit_count);
+			executed++;
+		}
+		else if (count > 0)
+		{
+			// Leave it to the interpreter
+			emit_exit(jit, -1, ip, exits, &exit_count);
+		}
+		else
+		{
+			jit->used = code - jit->arena;
+			simulator->cpu.instr_ptr = saved_ip;
+			return NULL;
+		}
+		break;
+	}
+	simulator->cpu.instr_ptr = saved_ip;
+
+	if (count_site)
+	{
+		*count_site = (uint8_t)executed;
+	}
+	jit->blocks[start] = code;
+	for (int i = 0; i < exit_count; i++)
+	{
+		link_exit(jit, &exits[i]);
+	}
+	link_pending_exits(jit, start);
+	return code;
+}
+
+// Runs instructions on the interpreter up to the end of the current block,
+// or past one the translator cannot handle, so the next instr_ptr is where a
+// block could start. Returns true if a run control stopped it.
+static bool interpret_block(simulator_t *simulator)
+{
+	while (simulator->cpu.instr_ptr < simulator->program_size - 1)
+	{
+		if (run_control_consume(simulator, is_breakpoint(simulator, simulator->cpu.instr_ptr)))
+		{
+			return true;
+		}
+		const instruction_t *instr = &fetch_instruction(simulator)->instruction;
+		eval_instruction(instr, simulator);
+		if (is_block_end(instr->op) || !is_translatable(instr))
+		{
+			return false;
+		}
+	}
+	return false;
+}
+
+// SETUP
+
+static bool protect_arena(jit_t *jit, int protection)
+{
+	if (mprotect(jit->arena, JIT_ARENA_SIZE, protection) != 0)
+	{
+		fprintf(stderr, "Error: Could not change the protection of the JIT code arena, interpreting instead\n");
+		return false;
+	}
+	return true;
+}
+
+// Translates a block with the arena writable and makes it executable again.
+// If either switch fails, the rest of the run is interpreted.
+static uint8_t *translate_writable(simulator_t *simulator, jit_t *jit, uint16_t start)
+{
+	if (!protect_arena(jit, PROT_READ | PROT_WRITE))
+	{
+		jit->disabled = true;
+		return NULL;
+	}
+	uint8_t *block = translate_block(simulator, jit, start);
+	if (!protect_arena(jit, PROT_READ | PROT_EXEC))
+	{
+		jit->disabled = true;
+		return NULL;
+	}
+	return block;
+}
+
+static void jit_destroy(jit_t *jit)
+{
+	munmap(jit->arena, JIT_ARENA_SIZE);
+	free(jit->blocks);
+	free(jit->counts);
+	free(jit->pending);
+	free(jit);
+}
+
+static jit_t *jit_create(size_t program_size)
+{
+	jit_t *jit = calloc(1, sizeof(jit_t));
+	if (!jit)
+	{
+		return NULL;
+	}
+	jit->program_size = program_size;
+	jit->blocks = calloc(program_size, sizeof(uint8_t *));
+	jit->counts = calloc(program_size, sizeof(uint16_t));
+	void *arena = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (!jit->blocks || !jit->counts || arena == MAP_FAILED)
+	{
+		fprintf(stderr, "Error: Could not allocate JIT code arena, interpreting instead\n");
+		if (arena != MAP_FAILED)
+		{
+			munmap(arena, JIT_ARENA_SIZE);
+		}
+		free(jit->blocks);
+		free(jit->counts);
+		free(jit);
+		return NULL;
+	}
+	jit->arena = arena;
+	emit_stubs(jit);
+	if (!protect_arena(jit, PROT_READ | PROT_EXEC))
+	{
+		jit_destroy(jit);
+		return NULL;
+	}
+	return jit;
+}
+
+// Throws away every translated block. Used when the arena is full and when
+// the program stores into its own code.
+void jit_flush(jit_t *jit)
+{
+	jit->used = jit->stubs_size;
+	jit->pending_count = 0;
+	memset(jit->blocks, 0, jit->program_size * sizeof(uint8_t *));
+	memset(jit->counts, 0, jit->program_size * sizeof(uint16_t));
+}
+
+void run_simulation_jit(simulator_t *simulator)
+{
+	if (is_tracing(simulator) || simulator->trace || simulator->count_cycles || simulator->profile)
+	{
+		run_simulation(simulator);
+		return;
+	}
+	jit_t *jit = jit_create(simulator->program_size);
+	if (!jit)
+	{
+		run_simulation(simulator);
+		return;
+	}
+	if (!init_decode_cache(simulator))
+	{
+		jit_destroy(jit);
+		return;
+	}
+	simulator->jit = jit;
+	run_control_t *control = &simulator->control;
+	run_control_start(simulator);
+	jit->counted = control->max_instructions || control->breakpoints;
+
+	cpu_state_t *cpu = &simulator->cpu;
+	while (cpu->instr_ptr < simulator->program_size - 1)
+	{
+		uint16_t ip = cpu->instr_ptr;
+		uint8_t *block = jit->disabled ? NULL : jit->blocks[ip];
+		if (!block && !jit->disabled && jit->counts[ip] != JIT_NEVER && ++jit->counts[ip] >= JIT_HOT_THRESHOLD)
+		{
+			block = translate_writable(simulator, jit, ip);
+			if (!block)
+			{
+				jit->counts[ip] = JIT_NEVER;
+			}
+		}
+
+		// Each block entered can use up to a full block of fuel
+		uint64_t budget = control->fuel / JIT_MAX_BLOCK_INSTRUCTIONS;
+		if (block && budget > 0)
+		{
+			materialize_flags(simulator);
+			cpu->instr_ptr = jit->enter(cpu, block, budget);
+		}
+		else if (interpret_block(simulator))
+		{
+			break;
+		}
+	}
+
+	if (simulator->verbosity != VERBOSITY_SILENT)
+	{
+		format_cpu_state(simulator);
+		format_memory_state(simulator);
+	}
+	output_flush(&simulator->output);
+	simulator->jit = NULL;
+	jit_destroy(jit);
+	free_decode_cache(simulator);
+}
+
+#else
+
+// No code generator for this host
+void jit_flush(jit_t *jit)
+{
+	(void)jit;
+}
+
+void run_simulation_jit(simulator_t *simulator)
+{
+	run_simulation(simulator);
+}
+
+#endif
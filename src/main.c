@@ -7,34 +7,245 @@
 #include "simulator.h"
 
 int main(int argc, char *argv[]) {
-	if (argc < 2) {
-		printf("Usage: %s <file_path>\n", argv[0]);
+	const char *file_path = NULL;
+	char *inputs[argc];
+	int input_count = 0;
+	engine_t engine = ENGINE_INTERPRETER;
+	bool batch = false;
+	int workers = 0;
+	const char *output_dir = NULL;
+	bool cycles = false;
+	bool profile = false;
+	bool disasm = false;
+	verbosity_t verbosity = VERBOSITY_TRACE;
+	const char *trace_path = NULL;
+	uint32_t load_address = DEFAULT_LOAD_ADDRESS;
+	const char *load_snapshot_path = NULL;
+	const char *save_snapshot_path = NULL;
+	uint64_t snapshot_instructions = UINT64_MAX;
+	int32_t snapshot_ip = -1;
+	uint64_t max_instructions = 0;
+	uint64_t max_cycles = 0;
+	uint8_t *breakpoints = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--threaded") == 0) {
+			engine = ENGINE_THREADED;
+		} else if (strcmp(argv[i], "--jit") == 0) {
+			engine = ENGINE_JIT;
+		} else if (strcmp(argv[i], "--batch") == 0) {
+			batch = true;
+		} else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+			workers = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--output-dir") == 0 && i + 1 < argc) {
+			output_dir = argv[++i];
+		} else if (strcmp(argv[i], "--cycles") == 0) {
+			cycles = true;
+		} else if (strcmp(argv[i], "--profile") == 0) {
+			profile = true;
+		} else if (strcmp(argv[i], "--disasm") == 0) {
+			disasm = true;
+		} else if (strcmp(argv[i], "--binary-trace") == 0 && i + 1 < argc) {
+			trace_path = argv[++i];
+		} else if (strcmp(argv[i], "--load-address") == 0 && i + 1 < argc) {
+			load_address = (uint32_t)strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--load-snapshot") == 0 && i + 1 < argc) {
+			load_snapshot_path = argv[++i];
+		} else if (strcmp(argv[i], "--save-snapshot") == 0 && i + 1 < argc) {
+			save_snapshot_path = argv[++i];
+		} else if (strcmp(argv[i], "--snapshot-at") == 0 && i + 1 < argc) {
+			snapshot_instructions = strtoull(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--snapshot-at-ip") == 0 && i + 1 < argc) {
+			snapshot_ip = (int32_t)(strtoul(argv[++i], NULL, 0) & 0xFFFF);
+		} else if (strcmp(argv[i], "--max-instructions") == 0 && i + 1 < argc) {
+			max_instructions = strtoull(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--max-cycles") == 0 && i + 1 < argc) {
+			max_cycles = strtoull(argv[++i], NULL, 0);
+		} else if ((strcmp(argv[i], "--break") == 0 || strcmp(argv[i], "--until") == 0) && i + 1 < argc) {
+			if (!breakpoints && !(breakpoints = calloc(RUN_BREAKPOINT_COUNT, 1))) {
+				fprintf(stderr, "Error: Could not allocate breakpoints\n");
+				return 1;
+			}
+			breakpoints[strtoul(argv[++i], NULL, 0) & 0xFFFF] = 1;
+		} else if (strcmp(argv[i], "--quiet") == 0) {
+			verbosity = VERBOSITY_FINAL;
+		} else if (strcmp(argv[i], "--silent") == 0) {
+			verbosity = VERBOSITY_SILENT;
+		} else {
+			file_path = argv[i];
+			inputs[input_count++] = argv[i];
+		}
+	}
+
+	if (!file_path && !load_snapshot_path) {
+		printf("Usage: %s [--threaded | --jit] [--quiet | --silent] [--cycles] [--profile] [--binary-trace <trace_path>] [--load-address <address>]\n"
+		       "          [--max-instructions <count>] [--max-cycles <count>] [--break <ip>]... [--until <ip>]\n"
+		       "          [--save-snapshot <path> [--snapshot-at <count>] [--snapshot-at-ip <address>]] <file_path | --load-snapshot <path>>\n", argv[0]);
+		printf("       %s --batch [--jobs <n>] [--output-dir <dir>] [--threaded | --jit] [--quiet | --silent] [--cycles] [--profile] [--load-address <address>]\n"
+		       "          [--max-instructions <count>] [--max-cycles <count>] <file_or_dir>...\n", argv[0]);
+		printf("       %s --disasm [--jobs <n>] <file_path>\n", argv[0]);
+		free(breakpoints);
 		return 1;
 	}
 
-	// Get the file path from the arguments
-	const char *file_path = argv[1];
-	size_t bin_size;
-	byte_t *bin_buffer = read_binary_file(file_path, &bin_size);
-	if (!bin_buffer){
-		return 0;
+	// Cycle limits are checked against the cycle count
+	if (max_cycles) {
+		cycles = true;
 	}
 
-	decoder_t decoder = {
-		.bin_buffer = bin_buffer,
-	};
+	bool snapshots = load_snapshot_path || save_snapshot_path;
+	if (disasm) {
+		if (batch || snapshots || !file_path) {
+			fprintf(stderr, "Error: --disasm takes one file and cannot be used with --batch or snapshots\n");
+			free(breakpoints);
+			return 1;
+		}
+		free(breakpoints);
+		output_sink_t out;
+		if (!output_init(&out, OUTPUT_STDOUT, NULL, DISASM_OUTPUT_SIZE)) {
+			return 1;
+		}
+		int result = disassemble_file(file_path, workers, &out);
+		if (!output_free(&out)) {
+			result = 1;
+		}
+		return result;
+	}
 
+	if (batch) {
+		if (trace_path || snapshots || breakpoints) {
+			fprintf(stderr, "Error: --binary-trace, snapshots and breakpoints cannot be used with --batch\n");
+			free(breakpoints);
+			return 1;
+		}
+		batch_options_t options = {
+				.engine = engine,
+				.verbosity = verbosity,
+				.count_cycles = cycles,
+				.profile = profile,
+				.load_address = load_address,
+				.max_instructions = max_instructions,
+				.max_cycles = max_cycles,
+				.workers = workers,
+				.output_dir = output_dir,
+		};
+		return run_batch(&options, inputs, input_count);
+	}
+
+	if (trace_path && snapshots) {
+		fprintf(stderr, "Error: --binary-trace cannot be used with snapshots\n");
+		free(breakpoints);
+		return 1;
+	}
+	// Without a count or address the snapshot is taken before the first instruction
+	if (snapshot_ip < 0 && snapshot_instructions == UINT64_MAX) {
+		snapshot_instructions = 0;
+	}
+
+	// The binary trace replaces the per-instruction text, which can be
+	// rendered later with trace_format
+	trace_writer_t *trace = NULL;
+	if (trace_path) {
+		trace = trace_open(trace_path);
+		if (!trace) {
+			free(breakpoints);
+			return 1;
+		}
+		if (verbosity == VERBOSITY_TRACE) {
+			verbosity = VERBOSITY_FINAL;
+		}
+	}
+
+	decoder_t decoder = {};
 	simulator_t simulator = {
-			.cpu = {
-				.flags = 0,
-				.instr_ptr = 0
-			},
 			.decoder = &decoder,
-			.program_size = bin_size,
+			.verbosity = verbosity,
+			.trace = trace,
+			.count_cycles = cycles,
+			.control = {
+					.max_instructions = max_instructions,
+					.max_cycles = max_cycles,
+					.breakpoints = breakpoints,
+			},
 	};
 
-	run_simulation(&simulator);
-	free(bin_buffer);
+	if (!memory_init(&simulator.memory)) {
+		trace_close(trace);
+		free(breakpoints);
+		return 1;
+	}
+	// A loaded snapshot stands in for the program and everything it did up
+	// to the snapshot
+	snapshot_t *start = NULL;
+	if (load_snapshot_path) {
+		start = snapshot_read(load_snapshot_path);
+		if (!start) {
+			memory_free(&simulator.memory);
+			free(breakpoints);
+			return 1;
+		}
+		snapshot_restore(&simulator, start);
+	} else if (!load_program(&simulator, file_path, load_address)) {
+		memory_free(&simulator.memory);
+		trace_close(trace);
+		free(breakpoints);
+		return 1;
+	}
+	if (!output_init(&simulator.output, OUTPUT_STDOUT, NULL, OUTPUT_BUFFER_SIZE)) {
+		memory_free(&simulator.memory);
+		trace_close(trace);
+		free(breakpoints);
+		return 1;
+	}
+	if (profile) {
+		simulator.profile = profile_create(simulator.program_size);
+		if (!simulator.profile) {
+			output_free(&simulator.output);
+			memory_free(&simulator.memory);
+			snapshot_free(start);
+			trace_close(trace);
+			free(breakpoints);
+			return 1;
+		}
+	}
+
+	// The instructions before the snapshot run on the interpreter, and the
+	// rest of the run carries on from it as usual
+	bool saved = true;
+	if (save_snapshot_path) {
+		snapshot_t *snapshot = NULL;
+		if (run_to_instruction(&simulator, snapshot_instructions, snapshot_ip)) {
+			snapshot = snapshot_take(&simulator);
+		} else {
+			fprintf(stderr, "Error: The program ended before reaching the snapshot point\n");
+		}
+		saved = snapshot && snapshot_write(snapshot, save_snapshot_path);
+		snapshot_free(snapshot);
+	}
+
+	run_engine(&simulator, engine);
+	bool written = output_free(&simulator.output);
+	profile_free(simulator.profile);
+	memory_free(&simulator.memory);
+	snapshot_free(start);
+	free(breakpoints);
+	if (!written) {
+		fprintf(stderr, "Error: Could not write all of the output\n");
+	}
+	if (!trace_close(trace) || !saved || !written) {
+		return 1;
+	}
+
+	// A run cut short by a limit or breakpoint always says so, since its
+	// output is not the program's final state
+	const char *stopped = stop_reason(simulator.status);
+	if (stopped) {
+		fprintf(stderr, "Stopped at 0x%04X: %s\n", simulator.cpu.instr_ptr, stopped);
+		return simulator.status;
+	}
+	// Silent runs have no output to inspect, so report how the run ended
+	if (verbosity == VERBOSITY_SILENT) {
+		return simulator.status;
+	}
 	return 0;
 }
 
@@ -0,0 +1,270 @@
+#include "simulator.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// OUTPUT SINK
+//
+// All simulator text goes through an output_sink_t. File-backed sinks collect
+// text in their buffer and hand it to the FILE in large writes; memory sinks
+// grow their buffer and keep everything; discard sinks drop text before it is
+// formatted. A zeroed sink writes straight to stdout without buffering.
+//
+// Writing never reports errors itself. A write or allocation that loses text
+// sets `failed`, which stays set, and output_flush and output_free report it,
+// so a run can fail at the end instead of checking every line.
+
+bool output_init(output_sink_t *out, output_backend_t backend, FILE *file, size_t buffer_size)
+{
+	*out = (output_sink_t){
+		.backend = backend,
+		.file = backend == OUTPUT_STDOUT ? stdout : file,
+	};
+	if (backend == OUTPUT_DISCARD || buffer_size == 0)
+	{
+		return true;
+	}
+
+	out->buffer = malloc(buffer_size);
+	if (!out->buffer)
+	{
+		fprintf(stderr, "Error: Could not allocate output buffer (%zu bytes)\n", buffer_size);
+		return false;
+	}
+	out->capacity = buffer_size;
+	return true;
+}
+
+bool output_free(output_sink_t *out)
+{
+	bool ok = output_flush(out);
+	if (out->file && fflush(out->file) != 0)
+	{
+		ok = false;
+	}
+	free(out->buffer);
+	out->buffer = NULL;
+	out->length = 0;
+	out->capacity = 0;
+	return ok;
+}
+
+bool output_flush(output_sink_t *out)
+{
+	if (out->backend == OUTPUT_MEMORY || out->length == 0)
+	{
+		return !out->failed;
+	}
+	size_t length = out->length;
+	out->length = 0;
+	if (fwrite(out->buffer, 1, length, out->file) != length)
+	{
+		out->failed = true;
+	}
+	return !out->failed;
+}
+
+// Makes room for at least `needed` more bytes, flushing file-backed sinks
+// before growing the buffer.
+static bool output_reserve(output_sink_t *out, size_t needed)
+{
+	if (out->backend != OUTPUT_MEMORY)
+	{
+		output_flush(out);
+	}
+	if (out->capacity - out->length >= needed)
+	{
+		return true;
+	}
+
+	size_t capacity = out->capacity * 2;
+	while (capacity - out->length < needed)
+	{
+		capacity *= 2;
+	}
+	char *buffer = realloc(out->buffer, capacity);
+	if (!buffer)
+	{
+		fprintf(stderr, "Error: Could not grow output buffer to %zu bytes\n", capacity);
+		out->failed = true;
+		return false;
+	}
+	out->buffer = buffer;
+	out->capacity = capacity;
+	return true;
+}
+
+void output_write(output_sink_t *out, const char *text, size_t length)
+{
+	if (out->backend == OUTPUT_DISCARD)
+	{
+		return;
+	}
+	if (!out->buffer)
+	{
+		if (fwrite(text, 1, length, out->file ? out->file : stdout) != length)
+		{
+			out->failed = true;
+		}
+		return;
+	}
+	if (out->capacity - out->length < length && !output_reserve(out, length))
+	{
+		return;
+	}
+	memcpy(out->buffer + out->length, text, length);
+	out->length += length;
+}
+
+void output_printf(output_sink_t *out, const char *format, ...)
+{
+	if (out->backend == OUTPUT_DISCARD)
+	{
+		return;
+	}
+
+	va_list args;
+	va_start(args, format);
+	if (!out->buffer)
+	{
+		if (vfprintf(out->file ? out->file : stdout, format, args) < 0)
+		{
+			out->failed = true;
+		}
+		va_end(args);
+		return;
+	}
+
+	size_t available = out->capacity - out->length;
+	int needed = vsnprintf(out->buffer + out->length, available, format, args);
+	va_end(args);
+	if (needed < 0)
+	{
+		out->failed = true;
+		return;
+	}
+
+	// Didn't fit: make room and format again
+	if ((size_t)needed >= available)
+	{
+		if (!output_reserve(out, (size_t)needed + 1))
+		{
+			return;
+		}
+		va_start(args, format);
+		vsnprintf(out->buffer + out->length, out->capacity - out->length, format, args);
+		va_end(args);
+	}
+	out->length += (size_t)needed;
+}
+
+// ORDERED OUTPUT
+//
+// The batch runner and the disassembler both split their work into numbered
+// items for a pool of threads and print the results in item order. Each
+// worker writes an item into its own memory sink, hands the text over and
+// keeps the grown buffer for its next item; whoever finishes the item next in
+// line writes it, and every finished item after it, under the lock.
+
+bool ordered_init(ordered_output_t *order, size_t count, ordered_write_t write, void *context)
+{
+	order->count = count;
+	order->next_output = 0;
+	order->write = write;
+	order->context = context;
+	atomic_init(&order->next_item, 0);
+	pthread_mutex_init(&order->lock, NULL);
+	order->items = calloc(count ? count : 1, sizeof(ordered_item_t));
+	return order->items != NULL;
+}
+
+static void write_item(ordered_output_t *order, size_t index)
+{
+	ordered_item_t *item = &order->items[index];
+	if (item->text)
+	{
+		order->write(order->context, index, item->text, item->length);
+		free(item->text);
+		item->text = NULL;
+	}
+}
+
+// Writes whatever is still held back behind an item that never finished
+void ordered_free(ordered_output_t *order)
+{
+	if (order->items)
+	{
+		for (size_t i = order->next_output; i < order->count; i++)
+		{
+			write_item(order, i);
+		}
+	}
+	free(order->items);
+	order->items = NULL;
+	pthread_mutex_destroy(&order->lock);
+}
+
+// Runs worker(arg) on up to `workers` threads, or on this one when none can
+// start, and waits for them. Each run starts claiming from the first item.
+// Returns false when some item was never claimed because no worker could set
+// up.
+bool ordered_run(ordered_output_t *order, long workers, void *(*worker)(void *), void *arg)
+{
+	atomic_store(&order->next_item, 0);
+	pthread_t *threads = calloc((size_t)workers, sizeof(pthread_t));
+	long started = 0;
+	while (threads && started < workers && pthread_create(&threads[started], NULL, worker, arg) == 0)
+	{
+		started++;
+	}
+	if (started == 0)
+	{
+		worker(arg);
+	}
+	for (long i = 0; i < started; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	return atomic_load(&order->next_item) >= order->count;
+}
+
+// Claims the next item. Returns false once every item is taken.
+bool ordered_claim(ordered_output_t *order, size_t *index)
+{
+	*index = atomic_fetch_add(&order->next_item, 1);
+	return *index < order->count;
+}
+
+// Marks an item done, taking the text in a memory sink unless out is NULL,
+// and writes every finished item that is next in line. The sink is emptied
+// but keeps its buffer. Returns false when the text could not be kept.
+bool ordered_finish(ordered_output_t *order, size_t index, output_sink_t *out)
+{
+	ordered_item_t *item = &order->items[index];
+	bool kept = true;
+	if (out)
+	{
+		item->text = malloc(out->length ? out->length : 1);
+		kept = item->text != NULL;
+		if (kept)
+		{
+			memcpy(item->text, out->buffer, out->length);
+			item->length = out->length;
+		}
+		out->length = 0;
+	}
+
+	pthread_mutex_lock(&order->lock);
+	item->done = true;
+	while (order->next_output < order->count && order->items[order->next_output].done)
+	{
+		write_item(order, order->next_output++);
+	}
+	pthread_mutex_unlock(&order->lock);
+	return kept;
+}
@@ -0,0 +1,197 @@
+#include "simulator.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// EXECUTION PROFILER
+//
+// With --profile the engines count every instruction they execute into the
+// flat arrays of a profile_t (see profile_instruction). The report written
+// at exit ranks the hottest addresses, lists how each jump and loop went,
+// finds hot loops from their back edges, checks returns against a shadow
+// stack of return addresses and breaks the run down by operation.
+
+profile_t *profile_create(size_t program_size)
+{
+	profile_t *profile = calloc(1, sizeof(profile_t));
+	if (!profile)
+	{
+		fprintf(stderr, "Error: Could not allocate profile\n");
+		return NULL;
+	}
+	profile->program_size = program_size;
+	profile->hits = calloc(program_size, sizeof(uint64_t));
+	profile->taken = calloc(program_size, sizeof(uint64_t));
+	profile->not_taken = calloc(program_size, sizeof(uint64_t));
+	if (!profile->hits || !profile->taken || !profile->not_taken)
+	{
+		fprintf(stderr, "Error: Could not allocate profile counters (%zu entries)\n", program_size);
+		profile_free(profile);
+		return NULL;
+	}
+	return profile;
+}
+
+void profile_free(profile_t *profile)
+{
+	if (!profile)
+	{
+		return;
+	}
+	free(profile->hits);
+	free(profile->taken);
+	free(profile->not_taken);
+	free(profile);
+}
+
+typedef struct ProfileEntry {
+	uint64_t count;
+	uint16_t ip;
+	uint16_t target; // Loop start, for back edges
+} profile_entry_t;
+
+// Highest count first, then lowest address
+static int compare_entries(const void *a, const void *b)
+{
+	const profile_entry_t *left = a;
+	const profile_entry_t *right = b;
+	if (left->count != right->count)
+	{
+		return left->count < right->count ? 1 : -1;
+	}
+	return (int)left->ip - (int)right->ip;
+}
+
+static double percent(uint64_t count, uint64_t total)
+{
+	return total ? 100.0 * (double)count / (double)total : 0.0;
+}
+
+// The instruction at ip as the decoder last saw it. Code the program
+// overwrote after running it has no cached decode left.
+static void format_profiled_instruction(simulator_t *simulator, uint16_t ip)
+{
+	const decoded_instruction_t *decoded = &simulator->decode_cache[ip];
+	if (decoded->is_decoded)
+	{
+		format_instruction(&simulator->output, &decoded->instruction);
+	}
+	else
+	{
+		output_printf(&simulator->output, "(code modified)");
+	}
+	output_write(&simulator->output, "\n", 1);
+}
+
+// Where the jump or loop at ip goes when it branches
+static uint16_t branch_target(const simulator_t *simulator, uint16_t ip)
+{
+	const decoded_instruction_t *decoded = &simulator->decode_cache[ip];
+	const instruction_t *instr = &decoded->instruction;
+	if (instr->op == OP_JMP)
+	{
+		return (uint16_t)instr->dest.value.immediate;
+	}
+	return (uint16_t)(ip + decoded->length + instr->dest.value.immediate);
+}
+
+void format_profile(simulator_t *simulator)
+{
+	const profile_t *profile = simulator->profile;
+	output_sink_t *out = &simulator->output;
+	profile_entry_t *entries = malloc(profile->program_size * sizeof(profile_entry_t));
+	if (!entries)
+	{
+		fprintf(stderr, "Error: Could not allocate profile report\n");
+		return;
+	}
+
+	uint64_t total = 0;
+	for (size_t op = 0; op <= LOOP_LOOPNZ; op++)
+	{
+		total += profile->operations[op];
+	}
+	output_printf(out, "Profile\n");
+	output_printf(out, "  instructions: %llu\n", (unsigned long long)total);
+
+	size_t count = 0;
+	for (size_t ip = 0; ip < profile->program_size; ip++)
+	{
+		if (profile->hits[ip])
+		{
+			entries[count++] = (profile_entry_t){.count = profile->hits[ip], .ip = (uint16_t)ip};
+		}
+	}
+	qsort(entries, count, sizeof(profile_entry_t), compare_entries);
+	output_printf(out, "Hot addresses\n");
+	for (size_t i = 0; i < count && i < PROFILE_TOP_ADDRESSES; i++)
+	{
+		output_printf(out, "  0x%04X: %llu (%.2f%%) ", entries[i].ip,
+			      (unsigned long long)entries[i].count, percent(entries[i].count, total));
+		format_profiled_instruction(simulator, entries[i].ip);
+	}
+
+	// Every jump and loop, in address order, and the back edges among them
+	output_printf(out, "Branches\n");
+	count = 0;
+	for (size_t ip = 0; ip < profile->program_size; ip++)
+	{
+		if (!profile->taken[ip] && !profile->not_taken[ip])
+		{
+			continue;
+		}
+		output_printf(out, "  0x%04X: taken %llu, not taken %llu ", (unsigned)ip,
+			      (unsigned long long)profile->taken[ip], (unsigned long long)profile->not_taken[ip]);
+		format_profiled_instruction(simulator, (uint16_t)ip);
+
+		if (profile->taken[ip] && simulator->decode_cache[ip].is_decoded)
+		{
+			uint16_t target = branch_target(simulator, (uint16_t)ip);
+			if (target <= ip)
+			{
+				entries[count++] = (profile_entry_t){profile->taken[ip], (uint16_t)ip, target};
+			}
+		}
+	}
+
+	// A taken branch back to an earlier address closes a loop; the number
+	// of times it was taken is how often the loop went round
+	qsort(entries, count, sizeof(profile_entry_t), compare_entries);
+	output_printf(out, "Hot loops\n");
+	for (size_t i = 0; i < count && i < PROFILE_TOP_LOOPS; i++)
+	{
+		output_printf(out, "  0x%04X-0x%04X: %llu back edges\n", entries[i].target, entries[i].ip,
+			      (unsigned long long)entries[i].count);
+	}
+
+	// A ret the shadow stack mispredicts went somewhere other than just past
+	// its call: the program changed its return address, returned more than it
+	// called or nested calls deeper than the shadow stack holds
+	uint64_t returns = profile->operations[OP_RET];
+	if (profile->operations[OP_CALL] || returns)
+	{
+		output_printf(out, "Returns\n");
+		output_printf(out, "  calls: %llu, returns: %llu, mispredicted: %llu (%.2f%%)\n",
+			      (unsigned long long)profile->operations[OP_CALL], (unsigned long long)returns,
+			      (unsigned long long)profile->mispredicted_returns,
+			      percent(profile->mispredicted_returns, returns));
+	}
+
+	count = 0;
+	for (size_t op = 0; op <= LOOP_LOOPNZ; op++)
+	{
+		if (profile->operations[op])
+		{
+			entries[count++] = (profile_entry_t){.count = profile->operations[op], .ip = (uint16_t)op};
+		}
+	}
+	qsort(entries, count, sizeof(profile_entry_t), compare_entries);
+	output_printf(out, "Operations\n");
+	for (size_t i = 0; i < count; i++)
+	{
+		output_printf(out, "  %s: %llu (%.2f%%)\n", op_names[entries[i].ip],
+			      (unsigned long long)entries[i].count, percent(entries[i].count, total));
+	}
+
+	free(entries);
+}
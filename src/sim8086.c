@@ -0,0 +1,272 @@
+#include "sim8086.h"
+#include "simulator.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// LIBRARY API
+//
+// Wraps a simulator_t and its decoder in an opaque handle. Everything a run
+// touches hangs off the handle, so instances share nothing.
+
+// Memory sinks start small and grow, since an embedder may keep many
+// instances around
+#define SIM8086_MEMORY_OUTPUT_SIZE (64 << 10)
+
+_Static_assert((int)SIM8086_VERBOSITY_TRACE == (int)VERBOSITY_TRACE &&
+		       (int)SIM8086_VERBOSITY_FINAL == (int)VERBOSITY_FINAL &&
+		       (int)SIM8086_VERBOSITY_SILENT == (int)VERBOSITY_SILENT,
+	       "library verbosity must match verbosity_t");
+_Static_assert((int)SIM8086_OK == (int)SIMULATION_OK &&
+		       (int)SIM8086_UNHANDLED_INSTRUCTION == (int)SIMULATION_UNHANDLED_INSTRUCTION &&
+		       (int)SIM8086_INSTRUCTION_LIMIT == (int)SIMULATION_INSTRUCTION_LIMIT &&
+		       (int)SIM8086_CYCLE_LIMIT == (int)SIMULATION_CYCLE_LIMIT &&
+		       (int)SIM8086_BREAKPOINT == (int)SIMULATION_BREAKPOINT,
+	       "library status must match simulation_status_t");
+_Static_assert((int)SIM8086_ENGINE_INTERPRETER == (int)ENGINE_INTERPRETER &&
+		       (int)SIM8086_ENGINE_THREADED == (int)ENGINE_THREADED &&
+		       (int)SIM8086_ENGINE_JIT == (int)ENGINE_JIT,
+	       "library engines must match engine_t");
+
+struct Sim8086Snapshot {
+	snapshot_t *snapshot;
+};
+
+struct Sim8086 {
+	simulator_t simulator;
+	decoder_t decoder;
+	sim8086_engine_t engine;
+	bool loaded;
+};
+
+sim8086_t *sim8086_create(const sim8086_options_t *options)
+{
+	sim8086_options_t defaults = {0};
+	if (!options)
+	{
+		options = &defaults;
+	}
+
+	sim8086_t *sim = calloc(1, sizeof(sim8086_t));
+	if (!sim)
+	{
+		fprintf(stderr, "Error: Could not allocate simulator\n");
+		return NULL;
+	}
+	sim->engine = options->engine;
+	simulator_t *simulator = &sim->simulator;
+	simulator->decoder = &sim->decoder;
+	simulator->verbosity = (verbosity_t)options->verbosity;
+	simulator->count_cycles = options->count_cycles || options->max_cycles;
+	simulator->control.max_instructions = options->max_instructions;
+	simulator->control.max_cycles = options->max_cycles;
+
+	bool ok;
+	switch (options->output)
+	{
+	case SIM8086_OUTPUT_FILE:
+		ok = output_init(&simulator->output, OUTPUT_FILE, options->file, OUTPUT_BUFFER_SIZE);
+		break;
+	case SIM8086_OUTPUT_DISCARD:
+		ok = output_init(&simulator->output, OUTPUT_DISCARD, NULL, 0);
+		break;
+	default:
+		ok = output_init(&simulator->output, OUTPUT_MEMORY, NULL, SIM8086_MEMORY_OUTPUT_SIZE);
+		break;
+	}
+	if (!ok)
+	{
+		free(sim);
+		return NULL;
+	}
+	if (!memory_init(&simulator->memory))
+	{
+		output_free(&simulator->output);
+		free(sim);
+		return NULL;
+	}
+	return sim;
+}
+
+void sim8086_destroy(sim8086_t *sim)
+{
+	if (!sim)
+	{
+		return;
+	}
+	free_decode_cache(&sim->simulator);
+	free(sim->simulator.control.breakpoints);
+	output_free(&sim->simulator.output);
+	memory_free(&sim->simulator.memory);
+	free(sim);
+}
+
+bool sim8086_load(sim8086_t *sim, const char *path, uint32_t load_address)
+{
+	simulator_t *simulator = &sim->simulator;
+	if (sim->loaded)
+	{
+		// Start over from zeroed memory, so nothing of the last program
+		// shows through the new one
+		free_decode_cache(simulator);
+		unload_program(simulator);
+		sim->loaded = false;
+	}
+	sim->loaded = load_program(simulator, path, load_address);
+	return sim->loaded;
+}
+
+static bool is_halted(const sim8086_t *sim)
+{
+	return !sim->loaded || sim->simulator.cpu.instr_ptr >= sim->simulator.program_size - 1;
+}
+
+bool sim8086_step(sim8086_t *sim)
+{
+	simulator_t *simulator = &sim->simulator;
+	if (is_halted(sim))
+	{
+		return false;
+	}
+	if (!simulator->decode_cache && !init_decode_cache(simulator))
+	{
+		return false;
+	}
+	simulate_instruction(simulator);
+	return true;
+}
+
+sim8086_status_t sim8086_run(sim8086_t *sim)
+{
+	simulator_t *simulator = &sim->simulator;
+	if (!sim->loaded)
+	{
+		return (sim8086_status_t)simulator->status;
+	}
+
+	// Each engine builds its own caches
+	free_decode_cache(simulator);
+	run_engine(simulator, (engine_t)sim->engine);
+	return (sim8086_status_t)simulator->status;
+}
+
+bool sim8086_set_breakpoint(sim8086_t *sim, uint16_t ip, bool enabled)
+{
+	run_control_t *control = &sim->simulator.control;
+	if (!control->breakpoints)
+	{
+		if (!enabled)
+		{
+			return true;
+		}
+		control->breakpoints = calloc(RUN_BREAKPOINT_COUNT, 1);
+		if (!control->breakpoints)
+		{
+			fprintf(stderr, "Error: Could not allocate breakpoints\n");
+			return false;
+		}
+	}
+	control->breakpoints[ip] = enabled;
+	return true;
+}
+
+sim8086_status_t sim8086_run_until(sim8086_t *sim, uint16_t ip)
+{
+	bool was_set = is_breakpoint(&sim->simulator, ip);
+	if (!sim8086_set_breakpoint(sim, ip, true))
+	{
+		return (sim8086_status_t)sim->simulator.status;
+	}
+	sim8086_status_t status = sim8086_run(sim);
+	sim8086_set_breakpoint(sim, ip, was_set);
+	return status;
+}
+
+void sim8086_get_state(sim8086_t *sim, sim8086_state_t *state)
+{
+	simulator_t *simulator = &sim->simulator;
+	const cpu_state_t *cpu = &simulator->cpu;
+	*state = (sim8086_state_t){
+		.ax = cpu->ax.x,
+		.bx = cpu->bx.x,
+		.cx = cpu->cx.x,
+		.dx = cpu->dx.x,
+		.sp = cpu->sp,
+		.bp = cpu->bp,
+		.si = cpu->si,
+		.di = cpu->di,
+		.es = cpu->es,
+		.cs = cpu->cs,
+		.ss = cpu->ss,
+		.ds = cpu->ds,
+		.flags = materialize_flags(simulator),
+		.ip = cpu->instr_ptr,
+		.cycles = simulator->cycles,
+		.status = (sim8086_status_t)simulator->status,
+		.halted = is_halted(sim),
+	};
+}
+
+static sim8086_snapshot_t *wrap_snapshot(snapshot_t *snapshot)
+{
+	if (!snapshot)
+	{
+		return NULL;
+	}
+	sim8086_snapshot_t *wrapper = malloc(sizeof(sim8086_snapshot_t));
+	if (!wrapper)
+	{
+		fprintf(stderr, "Error: Could not allocate snapshot\n");
+		snapshot_free(snapshot);
+		return NULL;
+	}
+	wrapper->snapshot = snapshot;
+	return wrapper;
+}
+
+sim8086_snapshot_t *sim8086_snapshot(sim8086_t *sim)
+{
+	if (!sim->loaded)
+	{
+		return NULL;
+	}
+	return wrap_snapshot(snapshot_take(&sim->simulator));
+}
+
+void sim8086_restore(sim8086_t *sim, const sim8086_snapshot_t *snapshot)
+{
+	snapshot_restore(&sim->simulator, snapshot->snapshot);
+	sim->loaded = true;
+}
+
+bool sim8086_snapshot_save(const sim8086_snapshot_t *snapshot, const char *path)
+{
+	return snapshot_write(snapshot->snapshot, path);
+}
+
+sim8086_snapshot_t *sim8086_snapshot_load(const char *path)
+{
+	return wrap_snapshot(snapshot_read(path));
+}
+
+void sim8086_snapshot_free(sim8086_snapshot_t *snapshot)
+{
+	if (!snapshot)
+	{
+		return;
+	}
+	snapshot_free(snapshot->snapshot);
+	free(snapshot);
+}
+
+const char *sim8086_output(const sim8086_t *sim, size_t *length)
+{
+	const output_sink_t *out = &sim->simulator.output;
+	if (out->backend != OUTPUT_MEMORY)
+	{
+		*length = 0;
+		return NULL;
+	}
+	*length = out->length;
+	return out->buffer;
+}
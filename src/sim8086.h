@@ -0,0 +1,116 @@
+#ifndef SIM8086_H
+#define SIM8086_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Embeddable 8086 simulator, built as libsim8086.a / libsim8086.so.
+//
+// Each sim8086_t owns its memory, caches and output sink, and the library
+// has no global mutable state, so separate instances can run on separate
+// threads at the same time. One instance must only be used by one thread at
+// a time.
+
+typedef struct Sim8086 sim8086_t;
+typedef struct Sim8086Snapshot sim8086_snapshot_t;
+
+typedef enum Sim8086Verbosity {
+	SIM8086_VERBOSITY_TRACE = 0, // Every instruction, register change and flag update
+	SIM8086_VERBOSITY_FINAL,     // Only the final CPU and memory state
+	SIM8086_VERBOSITY_SILENT,    // Nothing
+} sim8086_verbosity_t;
+
+typedef enum Sim8086Output {
+	SIM8086_OUTPUT_MEMORY = 0, // Kept in the instance, read with sim8086_output
+	SIM8086_OUTPUT_FILE,       // Written to `file`, buffered
+	SIM8086_OUTPUT_DISCARD,
+} sim8086_output_t;
+
+typedef enum Sim8086Engine {
+	SIM8086_ENGINE_INTERPRETER = 0,
+	SIM8086_ENGINE_THREADED,
+	SIM8086_ENGINE_JIT,
+} sim8086_engine_t;
+
+// A zeroed struct asks for a full trace kept in memory, on the interpreter
+typedef struct Sim8086Options {
+	sim8086_verbosity_t verbosity;
+	sim8086_output_t output;
+	FILE *file; // For SIM8086_OUTPUT_FILE
+	sim8086_engine_t engine;
+	bool count_cycles;
+	uint64_t max_instructions; // Per sim8086_run, 0 for no limit
+	uint64_t max_cycles;       // Against the cycle total, 0 for no limit; implies count_cycles
+} sim8086_options_t;
+
+typedef enum Sim8086Status {
+	SIM8086_OK = 0,
+	SIM8086_UNHANDLED_INSTRUCTION, // The program hit an instruction the simulator does not support
+	SIM8086_INSTRUCTION_LIMIT,     // The run stopped at max_instructions
+	SIM8086_CYCLE_LIMIT,           // The run stopped at max_cycles
+	SIM8086_BREAKPOINT,            // The run stopped before a breakpoint
+} sim8086_status_t;
+
+typedef struct Sim8086State {
+	uint16_t ax, bx, cx, dx;
+	uint16_t sp, bp, si, di;
+	uint16_t es, cs, ss, ds;
+	uint16_t flags;
+	uint16_t ip;
+	uint64_t cycles; // Only counted with count_cycles
+	sim8086_status_t status;
+	bool halted; // Execution reached the end of the program
+} sim8086_state_t;
+
+// NULL options are the same as zeroed ones. Returns NULL if the instance
+// cannot be allocated.
+sim8086_t *sim8086_create(const sim8086_options_t *options);
+void sim8086_destroy(sim8086_t *sim);
+
+// Loads a raw program image at load_address (a multiple of 16, e.g.
+// 0x10000) and resets the CPU and memory. Returns false if the file cannot
+// be loaded.
+bool sim8086_load(sim8086_t *sim, const char *path, uint32_t load_address);
+
+// Executes one instruction on the interpreter. Returns false once the
+// program has ended.
+bool sim8086_step(sim8086_t *sim);
+
+// Runs to the end of the program on the configured engine and writes the
+// final state at the configured verbosity. A run stopped by a limit or a
+// breakpoint leaves ip at the instruction it stopped before, and running
+// again carries on from there.
+sim8086_status_t sim8086_run(sim8086_t *sim);
+
+// Runs stop before reaching a breakpoint, except as their first instruction.
+// Returns false if the breakpoints cannot be allocated.
+bool sim8086_set_breakpoint(sim8086_t *sim, uint16_t ip, bool enabled);
+
+// Runs until execution reaches ip, as if it were a breakpoint for this run
+sim8086_status_t sim8086_run_until(sim8086_t *sim, uint16_t ip);
+
+void sim8086_get_state(sim8086_t *sim, sim8086_state_t *state);
+
+// Captures registers, flags, instr_ptr and memory. Returns NULL if nothing
+// is loaded or the copy cannot be allocated.
+sim8086_snapshot_t *sim8086_snapshot(sim8086_t *sim);
+
+// Puts an instance back to a snapshot, which may come from another instance
+// or a file. Going back to the snapshot an instance was last taken from or
+// restored to only copies the memory pages written since. Output already
+// written stays.
+void sim8086_restore(sim8086_t *sim, const sim8086_snapshot_t *snapshot);
+
+// Snapshot files let a later run start where this one took the snapshot
+bool sim8086_snapshot_save(const sim8086_snapshot_t *snapshot, const char *path);
+sim8086_snapshot_t *sim8086_snapshot_load(const char *path);
+
+void sim8086_snapshot_free(sim8086_snapshot_t *snapshot);
+
+// Text written so far by an instance with SIM8086_OUTPUT_MEMORY, not NUL
+// terminated. NULL for other outputs.
+const char *sim8086_output(const sim8086_t *sim, size_t *length);
+
+#endif
@@ -1,115 +1,612 @@
 #include "simulator.h"
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
-
-// Global file pointer for output redirection
-static FILE *g_output_file = NULL;
+#include <unistd.h>
 
 // SIMULATOR
 
 void run_simulation(simulator_t *simulator)
 {
+	if (!init_decode_cache(simulator))
+	{
+		return;
+	}
+	if (!init_block_cache(simulator))
+	{
+		free_decode_cache(simulator);
+		return;
+	}
+	if (simulator->trace)
+	{
+		trace_write_start(simulator->trace, simulator);
+	}
+	bool tracing = is_tracing(simulator);
+	run_control_t *control = &simulator->control;
+	run_control_start(simulator);
+	basic_block_t *block = NULL;
 	while (simulator->cpu.instr_ptr < simulator->program_size - 1)
 	{
-		instruction_t instruction = parse_instruction(simulator);
-		format_instruction(&instruction);
-		printf("\n");
+		block = next_block(simulator, block);
+		if (!block)
+		{
+			break;
+		}
+		if (block->fuel_cost >= control->fuel)
+		{
+			// Close to a limit or at a breakpoint: one checked instruction
+			if (run_control_step(simulator))
+			{
+				break;
+			}
+			simulate_instruction(simulator);
+			block = NULL;
+		}
+		else
+		{
+			control->fuel -= run_block(simulator, block, tracing);
+		}
+		if (control->max_cycles)
+		{
+			// The block may have ended on a rep instruction that took more
+			// clocks than its fuel allowed for
+			run_control_refuel(simulator);
+		}
+	}
+	if (simulator->trace)
+	{
+		trace_write_end(simulator->trace, simulator->cpu.instr_ptr);
+	}
+	if (simulator->verbosity != VERBOSITY_SILENT)
+	{
+		format_cpu_state(simulator);
+		format_memory_state(simulator);
+		if (simulator->profile)
+		{
+			format_profile(simulator);
+		}
+	}
+	output_flush(&simulator->output);
+	free_block_cache(simulator);
+	free_decode_cache(simulator);
+}
 
-		eval_instruction(instruction, simulator);
+void run_engine(simulator_t *simulator, engine_t engine)
+{
+	switch (engine)
+	{
+	case ENGINE_THREADED:
+		run_simulation_threaded(simulator);
+		break;
+	case ENGINE_JIT:
+		run_simulation_jit(simulator);
+		break;
+	default:
+		run_simulation(simulator);
+		break;
 	}
-	format_cpu_state(simulator);
-	format_memory_state(simulator);
 }
 
-void run_simulation_to_file(simulator_t *simulator, FILE *output_file)
+// RUN CONTROL
+
+static uint64_t run_control_count(const run_control_t *control)
 {
-	g_output_file = output_file;
-	while (simulator->cpu.instr_ptr < simulator->program_size - 1)
+	return control->instructions + (control->granted - control->fuel);
+}
+
+// Moves the fuel used so far into the instruction count and hands out what
+// can run before the nearest limit, taking every instruction to cost
+// MAX_INSTRUCTION_CLOCKS under a cycle limit
+void run_control_refuel(simulator_t *simulator)
+{
+	run_control_t *control = &simulator->control;
+	control->instructions = run_control_count(control);
+	uint64_t fuel = RUN_UNLIMITED;
+	if (control->max_instructions)
+	{
+		fuel = control->max_instructions > control->instructions
+			       ? control->max_instructions - control->instructions
+			       : 0;
+	}
+	if (control->max_cycles)
 	{
-		instruction_t instruction = parse_instruction(simulator);
-		format_instruction_to_file(&instruction, output_file);
-		fprintf(output_file, "\n");
+		uint64_t clocks = control->max_cycles > simulator->cycles ? control->max_cycles - simulator->cycles : 0;
+		if (clocks / MAX_INSTRUCTION_CLOCKS < fuel)
+		{
+			fuel = clocks / MAX_INSTRUCTION_CLOCKS;
+		}
+	}
+	control->fuel = fuel;
+	control->granted = fuel;
+}
+
+uint64_t instructions_run(const simulator_t *simulator)
+{
+	return run_control_count(&simulator->control);
+}
 
-		eval_instruction(instruction, simulator);
+void run_control_start(simulator_t *simulator)
+{
+	run_control_t *control = &simulator->control;
+	control->instructions = 0;
+	control->fuel = 0;
+	control->granted = 0;
+	// A stop only describes the run it ended
+	if (simulator->status >= SIMULATION_INSTRUCTION_LIMIT)
+	{
+		simulator->status = control->stopped_over;
 	}
-	format_cpu_state_to_file(simulator, output_file);
-	format_memory_state_to_file(simulator, output_file);
-	g_output_file = NULL;
+	run_control_refuel(simulator);
 }
 
-uint16_t evaluate_src(operand_t src, simulator_t *simulator)
+// Checks every limit before the instruction at instr_ptr. Returns true, with
+// the reason in status, if the run stops there; otherwise counts the
+// instruction and refuels.
+bool run_control_step(simulator_t *simulator)
 {
-	switch (src.type)
+	run_control_t *control = &simulator->control;
+	uint64_t count = run_control_count(control);
+	simulation_status_t stop = SIMULATION_OK;
+	if (control->max_instructions && count >= control->max_instructions)
 	{
-	case OPERAND_IMMEDIATE:
-		return src.value.immediate;
-	case OPERAND_REGISTER:
+		stop = SIMULATION_INSTRUCTION_LIMIT;
+	}
+	else if (control->max_cycles && simulator->cycles >= control->max_cycles)
+	{
+		stop = SIMULATION_CYCLE_LIMIT;
+	}
+	else if (count > 0 && is_breakpoint(simulator, simulator->cpu.instr_ptr))
+	{
+		stop = SIMULATION_BREAKPOINT;
+	}
+	if (stop != SIMULATION_OK)
+	{
+		control->stopped_over = simulator->status;
+		simulator->status = stop;
+		return true;
+	}
+
+	run_control_refuel(simulator);
+	if (control->fuel > 0)
+	{
+		control->fuel--;
+	}
+	else
+	{
+		control->instructions++;
+	}
+	return false;
+}
+
+const char *stop_reason(simulation_status_t status)
+{
+	switch (status)
+	{
+	case SIMULATION_INSTRUCTION_LIMIT:
+		return "instruction limit reached";
+	case SIMULATION_CYCLE_LIMIT:
+		return "cycle limit reached";
+	case SIMULATION_BREAKPOINT:
+		return "breakpoint";
+	default:
+		return NULL;
+	}
+}
+
+// Fetches, traces and executes the instruction at instr_ptr. This is the
+// unit the library steps by; the engines run whole blocks instead.
+void simulate_instruction(simulator_t *simulator)
+{
+	uint16_t ip = simulator->cpu.instr_ptr;
+	const decoded_instruction_t *decoded = fetch_instruction(simulator);
+	if (is_tracing(simulator))
+	{
+		format_instruction(&simulator->output, &decoded->instruction);
+		output_write(&simulator->output, "\n", 1);
+	}
+	if (simulator->trace)
+	{
+		trace_write_instruction(simulator->trace, ip, &decoded->instruction);
+	}
+
+	eval_instruction(&decoded->instruction, simulator);
+	if (simulator->profile)
+	{
+		profile_instruction(simulator->profile, ip, decoded->instruction.op, ip + decoded->length,
+				    simulator->cpu.instr_ptr);
+	}
+}
+
+// REGISTERS
+
+#define WORD_REGISTER(reg, field, name) [reg] = {offsetof(cpu_state_t, field), 0xFFFF, 0, name}
+#define LOW_REGISTER(reg, field, name) [reg] = {offsetof(cpu_state_t, field), 0x00FF, 0, name}
+#define HIGH_REGISTER(reg, field, name) [reg] = {offsetof(cpu_state_t, field), 0x00FF, 8, name}
+
+const register_accessor_t register_accessors[REG_COUNT] = {
+	[REG_NONE] = {0, 0, 0, "UNKNOWN"},
+	WORD_REGISTER(REG_AX, ax.x, "AX"),
+	WORD_REGISTER(REG_BX, bx.x, "BX"),
+	WORD_REGISTER(REG_CX, cx.x, "CX"),
+	WORD_REGISTER(REG_DX, dx.x, "DX"),
+	WORD_REGISTER(REG_SP, sp, "SP"),
+	WORD_REGISTER(REG_BP, bp, "BP"),
+	WORD_REGISTER(REG_SI, si, "SI"),
+	WORD_REGISTER(REG_DI, di, "DI"),
+	HIGH_REGISTER(REG_AH, ax.x, "AH"),
+	HIGH_REGISTER(REG_BH, bx.x, "BH"),
+	HIGH_REGISTER(REG_CH, cx.x, "CH"),
+	HIGH_REGISTER(REG_DH, dx.x, "DH"),
+	LOW_REGISTER(REG_AL, ax.x, "AL"),
+	LOW_REGISTER(REG_BL, bx.x, "BL"),
+	LOW_REGISTER(REG_CL, cx.x, "CL"),
+	LOW_REGISTER(REG_DL, dx.x, "DL"),
+	WORD_REGISTER(REG_ES, es, "ES"),
+	WORD_REGISTER(REG_CS, cs, "CS"),
+	WORD_REGISTER(REG_SS, ss, "SS"),
+	WORD_REGISTER(REG_DS, ds, "DS"),
+};
+
+#undef WORD_REGISTER
+#undef LOW_REGISTER
+#undef HIGH_REGISTER
+
+// MEMORY
+
+// Huge pages are 2 MB on x86-64, so a huge page mapping rounds the 1 MB
+// address space up to one page; normal pages map it exactly.
+#define MEMORY_HUGE_PAGE_SIZE (2 << 20)
+
+bool memory_init(memory_data_t *memory)
+{
+	*memory = (memory_data_t){};
+	void *bytes = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	bytes = mmap(NULL, MEMORY_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	memory->mapped_size = MEMORY_HUGE_PAGE_SIZE;
+#endif
+	if (bytes == MAP_FAILED)
 	{
-		switch (src.value.reg)
+		bytes = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		memory->mapped_size = MEMORY_SIZE;
+		if (bytes == MAP_FAILED)
 		{
-		case REG_AX:
-			return simulator->cpu.ax.x;
-		case REG_BX:
-			return simulator->cpu.bx.x;
-		case REG_CX:
-			return simulator->cpu.cx.x;
-		case REG_DX:
-			return simulator->cpu.dx.x;
-		case REG_SP:
-			return simulator->cpu.sp;
-		case REG_BP:
-			return simulator->cpu.bp;
-		case REG_SI:
-			return simulator->cpu.si;
-		case REG_DI:
-			return simulator->cpu.di;
-		case REG_AH:
-			return simulator->cpu.ax.byte.h;
-		case REG_AL:
-			return simulator->cpu.ax.byte.l;
-		case REG_BH:
-			return simulator->cpu.bx.byte.h;
-		case REG_BL:
-			return simulator->cpu.bx.byte.l;
-		case REG_CH:
-			return simulator->cpu.cx.byte.h;
-		case REG_CL:
-			return simulator->cpu.cx.byte.l;
-		case REG_DH:
-			return simulator->cpu.dx.byte.h;
-		case REG_DL:
-			return simulator->cpu.dx.byte.l;
-		default:
-			return 0;
+			fprintf(stderr, "Error: Could not map %d bytes of simulated memory\n", MEMORY_SIZE);
+			memory->mapped_size = 0;
+			return false;
 		}
+#ifdef MADV_HUGEPAGE
+		// No reserved huge pages; let transparent huge pages back it instead
+		madvise(bytes, MEMORY_SIZE, MADV_HUGEPAGE);
+#endif
 	}
-	case OPERAND_MEMORY:
+	memory->bytes = bytes;
+	return true;
+}
+
+void memory_free(memory_data_t *memory)
+{
+	if (memory->bytes)
+	{
+		munmap(memory->bytes, memory->mapped_size);
+	}
+	*memory = (memory_data_t){};
+}
+
+// Zeroes every page written since the last reset so the memory can back
+// another run.
+void memory_reset(memory_data_t *memory)
+{
+	for (uint32_t word = 0; word < MEMORY_PAGE_COUNT / 64; word++)
+	{
+		for (uint64_t bits = memory->dirty[word]; bits; bits &= bits - 1)
+		{
+			uint32_t page = word * 64 + __builtin_ctzll(bits);
+			memset(memory->bytes + ((size_t)page << MEMORY_PAGE_SHIFT), 0, MEMORY_PAGE_SIZE);
+		}
+		memory->dirty[word] = 0;
+		memory->changed[word] = 0;
+	}
+}
+
+// Segment and offset a memory operand refers to. Offsets wrap at 64 KB
+// within their segment; BP-based addresses default to SS and everything
+// else to DS.
+segmented_address_t effective_address(const memory_address_t *mem, simulator_t *simulator)
+{
+	// Absent base and index registers are REG_NONE, which reads as 0
+	uint16_t offset = read_register(&simulator->cpu, mem->base_reg) +
+			  read_register(&simulator->cpu, mem->index_reg) + mem->displacement;
+
+	cpu_reg_t segment = mem->segment;
+	if (segment == REG_NONE)
+	{
+		segment = (mem->has_base && mem->base_reg == REG_BP) ? REG_SS : REG_DS;
+	}
+	return (segmented_address_t){read_register(&simulator->cpu, segment), offset};
+}
+
+// DECODE CACHE
+
+bool init_decode_cache(simulator_t *simulator)
+{
+	simulator->decode_cache = calloc(simulator->program_size, sizeof(decoded_instruction_t));
+	if (!simulator->decode_cache)
+	{
+		fprintf(stderr, "Error: Could not allocate decode cache (%zu entries)\n", simulator->program_size);
+		return false;
+	}
+	return true;
+}
+
+void free_decode_cache(simulator_t *simulator)
+{
+	free(simulator->decode_cache);
+	simulator->decode_cache = NULL;
+}
+
+// Returns the decoded instruction at instr_ptr and leaves instr_ptr pointing at
+// the next instruction, exactly as parse_instruction would. Each byte offset is
+// decoded at most once; later visits only replay the recorded length.
+const decoded_instruction_t *fetch_instruction(simulator_t *simulator)
+{
+	uint16_t start = simulator->cpu.instr_ptr;
+	decoded_instruction_t *entry = &simulator->decode_cache[start];
+	if (entry->is_decoded)
+	{
+		simulator->cpu.instr_ptr = start + entry->length;
+		return entry;
+	}
+
+	entry->instruction = parse_instruction(simulator);
+	entry->length = (uint8_t)(simulator->cpu.instr_ptr - start);
+	entry->is_decoded = true;
+	return entry;
+}
+
+// BLOCK CACHE
+
+bool init_block_cache(simulator_t *simulator)
+{
+	simulator->block_cache = calloc(simulator->program_size, sizeof(basic_block_t *));
+	if (!simulator->block_cache)
+	{
+		fprintf(stderr, "Error: Could not allocate block cache (%zu entries)\n", simulator->program_size);
+		return false;
+	}
+	simulator->code_modified = false;
+	return true;
+}
+
+static void flush_block_cache(simulator_t *simulator)
+{
+	for (size_t ip = 0; ip < simulator->program_size; ip++)
+	{
+		basic_block_t *block = simulator->block_cache[ip];
+		if (block)
+		{
+			free(block->entries);
+			free(block);
+			simulator->block_cache[ip] = NULL;
+		}
+	}
+	simulator->code_modified = false;
+}
+
+void free_block_cache(simulator_t *simulator)
+{
+	if (!simulator->block_cache)
+	{
+		return;
+	}
+	flush_block_cache(simulator);
+	free(simulator->block_cache);
+	simulator->block_cache = NULL;
+}
+
+static bool is_branch(operation_t op)
+{
+	return (op >= OP_JMP && op <= LOOP_LOOPNZ) || op == OP_CALL || op == OP_RET;
+}
+
+// Where a branch goes when it is taken. ret and indirect calls go wherever
+// the stack or their operand says, so the fall-through stands in for them
+// and following one always looks its target up.
+static uint16_t branch_exit(const instruction_t *instr, uint16_t next)
+{
+	if (instr->op == OP_JMP)
+	{
+		return (uint16_t)instr->dest.value.immediate;
+	}
+	if (instr->op == OP_RET || instr->dest.type != OPERAND_IMMEDIATE)
+	{
+		return next;
+	}
+	return (uint16_t)(next + instr->dest.value.immediate);
+}
+
+// Decodes instructions from `start` up to and including the first jump,
+// loop, call or ret, stopping early where the program ends or before a
+// breakpoint.
+static basic_block_t *build_block(simulator_t *simulator, uint16_t start)
+{
+	basic_block_t *block = calloc(1, sizeof(basic_block_t));
+	block_entry_t *entries = malloc(BLOCK_MAX_INSTRUCTIONS * sizeof(block_entry_t));
+	if (!block || !entries)
+	{
+		fprintf(stderr, "Error: Could not allocate block at 0x%04X\n", start);
+		free(block);
+		free(entries);
+		return NULL;
+	}
+
+	uint16_t saved_ip = simulator->cpu.instr_ptr;
+	uint16_t ip = start;
+	block->exit_ip[0] = block->exit_ip[1] = ip;
+	while (block->count < BLOCK_MAX_INSTRUCTIONS && ip < simulator->program_size - 1)
+	{
+		if (block->count > 0 && is_breakpoint(simulator, ip))
+		{
+			break;
+		}
+		simulator->cpu.instr_ptr = ip;
+		const instruction_t *instr = &fetch_instruction(simulator)->instruction;
+		uint16_t next = simulator->cpu.instr_ptr;
+		bool branch = is_branch(instr->op);
+		entries[block->count++] = (block_entry_t){
+			.instruction = instr,
+			.ip = ip,
+			.next_ip = next,
+			.check_exit = branch || instr->dest.type == OPERAND_MEMORY || instr->rep != REP_NONE ||
+				      instr->op == OP_PUSH || instr->op == OP_PUSHF,
+		};
+		ip = next;
+		block->exit_ip[0] = block->exit_ip[1] = next;
+		if (branch)
+		{
+			block->exit_ip[0] = branch_exit(instr, next);
+			break;
+		}
+	}
+	simulator->cpu.instr_ptr = saved_ip;
+
+	block->entries = entries;
+	block->fuel_cost = is_breakpoint(simulator, start) ? RUN_UNLIMITED : block->count;
+	simulator->block_cache[start] = block;
+	return block;
+}
+
+// Appends `successor` to `block`, which ends in the branch leading to it.
+// The superblock takes over the successor's exits and links.
+static void grow_superblock(basic_block_t *block, const basic_block_t *successor)
+{
+	uint16_t count = block->count + successor->count;
+	block_entry_t *entries = realloc(block->entries, count * sizeof(block_entry_t));
+	if (!entries)
+	{
+		return;
+	}
+	// A loop body unrolls into itself
+	const block_entry_t *appended = successor == block ? entries : successor->entries;
+	memcpy(entries + block->count, appended, successor->count * sizeof(block_entry_t));
+	block->entries = entries;
+	block->count = count;
+	block->fuel_cost = count;
+	for (int side = 0; side < 2; side++)
+	{
+		block->exit_ip[side] = successor->exit_ip[side];
+		block->successor[side] = successor->successor[side];
+		block->exit_count[side] = 0;
+	}
+}
+
+// Finds the block starting at instr_ptr. Leaving `previous` through one of
+// its exits follows the cached link; anything else, like a superblock
+// leaving early, looks the block up by address.
+basic_block_t *next_block(simulator_t *simulator, basic_block_t *previous)
+{
+	uint16_t ip = simulator->cpu.instr_ptr;
+	if (simulator->code_modified)
+	{
+		flush_block_cache(simulator);
+		previous = NULL;
+	}
+
+	int side = -1;
+	if (previous)
+	{
+		side = previous->exit_ip[0] == ip ? 0 : previous->exit_ip[1] == ip ? 1 : -1;
+	}
+	if (side >= 0 && previous->successor[side])
+	{
+		basic_block_t *successor = previous->successor[side];
+		if (++previous->exit_count[side] >= SUPERBLOCK_THRESHOLD &&
+		    previous->count + successor->count <= SUPERBLOCK_MAX_INSTRUCTIONS &&
+		    successor->fuel_cost != RUN_UNLIMITED)
+		{
+			grow_superblock(previous, successor);
+		}
+		return successor;
+	}
+
+	basic_block_t *block = simulator->block_cache[ip];
+	if (!block)
+	{
+		block = build_block(simulator, ip);
+	}
+	if (side >= 0)
+	{
+		previous->successor[side] = block;
+	}
+	return block;
+}
+
+// Returns how many of the block's instructions ran
+uint16_t run_block(simulator_t *simulator, const basic_block_t *block, bool tracing)
+{
+	for (uint16_t i = 0; i < block->count; i++)
 	{
-		memory_address_t mem = src.value.memory;
-		uint16_t address = 0;
-		if (mem.has_base)
+		const block_entry_t *entry = &block->entries[i];
+		simulator->cpu.instr_ptr = entry->next_ip;
+		if (tracing)
 		{
-			address += get_register_data(mem.base_reg, simulator).value;
+			format_instruction(&simulator->output, entry->instruction);
+			output_write(&simulator->output, "\n", 1);
 		}
-		if (mem.has_index)
+		if (simulator->trace)
 		{
-			address += get_register_data(mem.index_reg, simulator).value;
+			trace_write_instruction(simulator->trace, entry->ip, entry->instruction);
 		}
-		if (mem.has_displacement)
+
+		eval_instruction(entry->instruction, simulator);
+		if (simulator->profile)
+		{
+			profile_instruction(simulator->profile, entry->ip, entry->instruction->op, entry->next_ip,
+					    simulator->cpu.instr_ptr);
+		}
+
+		// Leave when a branch went off the superblock's path, a store
+		// changed code the remaining entries were decoded from, or a rep
+		// instruction used up more clocks than the fuel accounts for
+		if (entry->check_exit &&
+		    (simulator->code_modified ||
+		     (i + 1 < block->count && simulator->cpu.instr_ptr != block->entries[i + 1].ip) ||
+		     (entry->instruction->rep != REP_NONE && simulator->control.max_cycles)))
 		{
-			address += mem.displacement;
+			return i + 1;
 		}
-		return simulator->memory.data[address];
 	}
+	return block->count;
+}
+
+uint16_t evaluate_src(operand_t src, uint8_t w_bit, simulator_t *simulator)
+{
+	switch (src.type)
+	{
+	case OPERAND_IMMEDIATE:
+		return src.value.immediate;
+	case OPERAND_REGISTER:
+		return read_register(&simulator->cpu, src.value.reg);
+	case OPERAND_MEMORY:
+		return memory_read(&simulator->memory, effective_address(&src.value.memory, simulator), w_bit);
 	default:
 		return 0;
 	}
 }
 
-void eval_instruction(instruction_t instr, simulator_t *simulator)
+void eval_instruction(const instruction_t *instr, simulator_t *simulator)
 {
-	switch (instr.op)
+	if (simulator->count_cycles)
+	{
+		count_cycles(instr, simulator);
+	}
+	switch (instr->op)
 	{
 		case OP_MOV:
 		{
@@ -137,9 +634,70 @@ void eval_instruction(instruction_t instr, simulator_t *simulator)
 			break;
 		};
 		case OP_JNZ:
+		case OP_JB:
+		case OP_JE:
 		case OP_JNE:
+		case OP_JL:
+		case OP_JLE:
+		case OP_JG:
+		case OP_JGE:
+		case OP_JBE:
+		case OP_JP:
+		case OP_JO:
+		case OP_JS:
+		case OP_JNL:
+		case OP_JA:
+		case OP_JNB:
+		case OP_JNP:
+		case OP_JNO:
+		case OP_JNS:
+		{
+			handle_conditional_jump(instr, simulator);
+			break;
+		};
+		case OP_JCXZ:
+		case LOOP_LOOP:
+		case LOOP_LOOPZ:
+		case LOOP_LOOPNZ:
+		{
+			handle_loop(instr, simulator);
+			break;
+		};
+		case OP_MOVS:
+		case OP_CMPS:
+		case OP_STOS:
+		case OP_LODS:
+		case OP_SCAS:
+		{
+			handle_string(instr, simulator);
+			break;
+		};
+		case OP_CLD:
+		case OP_STD:
+		{
+			handle_direction(instr, simulator);
+			break;
+		};
+		case OP_PUSH:
+		case OP_PUSHF:
+		{
+			handle_push(instr, simulator);
+			break;
+		};
+		case OP_POP:
+		case OP_POPF:
+		{
+			handle_pop(instr, simulator);
+			break;
+		};
+		case OP_CALL:
+		{
+			handle_call(instr, simulator);
+			break;
+		};
+		case OP_RET:
 		{
-			handle_jnz(instr, simulator);
+			handle_ret(instr, simulator);
 			break;
 		};
 		default:
@@ -149,334 +707,1015 @@ void eval_instruction(instruction_t instr, simulator_t *simulator)
 	}
 }
 
-void set_register_data(register_t reg, uint16_t src_value, simulator_t *simulator)
+void set_register_data(cpu_reg_t reg, uint16_t src_value, simulator_t *simulator)
 {
-	switch (reg)
-	{
-	case REG_AX:
-		simulator->cpu.ax.x = src_value;
-		break;
-	case REG_BX:
-		simulator->cpu.bx.x = src_value;
-		break;
-	case REG_CX:
-		simulator->cpu.cx.x = src_value;
-		break;
-	case REG_DX:
-		simulator->cpu.dx.x = src_value;
-		break;
-	case REG_SP:
-		simulator->cpu.sp = src_value;
-		break;
-	case REG_BP:
-		simulator->cpu.bp = src_value;
-		break;
-	case REG_SI:
-		simulator->cpu.si = src_value;
-		break;
-	case REG_DI:
-		simulator->cpu.di = src_value;
-		break;
-	case REG_AH:
-		simulator->cpu.ax.byte.h = (uint8_t)src_value;
-		break;
-	case REG_AL:
-		simulator->cpu.ax.byte.l = (uint8_t)src_value;
-		break;
-	case REG_BH:
-		simulator->cpu.bx.byte.h = (uint8_t)src_value;
-		break;
-	case REG_BL:
-		simulator->cpu.bx.byte.l = (uint8_t)src_value;
-		break;
-	case REG_CH:
-		simulator->cpu.cx.byte.h = (uint8_t)src_value;
-		break;
-	case REG_CL:
-		simulator->cpu.cx.byte.l = (uint8_t)src_value;
-		break;
-	case REG_DH:
-		simulator->cpu.dx.byte.h = (uint8_t)src_value;
-		break;
-	case REG_DL:
-		simulator->cpu.dx.byte.l = (uint8_t)src_value;
-		break;
-	}
+	write_register(&simulator->cpu, reg, src_value);
 }
 
-void set_memory_data(uint16_t address, uint16_t src_value, simulator_t *simulator)
+// Drops cached decodes of any instruction that covers a byte the program
+// just stored to, so self-modifying code is decoded again on its next visit.
+// `length` bytes from `address` were written, without wrapping.
+static void invalidate_decoded_code(simulator_t *simulator, uint32_t address, uint32_t length)
 {
-	simulator->memory.data[address] = src_value;
-	if (simulator->memory.last_used < address)
+	uint32_t image = (uint32_t)(simulator->decoder->bin_buffer - simulator->memory.bytes);
+	if (address + length <= image || address >= image + simulator->program_size)
 	{
-		simulator->memory.last_used = address;
+		return;
 	}
-}
-
-register_data_t get_register_data(register_t reg, simulator_t *simulator)
-{
-	register_data_t info = {
-			.name = "UNKNOWN",
-			.value = 0,
-			.is_8bit = false};
-
-	switch (reg)
+	uint32_t first = address > image ? address - image : 0;
+	uint32_t last = address + length - image < simulator->program_size ? address + length - image - 1
+									   : simulator->program_size - 1;
+	simulator->code_modified = true;
+	if (simulator->jit)
 	{
-	case REG_AX:
-		info.name = "AX";
-		info.value = simulator->cpu.ax.x;
-		break;
-	case REG_BX:
-		info.name = "BX";
-		info.value = simulator->cpu.bx.x;
-		break;
-	case REG_CX:
-		info.name = "CX";
-		info.value = simulator->cpu.cx.x;
-		break;
-	case REG_DX:
-		info.name = "DX";
-		info.value = simulator->cpu.dx.x;
-		break;
-	case REG_SP:
-		info.name = "SP";
-		info.value = simulator->cpu.sp;
-		break;
-	case REG_BP:
-		info.name = "BP";
-		info.value = simulator->cpu.bp;
-		break;
-	case REG_SI:
-		info.name = "SI";
-		info.value = simulator->cpu.si;
-		break;
-	case REG_DI:
-		info.name = "DI";
-		info.value = simulator->cpu.di;
-		break;
-	case REG_AH:
-		info.name = "AH";
-		info.value = simulator->cpu.ax.byte.h;
-		info.is_8bit = true;
-		break;
-	case REG_AL:
-		info.name = "AL";
-		info.value = simulator->cpu.ax.byte.l;
-		info.is_8bit = true;
-		break;
-	case REG_BH:
-		info.name = "BH";
-		info.value = simulator->cpu.bx.byte.h;
-		info.is_8bit = true;
-		break;
-	case REG_BL:
-		info.name = "BL";
-		info.value = simulator->cpu.bx.byte.l;
-		info.is_8bit = true;
-		break;
-	case REG_CH:
-		info.name = "CH";
-		info.value = simulator->cpu.cx.byte.h;
-		info.is_8bit = true;
-		break;
-	case REG_CL:
-		info.name = "CL";
-		info.value = simulator->cpu.cx.byte.l;
-		info.is_8bit = true;
-		break;
-	case REG_DH:
-		info.name = "DH";
-		info.value = simulator->cpu.dx.byte.h;
-		info.is_8bit = true;
-		break;
-	case REG_DL:
-		info.name = "DL";
-		info.value = simulator->cpu.dx.byte.l;
-		info.is_8bit = true;
-		break;
+		jit_flush(simulator->jit);
 	}
+	uint32_t start = first >= DECODE_MAX_LENGTH ? first - DECODE_MAX_LENGTH + 1 : 0;
+	for (; start <= last; start++)
+	{
+		decoded_instruction_t *entry = &simulator->decode_cache[start];
+		if (entry->is_decoded && start + entry->length > first)
+		{
+			entry->is_decoded = false;
+		}
+	}
+}
+
+void set_memory_data(segmented_address_t address, uint16_t src_value, uint8_t w_bit, simulator_t *simulator)
+{
+	memory_write(&simulator->memory, address, src_value, w_bit);
+
+	// The bytes of an unaligned word can be on different pages
+	uint32_t low = physical_address(address.segment, address.offset);
+	uint32_t high = physical_address(address.segment, address.offset + 1);
+	memory_mark_dirty(&simulator->memory, low);
+	if (w_bit)
+	{
+		memory_mark_dirty(&simulator->memory, high);
+	}
+	if (simulator->decode_cache)
+	{
+		invalidate_decoded_code(simulator, low, 1);
+		if (w_bit)
+		{
+			invalidate_decoded_code(simulator, high, 1);
+		}
+	}
+	if (simulator->trace)
+	{
+		trace_write_memory(simulator->trace, address, src_value, w_bit);
+	}
+}
+
+register_data_t get_register_data(cpu_reg_t reg, simulator_t *simulator)
+{
+	const register_accessor_t *access = &register_accessors[reg];
+	return (register_data_t){
+		.name = access->name,
+		.value = read_register(&simulator->cpu, reg),
+		.is_8bit = access->mask == 0x00FF,
+	};
+}
 
-	return info;
+// Reports a register write to whichever traces are active. The text trace
+// only prints writes that change the value; the binary trace records them all.
+void report_register_change(cpu_reg_t reg, register_data_t prev_data, uint16_t value, simulator_t *simulator)
+{
+	if (is_tracing(simulator))
+	{
+		format_reg_before_after(&simulator->output, prev_data, value);
+	}
+	if (simulator->trace)
+	{
+		trace_write_register(simulator->trace, reg, prev_data.value, value);
+	}
 }
 
-void handle_mov(instruction_t instr, simulator_t *simulator)
+void handle_mov(const instruction_t *instr, simulator_t *simulator)
 {
-	uint16_t src_value = evaluate_src(instr.src, simulator);
+	uint16_t src_value = evaluate_src(instr->src, instr->w_bit, simulator);
 	register_data_t prev_data;
-	switch(instr.dest.type){
+	switch(instr->dest.type){
 		case OPERAND_REGISTER:
-			prev_data = get_register_data(instr.dest.value.reg, simulator);
-			set_register_data(instr.dest.value.reg, src_value, simulator);
-			format_reg_before_after(prev_data, src_value);
+			prev_data = get_register_data(instr->dest.value.reg, simulator);
+			set_register_data(instr->dest.value.reg, src_value, simulator);
+			report_register_change(instr->dest.value.reg, prev_data, src_value, simulator);
 			break;
 		case OPERAND_MEMORY:
-		{
-			memory_address_t mem = instr.dest.value.memory;
-			uint16_t address = 0;
-			if (mem.has_base)
-			{
-				address += get_register_data(mem.base_reg, simulator).value;
-			}
-			if (mem.has_index)
+			set_memory_data(effective_address(&instr->dest.value.memory, simulator), src_value, instr->w_bit, simulator);
+			break;
+		default:
+			simulator->status = SIMULATION_UNHANDLED_INSTRUCTION;
+			if (is_tracing(simulator))
 			{
-				address += get_register_data(mem.index_reg, simulator).value;
+				output_printf(&simulator->output, "UNHANDLED MOV INSTRUCTION\n");
 			}
-			if (mem.has_displacement)
+			if (simulator->trace)
 			{
-				address += mem.displacement;
+				trace_write_unhandled(simulator->trace);
 			}
-			set_memory_data(address, src_value, simulator);
-			break;
-		}
-		default:
-			printf("UNHANDLED MOV INSTRUCTION\n");
 			break;
 	}
 }
 
-void handle_sub(instruction_t instr, simulator_t *simulator)
+void handle_sub(const instruction_t *instr, simulator_t *simulator)
 {
-	register_data_t prev_data = get_register_data(instr.dest.value.reg, simulator);
-	uint16_t src_value = evaluate_src(instr.src, simulator);
+	register_data_t prev_data = get_register_data(instr->dest.value.reg, simulator);
+	uint16_t src_value = evaluate_src(instr->src, instr->w_bit, simulator);
 	uint16_t result = prev_data.value - src_value;
-	set_register_data(instr.dest.value.reg, result, simulator);
+	set_register_data(instr->dest.value.reg, result, simulator);
 
-	process_cpu_flags(result, simulator);
+	update_flags(LAZY_FLAGS_SUB, prev_data.value, src_value, result, instr->w_bit, simulator);
 
-	format_reg_before_after(prev_data, result);
+	report_register_change(instr->dest.value.reg, prev_data, result, simulator);
 }
 
-void handle_add(instruction_t instr, simulator_t *simulator)
+void handle_add(const instruction_t *instr, simulator_t *simulator)
 {
-	register_data_t prev_data = get_register_data(instr.dest.value.reg, simulator);
-	uint16_t src_value = evaluate_src(instr.src, simulator);
+	register_data_t prev_data = get_register_data(instr->dest.value.reg, simulator);
+	uint16_t src_value = evaluate_src(instr->src, instr->w_bit, simulator);
 	uint16_t result = prev_data.value + src_value;
-	set_register_data(instr.dest.value.reg, result, simulator);
+	set_register_data(instr->dest.value.reg, result, simulator);
 
-	process_cpu_flags(result, simulator);
+	update_flags(LAZY_FLAGS_ADD, prev_data.value, src_value, result, instr->w_bit, simulator);
 
-	format_reg_before_after(prev_data, result);
+	report_register_change(instr->dest.value.reg, prev_data, result, simulator);
 }
 
-void handle_cmp(instruction_t instr, simulator_t *simulator)
+void handle_cmp(const instruction_t *instr, simulator_t *simulator)
 {
-	register_data_t prev_data = get_register_data(instr.dest.value.reg, simulator);
-	uint16_t src_value = evaluate_src(instr.src, simulator);
+	register_data_t prev_data = get_register_data(instr->dest.value.reg, simulator);
+	uint16_t src_value = evaluate_src(instr->src, instr->w_bit, simulator);
 	uint16_t result = prev_data.value - src_value;
 
-	process_cpu_flags(result, simulator);
+	update_flags(LAZY_FLAGS_SUB, prev_data.value, src_value, result, instr->w_bit, simulator);
 }
 
-void handle_jmp(instruction_t instr, simulator_t *simulator)
+void handle_jmp(const instruction_t *instr, simulator_t *simulator)
 {
-	simulator->cpu.instr_ptr = instr.dest.value.immediate;
+	simulator->cpu.instr_ptr = instr->dest.value.immediate;
 }
 
-void handle_jnz(instruction_t instr, simulator_t *simulator)
-{
-	if (simulator->cpu.flags & FLAG_ZF)
+static bool jump_condition(operation_t op, const simulator_t *simulator)
+{
+	switch (op)
+	{
+	case OP_JO:
+		return test_flag(simulator, FLAG_OF);
+	case OP_JNO:
+		return !test_flag(simulator, FLAG_OF);
+	case OP_JB:
+		return test_flag(simulator, FLAG_CF);
+	case OP_JNB:
+		return !test_flag(simulator, FLAG_CF);
+	case OP_JE:
+		return test_flag(simulator, FLAG_ZF);
+	case OP_JNE:
+	case OP_JNZ:
+		return !test_flag(simulator, FLAG_ZF);
+	case OP_JBE:
+		return test_flag(simulator, FLAG_CF) || test_flag(simulator, FLAG_ZF);
+	case OP_JA:
+		return !test_flag(simulator, FLAG_CF) && !test_flag(simulator, FLAG_ZF);
+	case OP_JS:
+		return test_flag(simulator, FLAG_SF);
+	case OP_JNS:
+		return !test_flag(simulator, FLAG_SF);
+	case OP_JP:
+		return test_flag(simulator, FLAG_PF);
+	case OP_JNP:
+		return !test_flag(simulator, FLAG_PF);
+	case OP_JL:
+		return test_flag(simulator, FLAG_SF) != test_flag(simulator, FLAG_OF);
+	case OP_JNL:
+	case OP_JGE:
+		return test_flag(simulator, FLAG_SF) == test_flag(simulator, FLAG_OF);
+	case OP_JLE:
+		return test_flag(simulator, FLAG_ZF) ||
+		       test_flag(simulator, FLAG_SF) != test_flag(simulator, FLAG_OF);
+	case OP_JG:
+		return !test_flag(simulator, FLAG_ZF) &&
+		       test_flag(simulator, FLAG_SF) == test_flag(simulator, FLAG_OF);
+	default:
+		return false;
+	}
+}
+
+void handle_conditional_jump(const instruction_t *instr, simulator_t *simulator)
+{
+	if (jump_condition(instr->op, simulator))
+	{
+		simulator->cpu.instr_ptr = simulator->cpu.instr_ptr + instr->dest.value.immediate;
+	}
+}
+
+// loop/loopz/loopnz decrement CX without touching the flags; jcxz only tests it
+void handle_loop(const instruction_t *instr, simulator_t *simulator)
+{
+	uint16_t count = simulator->cpu.cx.x;
+	bool taken;
+	if (instr->op == OP_JCXZ)
+	{
+		taken = count == 0;
+	}
+	else
+	{
+		register_data_t prev_data = get_register_data(REG_CX, simulator);
+		count--;
+		set_register_data(REG_CX, count, simulator);
+		report_register_change(REG_CX, prev_data, count, simulator);
+
+		taken = count != 0;
+		if (instr->op == LOOP_LOOPZ)
+		{
+			taken = taken && test_flag(simulator, FLAG_ZF);
+		}
+		else if (instr->op == LOOP_LOOPNZ)
+		{
+			taken = taken && !test_flag(simulator, FLAG_ZF);
+		}
+	}
+	if (taken)
+	{
+		simulator->cpu.instr_ptr = simulator->cpu.instr_ptr + instr->dest.value.immediate;
+	}
+}
+
+// STRING INSTRUCTIONS
+
+// Where a string instruction's elements start and how they step. Offsets
+// wrap within their segment like any other address.
+typedef struct StringRun
+{
+	segmented_address_t source;      // [si], in DS or the override segment
+	segmented_address_t destination; // es:[di]
+	int16_t step;                    // Added to SI and DI per element, negative with DF set
+} string_run_t;
+
+static const operand_t *string_operand(const instruction_t *instr, cpu_reg_t index)
+{
+	if (instr->dest.type == OPERAND_MEMORY && instr->dest.value.memory.index_reg == index)
+	{
+		return &instr->dest;
+	}
+	if (instr->src.type == OPERAND_MEMORY && instr->src.value.memory.index_reg == index)
+	{
+		return &instr->src;
+	}
+	return NULL;
+}
+
+static string_run_t string_run(const instruction_t *instr, simulator_t *simulator)
+{
+	const operand_t *source = string_operand(instr, REG_SI);
+	const operand_t *destination = string_operand(instr, REG_DI);
+	int16_t size = instr->w_bit ? 2 : 1;
+	return (string_run_t){
+		.source = source ? effective_address(&source->value.memory, simulator) : (segmented_address_t){},
+		.destination = destination ? effective_address(&destination->value.memory, simulator)
+					   : (segmented_address_t){},
+		.step = test_flag(simulator, FLAG_DF) ? -size : size,
+	};
+}
+
+static segmented_address_t string_element(segmented_address_t start, int16_t step, uint32_t index)
+{
+	return (segmented_address_t){start.segment, (uint16_t)(start.offset + (int32_t)step * (int32_t)index)};
+}
+
+// Physical address of the lowest of the bytes `count` elements from `start`
+// cover, or -1 when they wrap around their segment or the end of memory and
+// so are not one range of host memory
+static int64_t string_range(segmented_address_t start, int16_t step, uint32_t count)
+{
+	int32_t size = step < 0 ? -step : step;
+	int32_t low = step < 0 ? start.offset - (int32_t)(count - 1) * size : start.offset;
+	uint32_t length = count * (uint32_t)size;
+	if (low < 0 || low + length > 0x10000)
+	{
+		return -1;
+	}
+	uint32_t address = ((uint32_t)start.segment << 4) + (uint32_t)low;
+	return address + length <= MEMORY_SIZE ? (int64_t)address : -1;
+}
+
+// Position in memory order of the first nonzero byte of a word loaded with
+// memcpy
+static inline size_t first_nonzero_byte(uint64_t word)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return __builtin_clzll(word) / 8;
+#else
+	return __builtin_ctzll(word) / 8;
+#endif
+}
+
+// Index of the first byte where `a` and `b` differ, or `length` if none,
+// compared eight bytes at a time
+static size_t first_difference(const uint8_t *a, const uint8_t *b, size_t length)
+{
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8)
+	{
+		uint64_t x;
+		uint64_t y;
+		memcpy(&x, a + i, 8);
+		memcpy(&y, b + i, 8);
+		if (x != y)
+		{
+			return i + first_nonzero_byte(x ^ y);
+		}
+	}
+	while (i < length && a[i] == b[i])
+	{
+		i++;
+	}
+	return i;
+}
+
+// Index of the first byte that breaks the repeating 8-byte `pattern`, or
+// `length` if none
+static size_t first_difference_from(const uint8_t *bytes, const uint8_t pattern[8], size_t length)
+{
+	uint64_t y;
+	memcpy(&y, pattern, 8);
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8)
+	{
+		uint64_t x;
+		memcpy(&x, bytes + i, 8);
+		if (x != y)
+		{
+			return i + first_nonzero_byte(x ^ y);
+		}
+	}
+	while (i < length && bytes[i] == pattern[i % 8])
+	{
+		i++;
+	}
+	return i;
+}
+
+// Elements a repeated cmps or scas compares, up to `limit`: it stops after
+// the first that compares unequal under repz, or equal under repnz. Forward
+// runs over one range of memory are searched with memchr or eight bytes at
+// a time.
+static uint32_t compare_count(const instruction_t *instr, const string_run_t *run, uint32_t limit,
+			      simulator_t *simulator)
+{
+	const uint8_t *bytes = simulator->memory.bytes;
+	uint32_t size = instr->w_bit ? 2 : 1;
+	uint16_t accumulator = read_register(&simulator->cpu, instr->w_bit ? REG_AX : REG_AL);
+	int64_t destination = string_range(run->destination, run->step, limit);
+	if (run->step > 0 && destination >= 0)
+	{
+		size_t length = (size_t)limit * size;
+		if (instr->op == OP_CMPS)
+		{
+			int64_t source = string_range(run->source, run->step, limit);
+			if (source >= 0 && instr->rep == REP_Z)
+			{
+				size_t found = first_difference(bytes + source, bytes + destination, length);
+				return found == length ? limit : (uint32_t)(found / size) + 1;
+			}
+		}
+		else if (instr->rep == REP_Z)
+		{
+			uint8_t pattern[8];
+			for (int i = 0; i < 8; i++)
+			{
+				pattern[i] = (uint8_t)(accumulator >> (8 * (i % size)));
+			}
+			size_t found = first_difference_from(bytes + destination, pattern, length);
+			return found == length ? limit : (uint32_t)(found / size) + 1;
+		}
+		else if (size == 1)
+		{
+			const uint8_t *match = memchr(bytes + destination, accumulator, length);
+			return match ? (uint32_t)(match - (bytes + destination)) + 1 : limit;
+		}
+	}
+
+	for (uint32_t i = 0; i < limit; i++)
+	{
+		uint16_t value = memory_read(&simulator->memory, string_element(run->destination, run->step, i),
+					     instr->w_bit);
+		uint16_t compared = instr->op == OP_CMPS
+					    ? memory_read(&simulator->memory, string_element(run->source, run->step, i),
+							  instr->w_bit)
+					    : accumulator;
+		if ((compared == value) == (instr->rep == REP_NZ))
+		{
+			return i + 1;
+		}
+	}
+	return limit;
+}
+
+// Elements the string instruction about to run will process: one without a
+// prefix, otherwise up to CX
+static uint32_t string_count(const instruction_t *instr, const string_run_t *run, simulator_t *simulator)
+{
+	if (instr->rep == REP_NONE)
+	{
+		return 1;
+	}
+	uint32_t count = simulator->cpu.cx.x;
+	if (count > 0 && (instr->op == OP_CMPS || instr->op == OP_SCAS))
+	{
+		count = compare_count(instr, run, count, simulator);
+	}
+	return count;
+}
+
+// Marks pages and decoded code under bytes written straight to memory
+static void string_written(simulator_t *simulator, uint32_t address, uint32_t length)
+{
+	for (uint32_t page = address >> MEMORY_PAGE_SHIFT; page <= (address + length - 1) >> MEMORY_PAGE_SHIFT; page++)
+	{
+		memory_mark_dirty(&simulator->memory, page << MEMORY_PAGE_SHIFT);
+	}
+	if (simulator->decode_cache)
+	{
+		invalidate_decoded_code(simulator, address, length);
+	}
+}
+
+// Stores `count` elements for movs or stos. A run that stays in one range of
+// memory becomes a single memmove or memset, unless a binary trace needs
+// every store.
+static void string_store(const instruction_t *instr, const string_run_t *run, uint32_t count,
+			 simulator_t *simulator)
+{
+	uint8_t *bytes = simulator->memory.bytes;
+	uint32_t length = count * (instr->w_bit ? 2 : 1);
+	uint16_t accumulator = read_register(&simulator->cpu, instr->w_bit ? REG_AX : REG_AL);
+	int64_t destination = string_range(run->destination, run->step, count);
+	int64_t source = instr->op == OP_MOVS ? string_range(run->source, run->step, count) : 0;
+	if (simulator->trace || destination < 0 || source < 0)
+	{
+		for (uint32_t i = 0; i < count; i++)
+		{
+			uint16_t value = instr->op == OP_MOVS
+						 ? memory_read(&simulator->memory, string_element(run->source, run->step, i),
+							       instr->w_bit)
+						 : accumulator;
+			set_memory_data(string_element(run->destination, run->step, i), value, instr->w_bit, simulator);
+		}
+		return;
+	}
+
+	if (instr->op == OP_STOS)
+	{
+		if (!instr->w_bit || (accumulator & 0xFF) == accumulator >> 8)
+		{
+			memset(bytes + destination, accumulator & 0xFF, length);
+		}
+		else
+		{
+			for (uint32_t i = 0; i < length; i += 2)
+			{
+				bytes[destination + i] = (uint8_t)accumulator;
+				bytes[destination + i + 1] = (uint8_t)(accumulator >> 8);
+			}
+		}
+	}
+	// Copying element by element only differs from memmove when a store
+	// lands on source bytes the copy has not read yet
+	else if (source + length <= destination || destination + length <= source ||
+		 (run->step > 0 ? destination <= source : destination >= source))
+	{
+		memmove(bytes + destination, bytes + source, length);
+	}
+	else
+	{
+		for (uint32_t i = 0; i < count; i++)
+		{
+			uint16_t value = memory_read(&simulator->memory, string_element(run->source, run->step, i),
+						     instr->w_bit);
+			memory_write(&simulator->memory, string_element(run->destination, run->step, i), value,
+				     instr->w_bit);
+		}
+	}
+	string_written(simulator, (uint32_t)destination, length);
+}
+
+static void step_string_register(cpu_reg_t reg, int32_t delta, simulator_t *simulator)
+{
+	register_data_t prev_data = get_register_data(reg, simulator);
+	uint16_t value = (uint16_t)(prev_data.value + delta);
+	set_register_data(reg, value, simulator);
+	report_register_change(reg, prev_data, value, simulator);
+}
+
+// movs/cmps/stos/lods/scas, with or without a repeat prefix. The whole
+// repetition runs as one instruction: the flags are those of the last
+// compare, and each register it moves is reported once.
+void handle_string(const instruction_t *instr, simulator_t *simulator)
+{
+	string_run_t run = string_run(instr, simulator);
+	uint32_t count = string_count(instr, &run, simulator);
+	if (count == 0)
+	{
+		return;
+	}
+
+	uint32_t last = count - 1;
+	switch (instr->op)
+	{
+	case OP_MOVS:
+	case OP_STOS:
+		string_store(instr, &run, count, simulator);
+		break;
+	case OP_LODS:
+	{
+		cpu_reg_t accumulator = instr->w_bit ? REG_AX : REG_AL;
+		register_data_t prev_data = get_register_data(accumulator, simulator);
+		uint16_t value = memory_read(&simulator->memory, string_element(run.source, run.step, last), instr->w_bit);
+		set_register_data(accumulator, value, simulator);
+		report_register_change(accumulator, prev_data, value, simulator);
+		break;
+	}
+	default:
+	{
+		uint16_t value = memory_read(&simulator->memory, string_element(run.destination, run.step, last),
+					     instr->w_bit);
+		uint16_t compared = instr->op == OP_CMPS
+					    ? memory_read(&simulator->memory, string_element(run.source, run.step, last),
+							  instr->w_bit)
+					    : read_register(&simulator->cpu, instr->w_bit ? REG_AX : REG_AL);
+		update_flags(LAZY_FLAGS_SUB, compared, value, compared - value, instr->w_bit, simulator);
+		break;
+	}
+	}
+
+	int32_t delta = (int32_t)run.step * (int32_t)count;
+	if (string_operand(instr, REG_SI))
+	{
+		step_string_register(REG_SI, delta, simulator);
+	}
+	if (string_operand(instr, REG_DI))
+	{
+		step_string_register(REG_DI, delta, simulator);
+	}
+	if (instr->rep != REP_NONE)
+	{
+		step_string_register(REG_CX, -(int32_t)count, simulator);
+	}
+}
+
+// cld/std clear and set DF, which string instructions step SI and DI by
+void handle_direction(const instruction_t *instr, simulator_t *simulator)
+{
+	uint16_t flags = materialize_flags(simulator);
+	flags = instr->op == OP_STD ? flags | FLAG_DF : flags & ~FLAG_DF;
+	simulator->cpu.flags = flags;
+	update_flags(LAZY_FLAGS_NONE, 0, 0, flags, 0, simulator);
+}
+
+// STACK
+
+// The stack only holds words, always at SS:SP, so these go straight to
+// memory without working out an effective address.
+
+// Moves SP down a word and returns the slot a push fills
+static segmented_address_t push_slot(simulator_t *simulator)
+{
+	register_data_t prev_data = get_register_data(REG_SP, simulator);
+	uint16_t sp = prev_data.value - 2;
+	simulator->cpu.sp = sp;
+	report_register_change(REG_SP, prev_data, sp, simulator);
+	return (segmented_address_t){simulator->cpu.ss, sp};
+}
+
+// Returns the slot a pop empties and moves SP up past it and `discard` more
+// bytes
+static segmented_address_t pop_slot(uint16_t discard, simulator_t *simulator)
+{
+	register_data_t prev_data = get_register_data(REG_SP, simulator);
+	uint16_t sp = prev_data.value + 2 + discard;
+	simulator->cpu.sp = sp;
+	report_register_change(REG_SP, prev_data, sp, simulator);
+	return (segmented_address_t){simulator->cpu.ss, prev_data.value};
+}
+
+// push and pushf. The operand is read once SP has moved, so push sp stores
+// the decremented value as the 8086 does.
+void handle_push(const instruction_t *instr, simulator_t *simulator)
+{
+	segmented_address_t slot = push_slot(simulator);
+	uint16_t value = instr->op == OP_PUSHF ? materialize_flags(simulator) | FLAGS_UNUSED_ONES
+					       : evaluate_src(instr->dest, 1, simulator);
+	set_memory_data(slot, value, 1, simulator);
+}
+
+// pop and popf. popf only keeps the bits the 8086 has flags for.
+void handle_pop(const instruction_t *instr, simulator_t *simulator)
+{
+	uint16_t value = memory_read(&simulator->memory, pop_slot(0, simulator), 1);
+	if (instr->op == OP_POPF)
+	{
+		uint16_t flags = value & (FLAGS_ARITHMETIC | FLAGS_CONTROL);
+		simulator->cpu.flags = flags;
+		update_flags(LAZY_FLAGS_NONE, 0, 0, flags, 0, simulator);
+	}
+	else if (instr->dest.type == OPERAND_REGISTER)
+	{
+		register_data_t prev_data = get_register_data(instr->dest.value.reg, simulator);
+		set_register_data(instr->dest.value.reg, value, simulator);
+		report_register_change(instr->dest.value.reg, prev_data, value, simulator);
+	}
+	else
+	{
+		set_memory_data(effective_address(&instr->dest.value.memory, simulator), value, 1, simulator);
+	}
+}
+
+// Near calls, relative or through a register or memory word. The target is
+// read before the return address is pushed.
+void handle_call(const instruction_t *instr, simulator_t *simulator)
+{
+	uint16_t next = simulator->cpu.instr_ptr;
+	uint16_t target = instr->dest.type == OPERAND_IMMEDIATE ? (uint16_t)(next + instr->dest.value.immediate)
+							      : evaluate_src(instr->dest, 1, simulator);
+	set_memory_data(push_slot(simulator), next, 1, simulator);
+	simulator->cpu.instr_ptr = target;
+}
+
+// Near ret, dropping the immediate's worth of arguments after the return
+// address
+void handle_ret(const instruction_t *instr, simulator_t *simulator)
+{
+	uint16_t discard = instr->dest.type == OPERAND_IMMEDIATE ? (uint16_t)instr->dest.value.immediate : 0;
+	simulator->cpu.instr_ptr = memory_read(&simulator->memory, pop_slot(discard, simulator), 1);
+}
+
+// CYCLES
+
+// Base clocks and memory transfers per operation and operand form, from the
+// 8086 instruction timing tables. Moves to and from segment registers cost
+// the same as the matching general register forms.
+static const instruction_timing_t instruction_timings[OP_CMP + 1][FORM_COUNT] = {
+	[OP_MOV] = {
+		[FORM_REG_REG] = {2, 0},
+		[FORM_REG_IMM] = {4, 0},
+		[FORM_REG_MEM] = {8, 1},
+		[FORM_MEM_REG] = {9, 1},
+		[FORM_MEM_IMM] = {10, 1},
+	},
+	[OP_ADD] = {
+		[FORM_REG_REG] = {3, 0},
+		[FORM_REG_IMM] = {4, 0},
+		[FORM_REG_MEM] = {9, 1},
+		[FORM_MEM_REG] = {16, 2},
+		[FORM_MEM_IMM] = {17, 2},
+	},
+	[OP_SUB] = {
+		[FORM_REG_REG] = {3, 0},
+		[FORM_REG_IMM] = {4, 0},
+		[FORM_REG_MEM] = {9, 1},
+		[FORM_MEM_REG] = {16, 2},
+		[FORM_MEM_IMM] = {17, 2},
+	},
+	[OP_CMP] = {
+		[FORM_REG_REG] = {3, 0},
+		[FORM_REG_IMM] = {4, 0},
+		[FORM_REG_MEM] = {9, 1},
+		[FORM_MEM_REG] = {9, 1},
+		[FORM_MEM_IMM] = {10, 1},
+	},
+};
+
+// Clocks for jumps and loops, [not taken, taken]
+static const uint8_t branch_clocks[LOOP_LOOPNZ + 1][2] = {
+	[OP_JMP] = {15, 15},
+	[OP_JNZ] = {4, 16}, [OP_JB] = {4, 16}, [OP_JE] = {4, 16}, [OP_JNE] = {4, 16},
+	[OP_JL] = {4, 16}, [OP_JLE] = {4, 16}, [OP_JG] = {4, 16}, [OP_JGE] = {4, 16},
+	[OP_JBE] = {4, 16}, [OP_JP] = {4, 16}, [OP_JO] = {4, 16}, [OP_JS] = {4, 16},
+	[OP_JNL] = {4, 16}, [OP_JA] = {4, 16}, [OP_JNB] = {4, 16}, [OP_JNP] = {4, 16},
+	[OP_JNO] = {4, 16}, [OP_JNS] = {4, 16},
+	[OP_JCXZ] = {6, 18},
+	[LOOP_LOOP] = {5, 17},
+	[LOOP_LOOPZ] = {6, 18},
+	[LOOP_LOOPNZ] = {5, 19},
+};
+
+// Clocks for string instructions, [without a prefix, per repetition]. A
+// repeated one also pays REP_START_CLOCKS once, even when CX is 0.
+#define REP_START_CLOCKS 9
+static const uint8_t string_clocks[OP_SCAS + 1][2] = {
+	[OP_MOVS] = {18, 17},
+	[OP_CMPS] = {22, 22},
+	[OP_STOS] = {11, 10},
+	[OP_LODS] = {12, 13},
+	[OP_SCAS] = {15, 15},
+};
+
+// cld and std
+#define DIRECTION_CLOCKS 2
+
+// Clocks for stack instructions by operand: [register or none, segment
+// register, memory, immediate]. Each memory operand and stack word is one
+// transfer.
+static const uint8_t stack_clocks[OP_RET + 1][4] = {
+	[OP_PUSH] = {11, 10, 16},
+	[OP_POP] = {8, 8, 17},
+	[OP_PUSHF] = {10},
+	[OP_POPF] = {8},
+	[OP_CALL] = {16, 0, 21, 19},
+	[OP_RET] = {8, 0, 0, 12},
+};
+
+static operand_form_t operand_form(const instruction_t *instr)
+{
+	operand_type_t src = instr->src.type;
+	switch (instr->dest.type)
+	{
+	case OPERAND_REGISTER:
+		return src == OPERAND_REGISTER ? FORM_REG_REG :
+		       src == OPERAND_IMMEDIATE ? FORM_REG_IMM :
+		       src == OPERAND_MEMORY ? FORM_REG_MEM : FORM_NONE;
+	case OPERAND_MEMORY:
+		return src == OPERAND_REGISTER ? FORM_MEM_REG :
+		       src == OPERAND_IMMEDIATE ? FORM_MEM_IMM : FORM_NONE;
+	default:
+		return FORM_NONE;
+	}
+}
+
+// Effective address time: 6 for a direct address, 5 for one register, 7 or
+// 8 for two, plus 4 with a displacement and 2 with a segment override
+static uint32_t effective_address_clocks(const memory_address_t *mem)
+{
+	static const uint8_t clocks[3][2] = {{6, 6}, {5, 9}, {7, 11}};
+
+	// [bp] has no encoding without a displacement, so it always has one
+	bool displacement = mem->has_displacement ||
+			    (mem->has_base && mem->base_reg == REG_BP && !mem->has_index);
+	uint32_t total = clocks[mem->has_base + mem->has_index][displacement];
+	if ((mem->base_reg == REG_BP && mem->index_reg == REG_SI) ||
+	    (mem->base_reg == REG_BX && mem->index_reg == REG_DI))
+	{
+		total++;
+	}
+	if (mem->segment != REG_NONE)
+	{
+		total += 2;
+	}
+	return total;
+}
+
+// Whether a jump or loop about to run will branch, from the state before it
+static bool branch_taken(const instruction_t *instr, const simulator_t *simulator)
+{
+	uint16_t count = simulator->cpu.cx.x;
+	switch (instr->op)
+	{
+	case OP_JMP:
+		return true;
+	case OP_JCXZ:
+		return count == 0;
+	case LOOP_LOOP:
+		return count != 1;
+	case LOOP_LOOPZ:
+		return count != 1 && test_flag(simulator, FLAG_ZF);
+	case LOOP_LOOPNZ:
+		return count != 1 && !test_flag(simulator, FLAG_ZF);
+	default:
+		return jump_condition(instr->op, simulator);
+	}
+}
+
+// Clocks for the elements a string instruction will process, plus 2 for a
+// segment override. Word elements keep the parity of SI and DI, so each odd
+// one pays the penalty every time.
+static uint32_t string_cycles(const instruction_t *instr, simulator_t *simulator)
+{
+	string_run_t run = string_run(instr, simulator);
+	uint32_t count = string_count(instr, &run, simulator);
+	uint32_t clocks = instr->rep == REP_NONE ? string_clocks[instr->op][0]
+						 : REP_START_CLOCKS + count * string_clocks[instr->op][1];
+	const operand_t *source = string_operand(instr, REG_SI);
+	if (source && source->value.memory.segment != REG_NONE)
+	{
+		clocks += 2;
+	}
+	if (instr->w_bit)
+	{
+		uint32_t odd = (string_operand(instr, REG_SI) && (run.source.offset & 1)) +
+			       (string_operand(instr, REG_DI) && (run.destination.offset & 1));
+		clocks += ODD_ADDRESS_PENALTY * odd * count;
+	}
+	return clocks;
+}
+
+// Clocks for a stack instruction, plus the penalty for a stack word at an
+// odd SP and for an odd memory operand
+static uint32_t stack_cycles(const instruction_t *instr, simulator_t *simulator)
+{
+	const operand_t *operand = &instr->dest;
+	int column = operand->type == OPERAND_MEMORY ? 2 :
+		     operand->type == OPERAND_IMMEDIATE ? 3 :
+		     operand->type == OPERAND_REGISTER && operand->value.reg >= REG_ES ? 1 : 0;
+	uint32_t clocks = stack_clocks[instr->op][column];
+	if (operand->type == OPERAND_MEMORY)
+	{
+		clocks += effective_address_clocks(&operand->value.memory);
+		if (effective_address(&operand->value.memory, simulator).offset & 1)
+		{
+			clocks += ODD_ADDRESS_PENALTY;
+		}
+	}
+	if (simulator->cpu.sp & 1)
+	{
+		clocks += ODD_ADDRESS_PENALTY;
+	}
+	return clocks;
+}
+
+// Clocks the instruction will take, from the state before it runs
+uint32_t instruction_cycles(const instruction_t *instr, simulator_t *simulator)
+{
+	if (is_string_operation(instr->op))
+	{
+		return string_cycles(instr, simulator);
+	}
+	if (is_stack_operation(instr->op))
+	{
+		return stack_cycles(instr, simulator);
+	}
+	if (instr->op == OP_CLD || instr->op == OP_STD)
+	{
+		return DIRECTION_CLOCKS;
+	}
+	if (instr->op >= OP_JMP)
+	{
+		return branch_clocks[instr->op][branch_taken(instr, simulator)];
+	}
+
+	const instruction_timing_t *timing = &instruction_timings[instr->op][operand_form(instr)];
+	uint32_t clocks = timing->clocks;
+	const operand_t *memory = instr->dest.type == OPERAND_MEMORY ? &instr->dest :
+				  instr->src.type == OPERAND_MEMORY ? &instr->src : NULL;
+	if (memory)
 	{
-		return;
+		clocks += effective_address_clocks(&memory->value.memory);
+		if (instr->w_bit && (effective_address(&memory->value.memory, simulator).offset & 1))
+		{
+			clocks += ODD_ADDRESS_PENALTY * timing->transfers;
+		}
 	}
-	simulator->cpu.instr_ptr = simulator->cpu.instr_ptr + instr.dest.value.immediate;
+	return clocks;
 }
 
-void process_cpu_flags(uint16_t result, simulator_t *simulator){
-	if (result == 0)
+// Charges the instruction about to run to the cycle total
+void count_cycles(const instruction_t *instr, simulator_t *simulator)
+{
+	uint32_t clocks = instruction_cycles(instr, simulator);
+	simulator->cycles += clocks;
+	if (is_tracing(simulator))
 	{
-		simulator->cpu.flags |= FLAG_ZF;
+		format_cycles(&simulator->output, clocks, simulator->cycles);
 	}
-	else
+	if (simulator->trace)
 	{
-		simulator->cpu.flags &= ~FLAG_ZF;
+		trace_write_cycles(simulator->trace, clocks);
 	}
+}
 
-	if (result & 0x8000)
+// FLAGS
+
+// Parity of every byte value; PF is set when the low byte of a result has an
+// even number of 1 bits
+#define PARITY_2(n) n, n ^ 1, n ^ 1, n
+#define PARITY_4(n) PARITY_2(n), PARITY_2(n ^ 1), PARITY_2(n ^ 1), PARITY_2(n)
+#define PARITY_6(n) PARITY_4(n), PARITY_4(n ^ 1), PARITY_4(n ^ 1), PARITY_4(n)
+static const uint8_t parity_table[256] = {
+	PARITY_6(1), PARITY_6(0), PARITY_6(0), PARITY_6(1),
+};
+#undef PARITY_2
+#undef PARITY_4
+#undef PARITY_6
+
+// Records a flag-setting ALU result. Nothing is derived from it here unless
+// a trace needs to print the flags.
+void update_flags(lazy_flags_op_t op, uint16_t dest, uint16_t src, uint16_t result, uint8_t w_bit,
+		  simulator_t *simulator)
+{
+	lazy_flags_t *lazy = &simulator->cpu.lazy_flags;
+	lazy->op = op;
+	lazy->w_bit = w_bit;
+	lazy->dest = dest;
+	lazy->src = src;
+	lazy->result = result;
+
+	if (is_tracing(simulator))
 	{
-		simulator->cpu.flags |= FLAG_SF;
+		format_cpu_flags(simulator);
 	}
-	else
+	if (simulator->trace)
 	{
-		simulator->cpu.flags &= ~FLAG_SF;
+		trace_write_flags(simulator->trace, lazy);
 	}
-	format_cpu_flags(simulator);
-}
-
-void format_cpu_flags(simulator_t *simulator){
-	printf("flags: 0x%04X (zero: %d, sign: %d)\n", simulator->cpu.flags, (simulator->cpu.flags & FLAG_ZF) != 0, (simulator->cpu.flags & FLAG_SF) != 0);
 }
 
-void format_reg_before_after(register_data_t prev_data, uint16_t src_value)
+// Derives a single arithmetic flag from the recorded ALU operation
+static bool lazy_flag(const lazy_flags_t *lazy, uint16_t flag)
 {
-	if (prev_data.is_8bit)
+	uint16_t mask = lazy->w_bit ? 0xFFFF : 0x00FF;
+	uint16_t sign = lazy->w_bit ? 0x8000 : 0x0080;
+	uint16_t dest = lazy->dest & mask;
+	uint16_t src = lazy->src & mask;
+	uint16_t result = lazy->result & mask;
+	bool is_add = lazy->op == LAZY_FLAGS_ADD;
+
+	switch (flag)
 	{
-		if (prev_data.value != (src_value & 0xFF))
+	case FLAG_CF:
+		return is_add ? result < dest : dest < src;
+	case FLAG_PF:
+		return parity_table[result & 0xFF];
+	case FLAG_AF:
+		return ((dest ^ src ^ result) & 0x10) != 0;
+	case FLAG_ZF:
+		return result == 0;
+	case FLAG_SF:
+		return (result & sign) != 0;
+	case FLAG_OF:
+		if (is_add)
 		{
-			if (g_output_file) {
-				fprintf(g_output_file, "%s: 0x%02X -> 0x%02X (%d)\n", prev_data.name, prev_data.value, src_value & 0xFF, src_value);
-			} else {
-				printf("%s: 0x%02X -> 0x%02X (%d)\n", prev_data.name, prev_data.value, src_value & 0xFF, src_value);
-			}
+			return ((dest ^ result) & (src ^ result) & sign) != 0;
 		}
+		return ((dest ^ src) & (dest ^ result) & sign) != 0;
+	default:
+		return false;
 	}
-	else
+}
+
+bool test_flag(const simulator_t *simulator, uint16_t flag)
+{
+	const cpu_state_t *cpu = &simulator->cpu;
+	if (cpu->lazy_flags.op == LAZY_FLAGS_NONE || !(flag & FLAGS_ARITHMETIC))
 	{
-		if (prev_data.value != (src_value))
+		return (cpu->flags & flag) != 0;
+	}
+	return lazy_flag(&cpu->lazy_flags, flag);
+}
+
+// Folds any pending ALU result into cpu.flags and returns the full register
+uint16_t materialize_flags(simulator_t *simulator)
+{
+	cpu_state_t *cpu = &simulator->cpu;
+	const lazy_flags_t *lazy = &cpu->lazy_flags;
+	if (lazy->op != LAZY_FLAGS_NONE)
+	{
+		uint16_t flags = cpu->flags & ~FLAGS_ARITHMETIC;
+		for (uint16_t flag = FLAG_CF; flag <= FLAG_OF; flag <<= 1)
 		{
-			if (g_output_file) {
-				fprintf(g_output_file, "%s: 0x%04X -> 0x%04X (%d)\n", prev_data.name, prev_data.value, src_value, src_value);
-			} else {
-				printf("%s: 0x%04X -> 0x%04X (%d)\n", prev_data.name, prev_data.value, src_value, src_value);
+			if ((flag & FLAGS_ARITHMETIC) && lazy_flag(lazy, flag))
+			{
+				flags |= flag;
 			}
 		}
+		cpu->flags = flags;
+		cpu->lazy_flags.op = LAZY_FLAGS_NONE;
 	}
+	return cpu->flags;
+}
+
+void format_cpu_flags(simulator_t *simulator){
+	uint16_t flags = materialize_flags(simulator);
+	output_printf(&simulator->output, "flags: 0x%04X (zero: %d, sign: %d)\n", flags, (flags & FLAG_ZF) != 0, (flags & FLAG_SF) != 0);
+}
+
+void format_cycles(output_sink_t *out, uint32_t clocks, uint64_t total)
+{
+	output_printf(out, "clocks: +%u = %llu\n", clocks, (unsigned long long)total);
 }
 
-void format_reg_before_after_to_file(register_data_t prev_data, uint16_t src_value, FILE *output_file)
+void format_reg_before_after(output_sink_t *out, register_data_t prev_data, uint16_t src_value)
 {
 	if (prev_data.is_8bit)
 	{
 		if (prev_data.value != (src_value & 0xFF))
 		{
-			fprintf(output_file, "%s: 0x%02X -> 0x%02X (%d)\n", prev_data.name, prev_data.value, src_value & 0xFF, src_value);
+			output_printf(out, "%s: 0x%02X -> 0x%02X (%d)\n", prev_data.name, prev_data.value, src_value & 0xFF, src_value);
 		}
 	}
 	else
 	{
 		if (prev_data.value != (src_value))
 		{
-			fprintf(output_file, "%s: 0x%04X -> 0x%04X (%d)\n", prev_data.name, prev_data.value, src_value, src_value);
+			output_printf(out, "%s: 0x%04X -> 0x%04X (%d)\n", prev_data.name, prev_data.value, src_value, src_value);
 		}
 	}
 }
 
 void format_cpu_state(simulator_t *simulator)
 {
-	printf("Final registers\n");
-#define REGISTER(reg) printf("  %s: 0x%04X (high: 0x%02X, low: 0x%02X) (%d)\n", \
-														 #reg,                                              \
-														 simulator->cpu.reg.x,                                         \
-														 simulator->cpu.reg.byte.h,                                    \
-														 simulator->cpu.reg.byte.l,                                    \
-														 simulator->cpu.reg.x);
-	GENERAL_REGISTERS
-#undef REGISTER
-
-#define REGISTER(reg) printf("  %s: 0x%04X (%d)\n", \
-														 #reg,                  \
-														 simulator->cpu.reg,               \
-														 simulator->cpu.reg);
-	POINTER_REGISTERS
-#undef REGISTER
-
-	printf("  flags: 0x%04X (zero: %d, sign: %d)\n", simulator->cpu.flags, (simulator->cpu.flags & FLAG_ZF) != 0, (simulator->cpu.flags & FLAG_SF) != 0);
-	printf("  instr_ptr: 0x%04X\n", simulator->cpu.instr_ptr);
-}
-
-void format_cpu_state_to_file(simulator_t *simulator, FILE *output_file)
-{
-	fprintf(output_file, "Final registers\n");
-#define REGISTER(reg) fprintf(output_file, "  %s: 0x%04X (high: 0x%02X, low: 0x%02X) (%d)\n", \
+	output_sink_t *out = &simulator->output;
+	output_printf(out, "Final registers\n");
+#define REGISTER(reg) output_printf(out, "  %s: 0x%04X (high: 0x%02X, low: 0x%02X) (%d)\n", \
 														 #reg,                                              \
 														 simulator->cpu.reg.x,                                         \
 														 simulator->cpu.reg.byte.h,                                    \
@@ -485,43 +1724,124 @@ void format_cpu_state_to_file(simulator_t *simulator, FILE *output_file)
 	GENERAL_REGISTERS
 #undef REGISTER
 
-#define REGISTER(reg) fprintf(output_file, "  %s: 0x%04X (%d)\n", \
+#define REGISTER(reg) output_printf(out, "  %s: 0x%04X (%d)\n", \
 														 #reg,                  \
 														 simulator->cpu.reg,               \
 														 simulator->cpu.reg);
 	POINTER_REGISTERS
+	SEGMENT_REGISTERS
 #undef REGISTER
 
-	fprintf(output_file, "  flags: 0x%04X (zero: %d, sign: %d)\n", simulator->cpu.flags, (simulator->cpu.flags & FLAG_ZF) != 0, (simulator->cpu.flags & FLAG_SF) != 0);
-	fprintf(output_file, "  instr_ptr: 0x%04X\n", simulator->cpu.instr_ptr);
-}
-
-void format_memory_state(simulator_t *simulator)
-{
-	printf("Memory state\n");
-	for (int i = 0; i < simulator->memory.last_used; i++)
+	uint16_t flags = materialize_flags(simulator);
+	output_printf(out, "  flags: 0x%04X (zero: %d, sign: %d)\n", flags, (flags & FLAG_ZF) != 0, (flags & FLAG_SF) != 0);
+	output_printf(out, "  instr_ptr: 0x%04X\n", simulator->cpu.instr_ptr);
+	if (simulator->count_cycles)
 	{
-		if (simulator->memory.data[i] != 0)
-		{
-			printf("  0x%04X (%d): 0x%04X (%d)\n", i, i, simulator->memory.data[i], simulator->memory.data[i]);
-		}
+		output_printf(out, "  clocks: %llu\n", (unsigned long long)simulator->cycles);
 	}
 }
 
-void format_memory_state_to_file(simulator_t *simulator, FILE *output_file)
+void format_memory_state(simulator_t *simulator)
 {
-	fprintf(output_file, "Memory state\n");
-	for (int i = 0; i < simulator->memory.last_used; i++)
+	output_sink_t *out = &simulator->output;
+	output_printf(out, "Memory state\n");
+	// Memory is listed as aligned words, and only written pages can hold
+	// anything but zeroes
+	const memory_data_t *memory = &simulator->memory;
+	for (uint32_t word = 0; word < MEMORY_PAGE_COUNT / 64; word++)
 	{
-		if (simulator->memory.data[i] != 0)
+		for (uint64_t bits = memory->dirty[word]; bits; bits &= bits - 1)
 		{
-			fprintf(output_file, "  0x%04X (%d): 0x%04X (%d)\n", i, i, simulator->memory.data[i], simulator->memory.data[i]);
+			uint32_t start = (word * 64 + __builtin_ctzll(bits)) << MEMORY_PAGE_SHIFT;
+			for (uint32_t i = start; i < start + MEMORY_PAGE_SIZE; i += 2)
+			{
+				uint16_t value = memory->bytes[i] | memory->bytes[i + 1] << 8;
+				if (value != 0)
+				{
+					output_printf(out, "  0x%04X (%d): 0x%04X (%d)\n", i, i, value, (int16_t)value);
+				}
+			}
 		}
 	}
 }
 
 // DECODER
 
+// Maps the first byte of an instruction to the routine that decodes the rest
+// of it. Bytes without an entry decode to an empty instruction and are skipped.
+typedef struct OpcodeEntry {
+	instruction_t (*decode)(simulator_t *simulator, operation_t operation);
+	operation_t operation;
+} opcode_entry_t;
+
+static const opcode_entry_t opcode_table[256] = {
+	[0x00 ... 0x03] = {mod_regm_reg, OP_ADD},
+	[0x04 ... 0x05] = {immed_to_acc, OP_ADD},
+	[0x06] = {stack_segment, OP_PUSH},
+	[0x07] = {stack_segment, OP_POP},
+	[0x0E] = {stack_segment, OP_PUSH},
+	[0x16] = {stack_segment, OP_PUSH},
+	[0x17] = {stack_segment, OP_POP},
+	[0x1E] = {stack_segment, OP_PUSH},
+	[0x1F] = {stack_segment, OP_POP},
+	[0x26] = {segment_prefix, OP_MOV},
+	[0x28 ... 0x2B] = {mod_regm_reg, OP_SUB},
+	[0x2C ... 0x2D] = {immed_to_acc, OP_SUB},
+	[0x2E] = {segment_prefix, OP_MOV},
+	[0x36] = {segment_prefix, OP_MOV},
+	[0x38 ... 0x3B] = {mod_regm_reg, OP_CMP},
+	[0x3C ... 0x3D] = {immed_to_acc, OP_CMP},
+	[0x3E] = {segment_prefix, OP_MOV},
+	[0x50 ... 0x57] = {stack_register, OP_PUSH},
+	[0x58 ... 0x5F] = {stack_register, OP_POP},
+
+	[0x70] = {jmp_opcode, OP_JO},
+	[0x71] = {jmp_opcode, OP_JNO},
+	[0x72] = {jmp_opcode, OP_JB},
+	[0x73] = {jmp_opcode, OP_JNB},
+	[0x74] = {jmp_opcode, OP_JE},
+	[0x75] = {jmp_opcode, OP_JNZ},
+	[0x76] = {jmp_opcode, OP_JBE},
+	[0x77] = {jmp_opcode, OP_JA},
+	[0x78] = {jmp_opcode, OP_JS},
+	[0x79] = {jmp_opcode, OP_JNS},
+	[0x7A] = {jmp_opcode, OP_JP},
+	[0x7B] = {jmp_opcode, OP_JNP},
+	[0x7C] = {jmp_opcode, OP_JL},
+	[0x7D] = {jmp_opcode, OP_JNL},
+	[0x7E] = {jmp_opcode, OP_JLE},
+	[0x7F] = {jmp_opcode, OP_JG},
+
+	// The operation for immediate group opcodes comes from the reg field
+	[0x80 ... 0x83] = {immed_to_regm, OP_ADD},
+	[0x88 ... 0x8B] = {mod_regm_reg, OP_MOV},
+	[0x8C] = {mov_segment, OP_MOV},
+	[0x8E] = {mov_segment, OP_MOV},
+	[0x8F] = {stack_regm, OP_POP},
+	[0x9C] = {no_operand_opcode, OP_PUSHF},
+	[0x9D] = {no_operand_opcode, OP_POPF},
+	[0xA4 ... 0xA5] = {string_opcode, OP_MOVS},
+	[0xA6 ... 0xA7] = {string_opcode, OP_CMPS},
+	[0xAA ... 0xAB] = {string_opcode, OP_STOS},
+	[0xAC ... 0xAD] = {string_opcode, OP_LODS},
+	[0xAE ... 0xAF] = {string_opcode, OP_SCAS},
+	[0xB0 ... 0xBF] = {mov_immed_to_reg, OP_MOV},
+	[0xC2] = {immed16_opcode, OP_RET},
+	[0xC3] = {no_operand_opcode, OP_RET},
+	[0xC6 ... 0xC7] = {mov_immed_to_mem, OP_MOV},
+
+	[0xE0] = {loop_opcode, LOOP_LOOPNZ},
+	[0xE1] = {loop_opcode, LOOP_LOOPZ},
+	[0xE2] = {loop_opcode, LOOP_LOOP},
+	[0xE3] = {jmp_opcode, OP_JCXZ},
+	[0xE8] = {immed16_opcode, OP_CALL},
+	[0xF2 ... 0xF3] = {repeat_prefix, OP_MOV},
+	[0xFC] = {no_operand_opcode, OP_CLD},
+	[0xFD] = {no_operand_opcode, OP_STD},
+	// The reg field picks call or push; the rest of the group isn't modelled
+	[0xFF] = {stack_regm, OP_PUSH},
+};
+
 instruction_t parse_instruction(simulator_t *simulator) {
 	decoder_t *decoder = simulator->decoder;
 
@@ -531,143 +1851,69 @@ instruction_t parse_instruction(simulator_t *simulator) {
 	}
 
 	uint8_t byte = decoder->bin_buffer[simulator->cpu.instr_ptr];
+	const opcode_entry_t *entry = &opcode_table[byte];
 	instruction_t instruction = {};
 
-	if (byte >> 4 == 0b1011) {
-		instruction = mov_immed_to_reg(simulator);
-		return instruction;
+	if (entry->decode) {
+		instruction = entry->decode(simulator, entry->operation);
 	}
 
-	switch (byte >> 2) {
-		case 0b100010: {
-			instruction = mod_regm_reg(simulator, OP_MOV);
-			break;
-		}
-		case 0b000000: {
-			instruction = mod_regm_reg(simulator, OP_ADD);
-			break;
-		}
-		case 0b100000: {
-			instruction = immed_to_regm(simulator);
-			break;
-		}
-		case 0b001010: {
-			instruction = mod_regm_reg(simulator, OP_SUB);
-			break;
-		}
-		case 0b001110: {
-			instruction = mod_regm_reg(simulator, OP_CMP);
-			break;
-		}
-		case 0b110001: {
-			instruction = mov_immed_to_mem(simulator);
-			break;
-		}
-	}
+	advance_decoder(simulator);
+	return instruction;
+}
 
-	switch (byte >> 1) {
-		case 0b0000010: {
-			instruction = immed_to_acc(simulator, OP_ADD);
-			break;
-		}
-		case 0b0010110: {
-			instruction = immed_to_acc(simulator, OP_SUB);
-			break;
-		}
-		case 0b0011110: {
-			instruction = immed_to_acc(simulator, OP_CMP);
-			break;
-		}
+// ES/CS/SS/DS override prefixes apply to the memory operand of the
+// instruction that follows, which is decoded as part of this one.
+instruction_t segment_prefix(simulator_t *simulator, operation_t operation) {
+	decoder_t *decoder = simulator->decoder;
+	uint8_t byte = decoder->bin_buffer[simulator->cpu.instr_ptr];
+	cpu_reg_t segment = REG_ES + ((byte >> 3) & 0b11);
+
+	advance_decoder(simulator);
+	if (simulator->cpu.instr_ptr >= simulator->program_size) {
+		return (instruction_t){};
 	}
 
-	switch (byte) {
-		case 0b01110101: {
-			instruction = jmp_opcode(simulator, OP_JNZ);
-			break;
-		}
-		case 0b01110100: {
-			instruction = jmp_opcode(simulator, OP_JNE);
-			break;
-		}
-		case 0b01111100: {
-			instruction = jmp_opcode(simulator, OP_JL);
-			break;
-		}
-		case 0b01111110: {
-			instruction = jmp_opcode(simulator, OP_JLE);
-			break;
-		}
-		case 0b01110010: {
-			instruction = jmp_opcode(simulator, OP_JB);
-			break;
-		}
-		case 0b01110110: {
-			instruction = jmp_opcode(simulator, OP_JBE);
-			break;
-		}
-		case 0b01111010: {
-			instruction = jmp_opcode(simulator, OP_JP);
-			break;
-		}
-		case 0b01110000: {
-			instruction = jmp_opcode(simulator, OP_JO);
-			break;
-		}
-		case 0b01111000: {
-			instruction = jmp_opcode(simulator, OP_JS);
-			break;
-		}
-		case 0b01111101: {
-			instruction = jmp_opcode(simulator, OP_JNL);
-			break;
-		}
-		case 0b01111111: {
-			instruction = jmp_opcode(simulator, OP_JG);
-			break;
-		}
-		case 0b01110011: {
-			instruction = jmp_opcode(simulator, OP_JNB);
-			break;
-		}
-		case 0b01110111: {
-			instruction = jmp_opcode(simulator, OP_JA);
-			break;
-		}
-		case 0b01111011: {
-			instruction = jmp_opcode(simulator, OP_JNP);
-			break;
-		}
-		case 0b01110001: {
-			instruction = jmp_opcode(simulator, OP_JNO);
-			break;
-		}
-		case 0b01111001: {
-			instruction = jmp_opcode(simulator, OP_JNS);
-			break;
-		}
-		case 0b11100010: {
-			instruction = loop_opcode(simulator, LOOP_LOOP);
-			break;
-		}
-		case 0b11100001: {
-			instruction = loop_opcode(simulator, LOOP_LOOPZ);
-			break;
-		}
-		case 0b11100000: {
-			instruction = loop_opcode(simulator, LOOP_LOOPNZ);
-			break;
-		}
-		case 0b11100011: {
-			instruction = jmp_opcode(simulator, OP_JCXZ);
-			break;
-		}
+	const opcode_entry_t *entry = &opcode_table[decoder->bin_buffer[simulator->cpu.instr_ptr]];
+	if (!entry->decode) {
+		return (instruction_t){};
+	}
+	instruction_t instruction = entry->decode(simulator, entry->operation);
+	// A string instruction's es:[di] cannot be overridden, only its [si]
+	bool string = is_string_operation(instruction.op);
+	if (instruction.dest.type == OPERAND_MEMORY &&
+	    (!string || instruction.dest.value.memory.index_reg == REG_SI)) {
+		instruction.dest.value.memory.segment = segment;
 	}
+	if (instruction.src.type == OPERAND_MEMORY &&
+	    (!string || instruction.src.value.memory.index_reg == REG_SI)) {
+		instruction.src.value.memory.segment = segment;
+	}
+	return instruction;
+}
+
+// rep/repz (F3) and repnz (F2) prefixes, which only mean something to the
+// string instruction that follows. Anything else decodes as if unprefixed.
+instruction_t repeat_prefix(simulator_t *simulator, operation_t operation) {
+	decoder_t *decoder = simulator->decoder;
+	uint8_t byte = decoder->bin_buffer[simulator->cpu.instr_ptr];
 
 	advance_decoder(simulator);
+	if (simulator->cpu.instr_ptr >= simulator->program_size) {
+		return (instruction_t){};
+	}
+
+	const opcode_entry_t *entry = &opcode_table[decoder->bin_buffer[simulator->cpu.instr_ptr]];
+	if (!entry->decode) {
+		return (instruction_t){};
+	}
+	instruction_t instruction = entry->decode(simulator, entry->operation);
+	if (is_string_operation(instruction.op)) {
+		instruction.rep = byte == 0xF3 ? REP_Z : REP_NZ;
+	}
 	return instruction;
 }
 
-
 operand_t create_memory_operand(cpu_reg_t base, cpu_reg_t index,
 				int16_t displacement) {
 	operand_t op = {.type = OPERAND_MEMORY,
@@ -702,15 +1948,12 @@ instruction_t create_instruction(operation_t op, operand_t dest,
 	return (instruction_t){.op = op, .dest = dest, .src = src, .w_bit = w_bit};
 }
 
-instruction_t mod_regm_reg(simulator_t *simulator, operation_t operation) {
+// Decodes the mod/reg/r/m byte at instr_ptr and whatever displacement
+// follows it.
+static instruction_t decode_mod_regm(simulator_t *simulator, operation_t operation,
+				     uint8_t d_bit, uint8_t w_bit) {
 	decoder_t *decoder = simulator->decoder;
 	uint8_t byte = decoder->bin_buffer[simulator->cpu.instr_ptr];
-	uint8_t d_bit = (byte >> 1) & 0b01;
-	uint8_t w_bit = byte & 0b01;
-
-	advance_decoder(simulator);
-
-	byte = decoder->bin_buffer[simulator->cpu.instr_ptr];
 	uint8_t mod = byte >> 6;
 	uint8_t reg = (byte >> 3) & 0b111;
 	uint8_t regm = byte & 0b111;
@@ -741,6 +1984,66 @@ instruction_t mod_regm_reg(simulator_t *simulator, operation_t operation) {
 	return (instruction_t){};
 }
 
+instruction_t mod_regm_reg(simulator_t *simulator, operation_t operation) {
+	decoder_t *decoder = simulator->decoder;
+	uint8_t byte = decoder->bin_buffer[simulator->cpu.instr_ptr];
+	uint8_t d_bit = (byte >> 1) & 0b01;
+	uint8_t w_bit = byte & 0b01;
+
+	advance_decoder(simulator);
+	return decode_mod_regm(simulator, operation, d_bit, w_bit);
+}
+
+
+// Moves between a segment register and a 16-bit register or memory. The
+// reg field names the segment register and the opcode has no w bit.
+instruction_t mov_segment(simulator_t *simulator, operation_t operation) {
+	decoder_t *decoder = simulator->decoder;
+	uint8_t byte = decoder->bin_buffer[simulator->cpu.instr_ptr];
+	uint8_t d_bit = (byte >> 1) & 0b01;
+
+	advance_decoder(simulator);
+	byte = decoder->bin_buffer[simulator->cpu.instr_ptr];
+	uint8_t mod = byte >> 6;
+	operand_t segment = create_register_operand(REG_ES + ((byte >> 3) & 0b11));
+
+	instruction_t instruction;
+	if (mod == 0b11) {
+		operand_t regm = create_register_operand(bits_to_reg(byte & 0b111, 1));
+		instruction = create_instruction(operation, regm, regm, 1);
+	} else {
+		instruction = decode_mod_regm(simulator, operation, d_bit, 1);
+	}
+	if (d_bit) {
+		instruction.dest = segment;
+	} else {
+		instruction.src = segment;
+	}
+	return instruction;
+}
+
+// pop r/m16 (8F /0), and call r/m16 (FF /2) and push r/m16 (FF /6). The
+// reg field only selects the operation, so the r/m operand is the only one.
+// Other reg values decode to an empty instruction of the right length.
+instruction_t stack_regm(simulator_t *simulator, operation_t operation) {
+	decoder_t *decoder = simulator->decoder;
+	uint8_t opcode = decoder->bin_buffer[simulator->cpu.instr_ptr];
+	advance_decoder(simulator);
+	if (simulator->cpu.instr_ptr >= simulator->program_size) {
+		return (instruction_t){};
+	}
+	uint8_t reg = (decoder->bin_buffer[simulator->cpu.instr_ptr] >> 3) & 0b111;
+	if (opcode == 0xFF) {
+		operation = reg == 0b010 ? OP_CALL : OP_PUSH;
+	}
+	instruction_t instruction = decode_mod_regm(simulator, operation, 0, 1);
+	if ((opcode == 0x8F && reg != 0b000) || (opcode == 0xFF && reg != 0b010 && reg != 0b110)) {
+		return (instruction_t){};
+	}
+	instruction.src = (operand_t){};
+	return instruction;
+}
+
 instruction_t jmp_opcode(simulator_t *simulator, operation_t operation) {
 	decoder_t *decoder = simulator->decoder;
 	advance_decoder(simulator);
@@ -759,7 +2062,65 @@ instruction_t loop_opcode(simulator_t *simulator, operation_t operation) {
 	return create_instruction(operation, dest, (operand_t){}, 0);
 }
 
-instruction_t mov_immed_to_reg(simulator_t *simulator) {
+// movs/cmps/stos/lods/scas have no operand bytes; the low bit of the opcode
+// is the w bit. Operands are written destination first, as for cmp, so cmps
+// compares [si] with es:[di] and scas the accumulator with es:[di].
+instruction_t string_opcode(simulator_t *simulator, operation_t operation) {
+	decoder_t *decoder = simulator->decoder;
+	uint8_t w_bit = decoder->bin_buffer[simulator->cpu.instr_ptr] & 0b1;
+
+	operand_t source = create_memory_operand(REG_NONE, REG_SI, 0);
+	operand_t destination = create_memory_operand(REG_NONE, REG_DI, 0);
+	destination.value.memory.segment = REG_ES;
+	operand_t accumulator = create_register_operand(w_bit ? REG_AX : REG_AL);
+	switch (operation) {
+		case OP_MOVS:
+			return create_instruction(operation, destination, source, w_bit);
+		case OP_CMPS:
+			return create_instruction(operation, source, destination, w_bit);
+		case OP_STOS:
+			return create_instruction(operation, destination, accumulator, w_bit);
+		case OP_LODS:
+			return create_instruction(operation, accumulator, source, w_bit);
+		default:
+			return create_instruction(operation, accumulator, destination, w_bit);
+	}
+}
+
+// cld/std, pushf/popf and ret, which take no operands
+instruction_t no_operand_opcode(simulator_t *simulator, operation_t operation) {
+	return create_instruction(operation, (operand_t){}, (operand_t){}, 0);
+}
+
+// push/pop of a word register, named by the low three bits of the opcode
+instruction_t stack_register(simulator_t *simulator, operation_t operation) {
+	uint8_t byte = simulator->decoder->bin_buffer[simulator->cpu.instr_ptr];
+	return create_instruction(operation, create_register_operand(bits_to_reg(byte & 0b111, 1)),
+				  (operand_t){}, 1);
+}
+
+// push/pop of a segment register, named by bits 3 and 4 of the opcode
+instruction_t stack_segment(simulator_t *simulator, operation_t operation) {
+	uint8_t byte = simulator->decoder->bin_buffer[simulator->cpu.instr_ptr];
+	return create_instruction(operation, create_register_operand(REG_ES + ((byte >> 3) & 0b11)),
+				  (operand_t){}, 1);
+}
+
+// call rel16 and ret imm16, whose one operand is a 16-bit immediate
+instruction_t immed16_opcode(simulator_t *simulator, operation_t operation) {
+	decoder_t *decoder = simulator->decoder;
+	if (simulator->cpu.instr_ptr + 2 >= simulator->program_size) {
+		return (instruction_t){};
+	}
+	advance_decoder(simulator);
+	uint8_t data_lo = decoder->bin_buffer[simulator->cpu.instr_ptr];
+	advance_decoder(simulator);
+	uint8_t data_hi = decoder->bin_buffer[simulator->cpu.instr_ptr];
+	operand_t dest = create_immediate_operand((int16_t)((data_hi << 8) | data_lo));
+	return create_instruction(operation, dest, (operand_t){}, 1);
+}
+
+instruction_t mov_immed_to_reg(simulator_t *simulator, operation_t operation) {
 	decoder_t *decoder = simulator->decoder;
 	uint8_t byte = decoder->bin_buffer[simulator->cpu.instr_ptr];
 	uint8_t w_bit = (byte >> 3) & 0b1;
@@ -781,15 +2142,13 @@ instruction_t mov_immed_to_reg(simulator_t *simulator) {
 		immed = byte;
 	}
 
-	advance_decoder(simulator);
-
 	cpu_reg_t dest = bits_to_reg(reg, w_bit);
 	cpu_reg_t src = immed;
-	return create_instruction(OP_MOV, create_register_operand(dest),
+	return create_instruction(operation, create_register_operand(dest),
 			   create_immediate_operand(src), w_bit);
 }
 
-instruction_t immed_to_regm(simulator_t *simulator) {
+instruction_t immed_to_regm(simulator_t *simulator, operation_t operation) {
 	decoder_t *decoder = simulator->decoder;
 	uint8_t byte = decoder->bin_buffer[simulator->cpu.instr_ptr];
 	uint8_t s_bit = (byte >> 1) & 0b01;
@@ -802,10 +2161,11 @@ instruction_t immed_to_regm(simulator_t *simulator) {
 	uint8_t op_octet = (byte >> 3) & 0b111;
 	uint8_t regm = byte & 0b111;
 
-	operation_t operation;
+	// The table hands us add. or/adc/sbb/and/xor aren't modelled: they are
+	// decoded for their length and come back empty, which runs as unhandled.
+	bool modelled = true;
 	switch (op_octet) {
 		case 0b000: {
-			operation = OP_ADD;
 			break;
 		}
 		case 0b101: {
@@ -816,6 +2176,10 @@ instruction_t immed_to_regm(simulator_t *simulator) {
 			operation = OP_CMP;
 			break;
 		}
+		default: {
+			modelled = false;
+			break;
+		}
 	}
 	instruction_data_t instr = {.operation = operation,
 		.d_s_bit = s_bit,
@@ -823,21 +2187,25 @@ instruction_t immed_to_regm(simulator_t *simulator) {
 		.reg = op_octet,
 		.regm = regm};
 
+	instruction_t instruction = {};
 	switch (mod) {
 		case 0b11: {
-			return handle_mod_11_immed(instr, simulator);
+			instruction = handle_mod_11_immed(instr, simulator);
+			break;
 		}
 		case 0b00: {
-			return handle_mod_00_immed(instr, simulator);
+			instruction = handle_mod_00_immed(instr, simulator);
+			break;
 		}
 		case 0b10: {
-			return handle_mod_10_immed(instr, simulator);
+			instruction = handle_mod_10_immed(instr, simulator);
+			break;
 		}
 	}
-	return (instruction_t){};
+	return modelled ? instruction : (instruction_t){};
 }
 
-instruction_t mov_immed_to_mem(simulator_t *simulator) {
+instruction_t mov_immed_to_mem(simulator_t *simulator, operation_t operation) {
 	decoder_t *decoder = simulator->decoder;
 	uint8_t byte = decoder->bin_buffer[simulator->cpu.instr_ptr];
 	uint8_t w_bit = byte & 0b1;
@@ -848,7 +2216,7 @@ instruction_t mov_immed_to_mem(simulator_t *simulator) {
 	uint8_t reg = (byte >> 3) & 0b111;
 	uint8_t regm = byte & 0b111;
 
-	instruction_data_t instr = {.operation = OP_MOV,
+	instruction_data_t instr = {.operation = operation,
 		.d_s_bit = 0,
 		.w_bit = w_bit,
 		.reg = reg,
@@ -1191,57 +2559,103 @@ void advance_decoder(simulator_t *simulator) {
 	simulator->cpu.instr_ptr++;
 }
 
-byte_t *read_binary_file(const char *file_path, size_t *bin_size) {
-	FILE *file = fopen(file_path, "rb");
-	if (!file) {
+// Places the program image at load_address in simulated memory and points
+// CS:IP at its first byte. When the address is page aligned the file is
+// mapped copy-on-write over that part of memory, so nothing is read until
+// the decoder touches it and stores into the code only change our copy.
+// Otherwise, or if the mapping is refused, the image is read in.
+bool load_program(simulator_t *simulator, const char *file_path, uint32_t load_address) {
+	int fd = open(file_path, O_RDONLY);
+	if (fd < 0) {
 		fprintf(stderr, "Error: Could not open file '%s'\n", file_path);
-		return NULL;
-	}
-
-	// Get the size of the file - may be inefficient as files get larger
-	if (fseek(file, 0, SEEK_END) != 0) {
-		fprintf(stderr, "Error: Could not seek to end of file '%s'\n", file_path);
-		fclose(file);
-		return NULL;
+		return false;
 	}
 
-	long file_size = ftell(file);
-	if (file_size < 0) {
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
 		fprintf(stderr, "Error: Could not determine size of file '%s'\n", file_path);
-		fclose(file);
-		return NULL;
+		close(fd);
+		return false;
 	}
-
-	*bin_size = (size_t)file_size;
-
-	if (fseek(file, 0, SEEK_SET) != 0) {
-		fprintf(stderr, "Error: Could not seek to beginning of file '%s'\n", file_path);
-		fclose(file);
-		return NULL;
+	size_t size = (size_t)st.st_size;
+	if (size == 0) {
+		fprintf(stderr, "Error: File '%s' is empty\n", file_path);
+		close(fd);
+		return false;
 	}
-
-	byte_t *bin_buffer = malloc(*bin_size);
-	if (!bin_buffer) {
-		fprintf(stderr, "Error: Could not allocate memory for file '%s' (size: %zu bytes)\n", file_path, *bin_size);
-		fclose(file);
-		return NULL;
+	if (load_address % 16 != 0) {
+		fprintf(stderr, "Error: Load address 0x%05X is not a multiple of 16\n", load_address);
+		close(fd);
+		return false;
+	}
+	if (size > MEMORY_SIZE - load_address || size > 0x10000) {
+		fprintf(stderr, "Error: '%s' (%zu bytes) does not fit in a code segment at 0x%05X\n",
+			file_path, size, load_address);
+		close(fd);
+		return false;
 	}
 
-	size_t bytes_read = fread(bin_buffer, sizeof(byte_t), *bin_size, file);
-	if (bytes_read != *bin_size) {
-		fprintf(stderr, "Error: Could not read complete file '%s' (read %zu of %zu bytes)\n", file_path, bytes_read, *bin_size);
-		free(bin_buffer);
-		fclose(file);
-		return NULL;
+	byte_t *image = simulator->memory.bytes + load_address;
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	bool mapped = false;
+	if (load_address % page_size == 0) {
+		mapped = mmap(image, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED;
+	}
+	if (!mapped) {
+		size_t bytes_read = 0;
+		while (bytes_read < size) {
+			ssize_t n = pread(fd, image + bytes_read, size - bytes_read, (off_t)bytes_read);
+			if (n <= 0) {
+				fprintf(stderr, "Error: Could not read complete file '%s' (read %zu of %zu bytes)\n",
+					file_path, bytes_read, size);
+				close(fd);
+				return false;
+			}
+			bytes_read += (size_t)n;
+		}
 	}
+	close(fd);
+
+	simulator->decoder->bin_buffer = image;
+	simulator->program_size = size;
+	simulator->program_mapped = mapped;
+	simulator->cpu.cs = load_address >> 4;
+	simulator->cpu.instr_ptr = 0;
+	return true;
+}
 
-	fclose(file);
-	return bin_buffer;
+// Takes the simulator back to the state load_program starts from: zeroed
+// memory, registers and counters. The memory stays mapped, so one
+// simulator_t can run program after program.
+void unload_program(simulator_t *simulator) {
+	byte_t *image = (byte_t *)simulator->decoder->bin_buffer;
+	if (image) {
+		// A file mapped over the image goes back to anonymous zero pages
+		size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+		size_t image_size = (simulator->program_size + page_size - 1) & ~(page_size - 1);
+		if (!simulator->program_mapped ||
+		    mmap(image, image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+			memset(image, 0, simulator->program_size);
+		}
+	}
+	memory_reset(&simulator->memory);
+
+	*simulator->decoder = (decoder_t){};
+	simulator->cpu = (cpu_state_t){};
+	simulator->program_size = 0;
+	simulator->program_mapped = false;
+	simulator->status = SIMULATION_OK;
+	simulator->cycles = 0;
+	simulator->code_modified = false;
+	simulator->snapshot_generation = 0;
 }
 
 static void format_memory_address(char *buf, size_t size,
 				  const memory_address_t *addr) {
 	int pos = 0;
+	if (addr->segment != REG_NONE) {
+		pos += snprintf(buf + pos, size - pos, "%s:", reg_names[addr->segment]);
+	}
 	pos += snprintf(buf + pos, size - pos, "[");
 
 	if (addr->has_base) {
@@ -1286,51 +2700,52 @@ static void format_operand(char *buf, size_t size, const operand_t *op) {
 	}
 }
 
-void format_instruction(const instruction_t *instr) {
+void format_instruction(output_sink_t *out, const instruction_t *instr) {
     char dest_buf[64] = {0};
     char src_buf[64] = {0};
 
     // Format operands
     format_operand(dest_buf, sizeof(dest_buf), &instr->dest);
     format_operand(src_buf, sizeof(src_buf), &instr->src);
-    // Handle jump instructions (single operand)
-    if (instr->op == OP_JMP || instr->op == OP_JE || instr->op == OP_JNE ||
-        instr->op == OP_JL || instr->op == OP_JLE || instr->op == OP_JG ||
-        instr->op == OP_JGE) {
-        printf("%s %s", op_names[instr->op], dest_buf);
+    if (is_string_operation(instr->op)) {
+        // The prefixes come first, NASM style: rep/repz/repnz, then the
+        // segment override of [si]
+        const char *rep = instr->rep == REP_NZ ? "repnz "
+                          : instr->rep != REP_Z ? ""
+                          : instr->op == OP_CMPS || instr->op == OP_SCAS ? "repz " : "rep ";
+        const operand_t *source = instr->dest.type == OPERAND_MEMORY &&
+                                  instr->dest.value.memory.index_reg == REG_SI ? &instr->dest : &instr->src;
+        cpu_reg_t segment = source->type == OPERAND_MEMORY && source->value.memory.index_reg == REG_SI
+                            ? source->value.memory.segment : REG_NONE;
+        output_printf(out, "%s%s%s%s%c", rep, segment != REG_NONE ? reg_names[segment] : "",
+                      segment != REG_NONE ? " " : "", op_names[instr->op], instr->w_bit ? 'w' : 'b');
     }
-    // Only add size prefix for immediate to memory operations
-    else if (instr->src.type == OPERAND_IMMEDIATE && instr->dest.type == OPERAND_MEMORY) {
-        const char *size_ptr = instr->w_bit ? "word" : "byte";
-        printf("%s %s %s, %s", op_names[instr->op], size_ptr, dest_buf, src_buf);
+    else if (instr->op == OP_CLD || instr->op == OP_STD) {
+        output_printf(out, "%s", op_names[instr->op]);
     }
-    // Default case - no size prefix needed
-    else {
-        printf("%s %s, %s", op_names[instr->op], dest_buf, src_buf);
+    else if (is_stack_operation(instr->op)) {
+        // At most one operand; a memory one is always a word
+        if (instr->dest.type == OPERAND_NONE) {
+            output_printf(out, "%s", op_names[instr->op]);
+        } else {
+            output_printf(out, "%s %s%s", op_names[instr->op],
+                          instr->dest.type == OPERAND_MEMORY ? "word " : "", dest_buf);
+        }
     }
-}
-
-void format_instruction_to_file(const instruction_t *instr, FILE *output_file) {
-    char dest_buf[64] = {0};
-    char src_buf[64] = {0};
-
-    // Format operands
-    format_operand(dest_buf, sizeof(dest_buf), &instr->dest);
-    format_operand(src_buf, sizeof(src_buf), &instr->src);
     // Handle jump instructions (single operand)
-    if (instr->op == OP_JMP || instr->op == OP_JE || instr->op == OP_JNE ||
+    else if (instr->op == OP_JMP || instr->op == OP_JE || instr->op == OP_JNE ||
         instr->op == OP_JL || instr->op == OP_JLE || instr->op == OP_JG ||
         instr->op == OP_JGE) {
-        fprintf(output_file, "%s %s", op_names[instr->op], dest_buf);
+        output_printf(out, "%s %s", op_names[instr->op], dest_buf);
     }
     // Only add size prefix for immediate to memory operations
     else if (instr->src.type == OPERAND_IMMEDIATE && instr->dest.type == OPERAND_MEMORY) {
         const char *size_ptr = instr->w_bit ? "word" : "byte";
-        fprintf(output_file, "%s %s %s, %s", op_names[instr->op], size_ptr, dest_buf, src_buf);
+        output_printf(out, "%s %s %s, %s", op_names[instr->op], size_ptr, dest_buf, src_buf);
     }
     // Default case - no size prefix needed
     else {
-        fprintf(output_file, "%s %s, %s", op_names[instr->op], dest_buf, src_buf);
+        output_printf(out, "%s %s, %s", op_names[instr->op], dest_buf, src_buf);
     }
 }
 
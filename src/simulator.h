@@ -1,6 +1,7 @@
 #ifndef SIMULATOR_H
 #define SIMULATOR_H
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdatomic.h>
 #include <stdint.h>
@@ -12,7 +13,7 @@
 typedef uint8_t byte_t;
 
 typedef struct Decoder {
-	const byte_t *bin_buffer;
+	const byte_t *bin_buffer; // Start of the code segment in simulated memory
 } decoder_t;
 
 typedef enum Register {
@@ -26,6 +27,9 @@ typedef enum Register {
 	REG_AH, REG_BH, REG_CH, REG_DH,
 	// 8-bit registers (low)
 	REG_AL, REG_BL, REG_CL, REG_DL,
+	// Segment registers, in sreg encoding order
+	REG_ES, REG_CS, REG_SS, REG_DS,
+	REG_COUNT
 } cpu_reg_t;
 
 static const char* const reg_names[] = {
@@ -38,11 +42,17 @@ static const char* const reg_names[] = {
 	[REG_AH] = "ah", [REG_BH] = "bh", [REG_CH] = "ch", [REG_DH] = "dh",
 	// 8-bit low
 	[REG_AL] = "al", [REG_BL] = "bl", [REG_CL] = "cl", [REG_DL] = "dl",
+	// Segment
+	[REG_ES] = "es", [REG_CS] = "cs", [REG_SS] = "ss", [REG_DS] = "ds",
 };
 
 typedef enum Operation {
 	OP_MOV,
 	OP_ADD, OP_SUB, OP_CMP,
+	OP_MOVS, OP_CMPS, OP_STOS, OP_LODS, OP_SCAS,
+	OP_CLD, OP_STD,
+	OP_PUSH, OP_POP, OP_PUSHF, OP_POPF,
+	OP_CALL, OP_RET,
 	OP_JMP, OP_JNZ, OP_JB,
 	OP_JE, OP_JNE, OP_JL, OP_JLE, OP_JG, OP_JGE, OP_JBE, OP_JP,
 	OP_JO, OP_JS, OP_JNL, OP_JA, OP_JNB, OP_JNP, OP_JNO, OP_JNS,OP_JCXZ,
@@ -51,6 +61,10 @@ typedef enum Operation {
 
 static const char *const op_names[] = {
     [OP_MOV] = "mov",     [OP_ADD] = "add",     [OP_SUB] = "sub",     [OP_CMP] = "cmp",
+    [OP_MOVS] = "movs",   [OP_CMPS] = "cmps",   [OP_STOS] = "stos",  [OP_LODS] = "lods",
+    [OP_SCAS] = "scas",   [OP_CLD] = "cld",     [OP_STD] = "std",
+    [OP_PUSH] = "push",   [OP_POP] = "pop",     [OP_PUSHF] = "pushf", [OP_POPF] = "popf",
+    [OP_CALL] = "call",   [OP_RET] = "ret",
     [OP_JMP] = "jmp",     [OP_JNZ] = "jnz",     [OP_JB] = "jb",
     [OP_JE] = "je",       [OP_JNE] = "jne",     [OP_JL] = "jl",      [OP_JLE] = "jle",
     [OP_JG] = "jg",       [OP_JGE] = "jge",     [OP_JBE] = "jbe",    [OP_JP] = "jp",
@@ -80,6 +94,7 @@ typedef struct MemoryAddress {
     cpu_reg_t base_reg;     // BX or BP
     cpu_reg_t index_reg;    // SI or DI
     int16_t displacement;  // 16-bit displacement
+    cpu_reg_t segment;      // Override prefix, REG_NONE for the default segment
     bool has_base : 1;
     bool has_index : 1;
     bool has_displacement : 1;
@@ -96,9 +111,34 @@ typedef struct Operand {
 	} value;
 } operand_t;
 
+// F3 repeats a string instruction CX times, stopping cmps and scas early
+// once they compare unequal; F2 stops them once they compare equal
+typedef enum RepeatPrefix {
+	REP_NONE = 0,
+	REP_Z,  // rep / repz
+	REP_NZ, // repnz
+} repeat_prefix_t;
+
+// movs/cmps/stos/lods/scas name their elements as memory operands: [si] in
+// DS or its override, and es:[di]
+static inline bool is_string_operation(operation_t op)
+{
+	return op >= OP_MOVS && op <= OP_SCAS;
+}
+
+// push/pop/pushf/popf/call/ret move words through SS:SP. Their one operand,
+// if any, is in dest: what push and pop move, where call goes (an immediate
+// relative to the next instruction, or a register or memory operand holding
+// the target) and how many bytes ret drops after popping.
+static inline bool is_stack_operation(operation_t op)
+{
+	return op >= OP_PUSH && op <= OP_RET;
+}
+
 typedef struct Instruction {
 	operation_t op;
 	uint8_t w_bit;
+	uint8_t rep; // repeat_prefix_t, only set on string instructions
 	operand_t dest;
 	operand_t src;
 } instruction_t;
@@ -130,8 +170,42 @@ typedef union {
   REGISTER(si)                                                                 \
   REGISTER(di)
 
-#define FLAG_ZF (1 << 6) // Zero Flag (bit 6)
-#define FLAG_SF (1 << 7) // Sign Flag (bit 7)
+#define SEGMENT_REGISTERS                                                      \
+  REGISTER(es)                                                                 \
+  REGISTER(cs)                                                                 \
+  REGISTER(ss)                                                                 \
+  REGISTER(ds)
+
+#define FLAG_CF (1 << 0)  // Carry Flag (bit 0)
+#define FLAG_PF (1 << 2)  // Parity Flag (bit 2)
+#define FLAG_AF (1 << 4)  // Auxiliary Carry Flag (bit 4)
+#define FLAG_ZF (1 << 6)  // Zero Flag (bit 6)
+#define FLAG_SF (1 << 7)  // Sign Flag (bit 7)
+#define FLAG_TF (1 << 8)  // Trap Flag (bit 8)
+#define FLAG_IF (1 << 9)  // Interrupt Flag (bit 9)
+#define FLAG_DF (1 << 10) // Direction Flag (bit 10)
+#define FLAG_OF (1 << 11) // Overflow Flag (bit 11)
+#define FLAGS_ARITHMETIC (FLAG_CF | FLAG_PF | FLAG_AF | FLAG_ZF | FLAG_SF | FLAG_OF)
+#define FLAGS_CONTROL (FLAG_TF | FLAG_IF | FLAG_DF)
+// Bits the 8086 has no flag for read as 1 in the image pushf stores
+#define FLAGS_UNUSED_ONES 0xF002
+
+// The arithmetic flags are evaluated lazily: ALU instructions only record
+// what they computed, and flags are derived from that when something reads
+// them. LAZY_FLAGS_NONE means `flags` is already up to date.
+typedef enum LazyFlagsOp {
+	LAZY_FLAGS_NONE = 0,
+	LAZY_FLAGS_ADD,
+	LAZY_FLAGS_SUB, // Also cmp
+} lazy_flags_op_t;
+
+typedef struct LazyFlags {
+	uint8_t op; // lazy_flags_op_t
+	uint8_t w_bit;
+	uint16_t dest;
+	uint16_t src;
+	uint16_t result;
+} lazy_flags_t;
 
 typedef struct {
 #define REGISTER(reg) general_reg_t reg;
@@ -140,9 +214,11 @@ typedef struct {
 
 #define REGISTER(reg) uint16_t reg;
   POINTER_REGISTERS;
+  SEGMENT_REGISTERS;
 #undef REGISTER
 
-  uint16_t flags;
+  uint16_t flags; // Arithmetic bits are stale while lazy_flags.op is set
+  lazy_flags_t lazy_flags;
   uint16_t instr_ptr;
 } cpu_state_t;
 
@@ -152,28 +228,582 @@ typedef struct {
   bool is_8bit;
 } register_data_t;
 
+// Where each cpu_reg_t lives in cpu_state_t. Every register is read and
+// written through the 16-bit word that holds it, so a byte half is just a
+// mask and shift and no access needs to branch on the register.
+typedef struct RegisterAccessor {
+	uint16_t offset; // Byte offset of the 16-bit storage in cpu_state_t
+	uint16_t mask;   // 0xFFFF for words, 0x00FF for byte halves, 0 for REG_NONE
+	uint8_t shift;   // 8 for the high byte halves
+	const char *name;
+} register_accessor_t;
+
+extern const register_accessor_t register_accessors[REG_COUNT];
+
+static inline uint16_t read_register(const cpu_state_t *cpu, cpu_reg_t reg)
+{
+	const register_accessor_t *access = &register_accessors[reg];
+	uint16_t storage = *(const uint16_t *)((const char *)cpu + access->offset);
+	return (storage >> access->shift) & access->mask;
+}
+
+static inline void write_register(cpu_state_t *cpu, cpu_reg_t reg, uint16_t value)
+{
+	const register_accessor_t *access = &register_accessors[reg];
+	uint16_t *storage = (uint16_t *)((char *)cpu + access->offset);
+	uint16_t mask = access->mask << access->shift;
+	*storage = (*storage & ~mask) | ((value << access->shift) & mask);
+}
+
+// The 8086 forms 20-bit physical addresses as segment * 16 + offset, so the
+// whole address space is 1 MB. It is one flat mapping, so every access is an
+// index into `bytes`.
+#define MEMORY_SIZE (1 << 20)
+#define MEMORY_MASK (MEMORY_SIZE - 1)
+
+// Programs are loaded into their own segment above the data segments, which
+// all start at 0, so data only lands on the code when a program aims there.
+#define DEFAULT_LOAD_ADDRESS 0x10000
+
+// Writes mark the 4 KB pages they touch, so dumping or resetting memory only
+// has to visit pages a program actually wrote to.
+#define MEMORY_PAGE_SHIFT 12
+#define MEMORY_PAGE_SIZE (1 << MEMORY_PAGE_SHIFT)
+#define MEMORY_PAGE_COUNT (MEMORY_SIZE >> MEMORY_PAGE_SHIFT)
+
+typedef struct SegmentedAddress {
+	uint16_t segment;
+	uint16_t offset;
+} segmented_address_t;
+
 typedef struct {
-	int16_t data[65536];
-	int16_t last_used;
+	uint8_t *bytes;     // MEMORY_SIZE bytes, mmap'd by memory_init
+	size_t mapped_size; // Size of the mapping, rounded up to the page size used
+	uint64_t dirty[MEMORY_PAGE_COUNT / 64];   // One bit per written page
+	uint64_t changed[MEMORY_PAGE_COUNT / 64]; // Pages written since the last snapshot or restore
 } memory_data_t;
 
+// How far back a store into the code looks for cached instructions that
+// cover it; comfortably more than the longest 8086 encoding
+#define DECODE_MAX_LENGTH 16
+
+// Decoded form of the instruction starting at a given byte offset, along with
+// its encoded length so a cache hit can step instr_ptr without re-decoding.
+typedef struct DecodedInstruction {
+	instruction_t instruction;
+	uint8_t length;
+	bool is_decoded;
+} decoded_instruction_t;
+
+// Instructions a block collects before it ends without a branch, and how far
+// superblock formation may grow one
+#define BLOCK_MAX_INSTRUCTIONS 32
+#define SUPERBLOCK_MAX_INSTRUCTIONS 128
+// Times an exit must be followed before its target is appended to the block
+#define SUPERBLOCK_THRESHOLD 16
+
+typedef struct BlockEntry {
+	const instruction_t *instruction;
+	uint16_t ip;
+	uint16_t next_ip; // instr_ptr while it executes, as fetch_instruction leaves it
+	bool check_exit;  // A branch, a store that may land on the code, or a rep instruction
+} block_entry_t;
+
+// Predecoded instructions that run back to back, ending at a jump, loop, call
+// or ret.
+// Each exit keeps a link to the block it leads to. Once an exit has been
+// taken often enough, the block at its end is appended to form a superblock.
+// The branch it crossed then leaves early whenever it goes the other way.
+typedef struct BasicBlock {
+	block_entry_t *entries;
+	uint16_t count;
+	uint16_t exit_ip[2];             // Where the last branch goes when taken / not taken
+	struct BasicBlock *successor[2]; // Block at each exit_ip, linked on first use
+	uint32_t exit_count[2];          // Times each exit was followed since the block last grew
+	uint64_t fuel_cost;              // count, or RUN_UNLIMITED for a block starting at a breakpoint
+} basic_block_t;
+
+// ===== CYCLE ESTIMATION =====
+
+// With --cycles every instruction is charged its 8086 clock count: a base
+// cost for the operation and operand form, plus the effective address time
+// of a memory operand, plus ODD_ADDRESS_PENALTY for each word transferred at
+// an odd address. Jumps and loops cost more when they branch, and a repeated
+// string instruction pays for every element it processes.
+#define ODD_ADDRESS_PENALTY 4
+
+typedef enum OperandForm {
+	FORM_NONE = 0, // Not costed, e.g. an undecoded byte
+	FORM_REG_REG,
+	FORM_REG_IMM,
+	FORM_REG_MEM,
+	FORM_MEM_REG,
+	FORM_MEM_IMM,
+	FORM_COUNT
+} operand_form_t;
+
+typedef struct InstructionTiming {
+	uint8_t clocks;    // Before effective address time and penalties
+	uint8_t transfers; // Memory accesses, each paying the odd address penalty
+} instruction_timing_t;
+
+// ===== PROFILER =====
+
+// Execution counts collected with --profile. Every counter is a flat array
+// indexed by the instruction's instr_ptr, so profiling an instruction is a
+// couple of increments.
+#define PROFILE_TOP_ADDRESSES 20
+#define PROFILE_TOP_LOOPS 10
+// Return addresses the shadow stack keeps, like a CPU's return stack buffer:
+// deeper calls overwrite the oldest, whose returns then go unpredicted
+#define PROFILE_RETURN_STACK_DEPTH 16
+
+typedef struct Profile {
+	size_t program_size;
+	uint64_t *hits;      // Executions of the instruction at each instr_ptr
+	uint64_t *taken;     // Jumps and loops at each instr_ptr that branched
+	uint64_t *not_taken; // ... and that fell through
+	uint64_t operations[LOOP_LOOPNZ + 1]; // Executions of each operation_t
+	uint16_t return_stack[PROFILE_RETURN_STACK_DEPTH]; // Shadow of the calls' return addresses
+	uint32_t return_top;   // Pushes so far; the newest is at return_top - 1
+	uint32_t return_depth; // Entries held, up to PROFILE_RETURN_STACK_DEPTH
+	uint64_t mispredicted_returns; // rets that did not go where the shadow stack said
+} profile_t;
+
+// Counts an executed instruction. `next_ip` is where it ends and `new_ip`
+// where execution went, which differ when a jump or loop branched. Calls
+// push their return address on the shadow stack, and each ret is checked
+// against the address it pops.
+static inline void profile_instruction(profile_t *profile, uint16_t ip, operation_t op,
+				       uint16_t next_ip, uint16_t new_ip)
+{
+	profile->hits[ip]++;
+	profile->operations[op]++;
+	if (op >= OP_JMP)
+	{
+		if (new_ip != next_ip)
+		{
+			profile->taken[ip]++;
+		}
+		else
+		{
+			profile->not_taken[ip]++;
+		}
+	}
+	else if (op == OP_CALL)
+	{
+		profile->return_stack[profile->return_top++ % PROFILE_RETURN_STACK_DEPTH] = next_ip;
+		if (profile->return_depth < PROFILE_RETURN_STACK_DEPTH)
+		{
+			profile->return_depth++;
+		}
+	}
+	else if (op == OP_RET)
+	{
+		// An empty shadow stack predicts nothing
+		if (profile->return_depth == 0)
+		{
+			profile->mispredicted_returns++;
+		}
+		else
+		{
+			profile->return_depth--;
+			if (profile->return_stack[--profile->return_top % PROFILE_RETURN_STACK_DEPTH] != new_ip)
+			{
+				profile->mispredicted_returns++;
+			}
+		}
+	}
+}
+
+// ===== BINARY TRACE =====
+
+// A binary trace is a TRACE_MAGIC header followed by fixed-size records, one
+// per event, in the order the text trace would print them. trace_format
+// renders a trace back into the text format.
+#define TRACE_MAGIC "8086TRC"
+#define TRACE_VERSION 7
+#define TRACE_BUFFER_RECORDS 65536
+#define TRACE_W_BIT 0x80 // Set in the detail byte of instruction records
+
+typedef enum TraceRecordType {
+	TRACE_INSTRUCTION = 1, // detail: operation | TRACE_W_BIT, data: operands
+	TRACE_REGISTER,        // detail: register, data: value before and after
+	TRACE_FLAGS,           // detail: lazy_flags_op_t | TRACE_W_BIT, data: ALU operands and result,
+	                       // or the whole register in result for LAZY_FLAGS_NONE
+	TRACE_MEMORY_WRITE,    // detail: w bit, data: segment:offset and value
+	TRACE_UNHANDLED,       // Instruction the simulator could not execute
+	TRACE_END,             // ip: final instr_ptr
+	TRACE_START,           // ip: first instr_ptr, detail: counting cycles, data: segment registers
+	TRACE_IMAGE,           // ip: code offset, detail: byte count, data: program bytes
+	TRACE_CYCLES,          // data: clocks charged to the instruction
+	TRACE_REPEAT,          // detail: repeat_prefix_t of the instruction record that follows
+} trace_record_type_t;
+
+#define TRACE_HAS_BASE (1 << 0)
+#define TRACE_HAS_INDEX (1 << 1)
+#define TRACE_HAS_DISPLACEMENT (1 << 2)
+#define TRACE_SEGMENT_SHIFT 4 // Override segment in the high bits, 1 + sreg
+
+typedef struct TraceOperand {
+	uint8_t type;      // operand_type_t
+	uint8_t reg;       // Register, or base register of a memory operand
+	uint8_t index_reg; // Index register of a memory operand
+	uint8_t has;       // TRACE_HAS_* bits of a memory operand
+	int16_t value;     // Immediate, displacement or label offset
+} trace_operand_t;
+
+typedef struct TraceRecord {
+	uint8_t type;
+	uint8_t detail;
+	uint16_t ip; // Start of the instruction the event belongs to
+	union {
+		struct {
+			trace_operand_t dest;
+			trace_operand_t src;
+		} instruction;
+		struct {
+			uint16_t before;
+			uint16_t after;
+		} reg;
+		struct {
+			uint16_t dest;
+			uint16_t src;
+			uint16_t result;
+		} flags;
+		struct {
+			uint16_t es, cs, ss, ds;
+		} segments;
+		uint8_t image[12];
+		uint32_t clocks;
+		struct {
+			uint16_t segment;
+			uint16_t offset;
+			uint16_t value;
+		} memory;
+	} data;
+} trace_record_t;
+
+_Static_assert(sizeof(trace_record_t) == 16, "trace records must stay 16 bytes");
+
+typedef struct TraceHeader {
+	char magic[8];
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t reserved;
+} trace_header_t;
+
+typedef struct TraceWriter {
+	FILE *file;
+	trace_record_t *records;
+	size_t count;
+	uint16_t ip; // Instruction the following events are stamped with
+	bool failed; // A flush lost records, so the trace on disk is incomplete
+} trace_writer_t;
+
+// ===== OUTPUT SINK =====
+
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+typedef enum OutputBackend {
+	OUTPUT_STDOUT = 0,
+	OUTPUT_FILE,    // Flushed to `file` whenever the buffer fills up
+	OUTPUT_MEMORY,  // Everything is kept in `buffer`, which grows as needed
+	OUTPUT_DISCARD,
+} output_backend_t;
+
+typedef struct OutputSink {
+	output_backend_t backend;
+	FILE *file;
+	char *buffer; // NULL means unbuffered
+	size_t length;
+	size_t capacity;
+	bool failed; // Text was lost to a failed write or allocation
+} output_sink_t;
+
+// output_flush and output_free return false once any text has been lost
+bool output_init(output_sink_t *out, output_backend_t backend, FILE *file, size_t buffer_size);
+bool output_free(output_sink_t *out);
+bool output_flush(output_sink_t *out);
+void output_write(output_sink_t *out, const char *text, size_t length);
+void output_printf(output_sink_t *out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// ===== ORDERED OUTPUT =====
+
+// Numbered items run on a pool of threads, and the text each one leaves goes
+// out in item order. Workers claim items from a shared counter, and a
+// finished text waits until every item before it is written.
+typedef struct OrderedItem {
+	char *text; // Waiting for its turn
+	size_t length;
+	bool done;
+} ordered_item_t;
+
+// Writes one item's text; called in item order, under the lock
+typedef void (*ordered_write_t)(void *context, size_t index, const char *text, size_t length);
+
+typedef struct OrderedOutput {
+	ordered_item_t *items;
+	size_t count;
+	atomic_size_t next_item;
+	pthread_mutex_t lock; // Guards done, next_output and whatever write writes to
+	size_t next_output;   // First item not yet written
+	ordered_write_t write;
+	void *context;
+} ordered_output_t;
+
+// ordered_free is safe after any ordered_init, even one that failed
+bool ordered_init(ordered_output_t *order, size_t count, ordered_write_t write, void *context);
+void ordered_free(ordered_output_t *order);
+bool ordered_run(ordered_output_t *order, long workers, void *(*worker)(void *), void *arg);
+bool ordered_claim(ordered_output_t *order, size_t *index);
+bool ordered_finish(ordered_output_t *order, size_t index, output_sink_t *out);
+
+typedef enum Verbosity {
+	VERBOSITY_TRACE = 0, // Every instruction, register change and flag update
+	VERBOSITY_FINAL,     // Only the final CPU and memory state
+	VERBOSITY_SILENT,    // Nothing; the result is reported through the exit status
+} verbosity_t;
+
+typedef enum SimulationStatus {
+	SIMULATION_OK = 0,
+	SIMULATION_UNHANDLED_INSTRUCTION,
+	SIMULATION_INSTRUCTION_LIMIT, // Stopped by --max-instructions
+	SIMULATION_CYCLE_LIMIT,       // Stopped by --max-cycles
+	SIMULATION_BREAKPOINT,        // Stopped by --break or --until
+} simulation_status_t;
+
+typedef enum Engine {
+	ENGINE_INTERPRETER = 0, // run_simulation
+	ENGINE_THREADED,        // run_simulation_threaded (--threaded)
+	ENGINE_JIT,             // run_simulation_jit (--jit)
+} engine_t;
+
+typedef struct Jit jit_t;
+typedef struct Snapshot snapshot_t;
+
+// ===== RUN CONTROL =====
+
+// Limits that end a run early. The engines only count down `fuel`, the
+// number of instructions that can run before any limit could be reached, so
+// a block that fits in the fuel runs with one compare and no other checks.
+// Once the fuel runs short, instructions go through run_control_step one at
+// a time, which checks every limit exactly; where a run stops is therefore
+// the same on every engine.
+//
+// Breakpoints are one flag per instr_ptr. Blocks end before them and one
+// starting at a breakpoint costs more than any fuel, so they always take the
+// exact path. The first instruction of a run never stops it, which lets a
+// run continue from the breakpoint it stopped at.
+//
+// A repeated string instruction can take far more than MAX_INSTRUCTION_CLOCKS,
+// so under a cycle limit the engines refuel after each one.
+#define RUN_UNLIMITED UINT64_MAX
+#define RUN_BREAKPOINT_COUNT 0x10000 // One flag per 16-bit instr_ptr
+#define MAX_INSTRUCTION_CLOCKS 64    // Most instruction_cycles charges for anything but rep
+
+typedef struct RunControl {
+	uint64_t max_instructions; // Per run, 0 for no limit
+	uint64_t max_cycles;       // Against the cycle total, 0 for no limit; needs count_cycles
+	uint8_t *breakpoints;      // RUN_BREAKPOINT_COUNT flags, NULL for none
+	uint64_t fuel;
+	uint64_t granted;                 // Fuel at the last refuel
+	uint64_t instructions;            // Run before the last refuel
+	simulation_status_t stopped_over; // Status a stop replaced, put back when running again
+} run_control_t;
+
 typedef struct {
   cpu_state_t cpu;
   decoder_t *decoder;
   memory_data_t memory;
   size_t program_size;
+  decoded_instruction_t *decode_cache; // One slot per program byte, indexed by instr_ptr
+  basic_block_t **block_cache;         // Block starting at each instr_ptr, NULL until first run
+  bool code_modified;                  // A store hit the program image since blocks were built
+  verbosity_t verbosity;
+  simulation_status_t status;
+  trace_writer_t *trace; // Binary trace sink, NULL when not tracing
+  output_sink_t output;  // Where all text output goes
+  jit_t *jit;            // Translated blocks, only set while running with --jit
+  bool count_cycles;     // Estimate 8086 clocks (--cycles)
+  uint64_t cycles;       // Clocks charged so far
+  profile_t *profile;    // Execution counts, NULL unless running with --profile
+  bool program_mapped;   // load_program mapped the file over the program image
+  uint64_t snapshot_generation; // Memory matches that snapshot apart from memory.changed, 0 if unknown
+  run_control_t control;      // Instruction and cycle limits and breakpoints
 } simulator_t;
 
+// ===== SNAPSHOTS =====
+
+// A snapshot holds the CPU state and a copy of every memory page that can be
+// nonzero: the pages written so far and the pages under the program image.
+// Restoring the snapshot a simulator was last taken from or restored to only
+// copies back the pages written since (memory.changed), so it takes
+// microseconds however much memory the program set up beforehand. Snapshots
+// are told apart by a generation number no other snapshot in the process
+// shares, so a new snapshot that reuses a freed one's memory is never taken
+// for it.
+//
+// A snapshot file is a snapshot_header_t followed by the saved pages in
+// address order.
+#define SNAPSHOT_MAGIC "8086SNP"
+#define SNAPSHOT_VERSION 1
+
+struct Snapshot {
+	uint64_t generation; // Unique per snapshot, never 0
+	cpu_state_t cpu;
+	uint32_t image_address; // Physical address of the program image
+	uint32_t program_size;
+	uint64_t cycles;
+	simulation_status_t status;
+	uint64_t dirty[MEMORY_PAGE_COUNT / 64]; // memory.dirty when the snapshot was taken
+	uint8_t *pages[MEMORY_PAGE_COUNT];      // Copy of each page, NULL where it was all zeroes
+	uint8_t *page_data;                     // Backs `pages`
+};
+
+typedef struct SnapshotHeader {
+	char magic[8];
+	uint16_t version;
+	uint16_t page_shift;
+	uint32_t page_count; // Saved pages following the header
+	cpu_state_t cpu;
+	uint32_t image_address;
+	uint32_t program_size;
+	uint64_t cycles;
+	uint32_t status;
+	uint32_t reserved;
+	uint64_t dirty[MEMORY_PAGE_COUNT / 64];
+	uint64_t saved[MEMORY_PAGE_COUNT / 64]; // Which pages follow
+} snapshot_header_t;
+
+// ===== BATCH RUNNER =====
+
+// --batch runs many programs on a pool of worker threads. Each worker keeps
+// one simulator_t, and the memory mapped for it, for every program it runs.
+#define BATCH_OUTPUT_SIZE (64 << 10)
+
+typedef struct BatchOptions {
+	engine_t engine;
+	verbosity_t verbosity;
+	bool count_cycles;
+	bool profile;
+	uint32_t load_address;
+	uint64_t max_instructions; // Per program, 0 for no limit
+	uint64_t max_cycles;       // Per program, 0 for no limit; implies count_cycles
+	int workers;               // 0 starts one per online CPU
+	const char *output_dir;    // Where each program's <name>.txt goes; NULL combines them on stdout
+} batch_options_t;
+
+// ===== DISASSEMBLER =====
+
+// --disasm decodes a whole image in a linear sweep without running it and
+// writes NASM source that assembles back to the same bytes
+#define DISASM_OUTPUT_SIZE (4 << 20)
+
+// Per-instruction output is only produced at full trace verbosity; the hot
+// paths test this before doing any formatting work at all.
+static inline bool is_tracing(const simulator_t *simulator)
+{
+	return simulator->verbosity == VERBOSITY_TRACE;
+}
+
 void run_simulation(simulator_t *simulator);
-void run_simulation_to_file(simulator_t *simulator, FILE *output_file);
+void run_simulation_threaded(simulator_t *simulator);
+void run_simulation_jit(simulator_t *simulator);
+void run_engine(simulator_t *simulator, engine_t engine);
+void run_control_start(simulator_t *simulator);
+bool run_control_step(simulator_t *simulator);
+void run_control_refuel(simulator_t *simulator);
+// Instructions the current or last run executed. Translated JIT code only
+// counts itself under run controls.
+uint64_t instructions_run(const simulator_t *simulator);
+const char *stop_reason(simulation_status_t status);
+
+static inline bool is_breakpoint(const simulator_t *simulator, uint16_t ip)
+{
+	return simulator->control.breakpoints && simulator->control.breakpoints[ip];
+}
+
+// Counts the instruction at instr_ptr against the fuel, taking the exact path
+// when the fuel is used up or `checked` says the instruction needs it.
+// Returns true if the run stops before it.
+static inline bool run_control_consume(simulator_t *simulator, bool checked)
+{
+	run_control_t *control = &simulator->control;
+	if (control->fuel == 0 || checked)
+	{
+		return run_control_step(simulator);
+	}
+	control->fuel--;
+	return false;
+}
+void simulate_instruction(simulator_t *simulator);
+void jit_flush(jit_t *jit);
+
+// Simulated memory
+bool memory_init(memory_data_t *memory);
+void memory_free(memory_data_t *memory);
+void memory_reset(memory_data_t *memory);
+
+// Builds the 20-bit physical address of segment:offset
+static inline uint32_t physical_address(uint16_t segment, uint16_t offset)
+{
+	return (((uint32_t)segment << 4) + offset) & MEMORY_MASK;
+}
+
+// Words are little-endian and may be unaligned. Like the 8086, the high byte
+// of a word at offset 0xFFFF comes from offset 0 of the same segment.
+static inline uint16_t memory_read(const memory_data_t *memory, segmented_address_t address, uint8_t w_bit)
+{
+	uint16_t value = memory->bytes[physical_address(address.segment, address.offset)];
+	if (w_bit)
+	{
+		value |= memory->bytes[physical_address(address.segment, address.offset + 1)] << 8;
+	}
+	return value;
+}
+
+static inline void memory_mark_dirty(memory_data_t *memory, uint32_t address)
+{
+	uint32_t page = address >> MEMORY_PAGE_SHIFT;
+	memory->dirty[page / 64] |= (uint64_t)1 << (page % 64);
+	memory->changed[page / 64] |= (uint64_t)1 << (page % 64);
+}
+
+static inline void memory_write(memory_data_t *memory, segmented_address_t address, uint16_t value, uint8_t w_bit)
+{
+	memory->bytes[physical_address(address.segment, address.offset)] = (uint8_t)value;
+	if (w_bit)
+	{
+		memory->bytes[physical_address(address.segment, address.offset + 1)] = (uint8_t)(value >> 8);
+	}
+}
+
+// Decode cache
+bool init_decode_cache(simulator_t *simulator);
+void free_decode_cache(simulator_t *simulator);
+const decoded_instruction_t *fetch_instruction(simulator_t *simulator);
+bool init_block_cache(simulator_t *simulator);
+void free_block_cache(simulator_t *simulator);
+basic_block_t *next_block(simulator_t *simulator, basic_block_t *previous);
+uint16_t run_block(simulator_t *simulator, const basic_block_t *block, bool tracing);
 
 // Decoder function declarations
 instruction_t parse_instruction(simulator_t *simulator);
 instruction_t mod_regm_reg(simulator_t *simulator, operation_t operation);
-instruction_t mov_immed_to_reg(simulator_t *simulator);
-instruction_t immed_to_regm(simulator_t *simulator);
+instruction_t mov_immed_to_reg(simulator_t *simulator, operation_t operation);
+instruction_t immed_to_regm(simulator_t *simulator, operation_t operation);
 instruction_t immed_to_acc(simulator_t *simulator, operation_t operation);
-instruction_t mov_immed_to_mem(simulator_t *simulator);
+instruction_t mov_immed_to_mem(simulator_t *simulator, operation_t operation);
+instruction_t mov_segment(simulator_t *simulator, operation_t operation);
+instruction_t segment_prefix(simulator_t *simulator, operation_t operation);
+instruction_t repeat_prefix(simulator_t *simulator, operation_t operation);
+instruction_t string_opcode(simulator_t *simulator, operation_t operation);
+instruction_t no_operand_opcode(simulator_t *simulator, operation_t operation);
+instruction_t stack_register(simulator_t *simulator, operation_t operation);
+instruction_t stack_segment(simulator_t *simulator, operation_t operation);
+instruction_t stack_regm(simulator_t *simulator, operation_t operation);
+instruction_t immed16_opcode(simulator_t *simulator, operation_t operation);
 
 instruction_t handle_mod_11(instruction_data_t instr, simulator_t *simulator);
 instruction_t handle_mod_00(instruction_data_t instr, simulator_t *simulator);
@@ -197,8 +827,9 @@ int slice_peek_bits(simulator_t *simulator, int start, int end);
 // Utility functions (from decoder_helpers.h)
 char *regm_to_addr(int regm);
 char *reg_to_string(int reg, int is_16_bit);
-byte_t *read_binary_file(const char *file_path, size_t *bin_size);
-void format_instruction(const instruction_t* inst);
+bool load_program(simulator_t *simulator, const char *file_path, uint32_t load_address);
+void unload_program(simulator_t *simulator);
+void format_instruction(output_sink_t *out, const instruction_t *instr);
 void print_encoding_to_int(char *encoding);
 void print_position(const byte_t *buffer, int pos);
 void byte_to_binary(uint8_t byte, char* binary);
@@ -206,25 +837,70 @@ int get_bits(int num, int start, int end);
 cpu_reg_t bits_to_reg(int reg, int is_16_bit);
 
 // Simulator functions
-void eval_instruction(instruction_t instr, simulator_t *simulator);
-void process_cpu_flags(uint16_t result, simulator_t *simulator);
+void eval_instruction(const instruction_t *instr, simulator_t *simulator);
+void update_flags(lazy_flags_op_t op, uint16_t dest, uint16_t src, uint16_t result, uint8_t w_bit,
+		  simulator_t *simulator);
+uint16_t materialize_flags(simulator_t *simulator);
+bool test_flag(const simulator_t *simulator, uint16_t flag);
 void format_cpu_state(simulator_t *simulator);
 void format_memory_state(simulator_t *simulator);
 void format_cpu_flags(simulator_t *simulator);
-void format_cpu_state_to_file(simulator_t *simulator, FILE *output_file);
-void format_memory_state_to_file(simulator_t *simulator, FILE *output_file);
-void format_instruction_to_file(const instruction_t *instr, FILE *output_file);
-void format_reg_before_after_to_file(register_data_t prev_data, uint16_t src_value, FILE *output_file);
-void handle_mov(instruction_t instr, simulator_t *simulator);
-void handle_add(instruction_t instr, simulator_t *simulator);
-void handle_sub(instruction_t instr, simulator_t *simulator);
-void handle_cmp(instruction_t instr, simulator_t *simulator);
-void handle_jmp(instruction_t instr, simulator_t *simulator);
-void handle_jnz(instruction_t instr, simulator_t *simulator);
-
-uint16_t evaluate_src(operand_t src, simulator_t *simulator);
-register_data_t get_register_data(register_t reg, simulator_t *simulator);
-void set_register_data(register_t reg, uint16_t src_value, simulator_t *simulator);
-void format_reg_before_after(register_data_t prev_data, uint16_t src_value);
+void format_cycles(output_sink_t *out, uint32_t clocks, uint64_t total);
+uint32_t instruction_cycles(const instruction_t *instr, simulator_t *simulator);
+void count_cycles(const instruction_t *instr, simulator_t *simulator);
+void handle_mov(const instruction_t *instr, simulator_t *simulator);
+void handle_add(const instruction_t *instr, simulator_t *simulator);
+void handle_sub(const instruction_t *instr, simulator_t *simulator);
+void handle_cmp(const instruction_t *instr, simulator_t *simulator);
+void handle_jmp(const instruction_t *instr, simulator_t *simulator);
+void handle_conditional_jump(const instruction_t *instr, simulator_t *simulator);
+void handle_loop(const instruction_t *instr, simulator_t *simulator);
+void handle_string(const instruction_t *instr, simulator_t *simulator);
+void handle_direction(const instruction_t *instr, simulator_t *simulator);
+void handle_push(const instruction_t *instr, simulator_t *simulator);
+void handle_pop(const instruction_t *instr, simulator_t *simulator);
+void handle_call(const instruction_t *instr, simulator_t *simulator);
+void handle_ret(const instruction_t *instr, simulator_t *simulator);
+
+// Binary trace functions
+trace_writer_t *trace_open(const char *path);
+bool trace_close(trace_writer_t *trace);
+bool trace_flush(trace_writer_t *trace);
+void trace_write_instruction(trace_writer_t *trace, uint16_t ip, const instruction_t *instr);
+void trace_write_register(trace_writer_t *trace, cpu_reg_t reg, uint16_t before, uint16_t after);
+void trace_write_flags(trace_writer_t *trace, const lazy_flags_t *flags);
+void trace_write_memory(trace_writer_t *trace, segmented_address_t address, uint16_t value, uint8_t w_bit);
+void trace_write_unhandled(trace_writer_t *trace);
+void trace_write_cycles(trace_writer_t *trace, uint32_t clocks);
+void trace_write_start(trace_writer_t *trace, const simulator_t *simulator);
+void trace_write_end(trace_writer_t *trace, uint16_t instr_ptr);
+int format_trace(FILE *trace_file, output_sink_t *out);
+
+// Snapshots
+snapshot_t *snapshot_take(simulator_t *simulator);
+void snapshot_restore(simulator_t *simulator, const snapshot_t *snapshot);
+void snapshot_free(snapshot_t *snapshot);
+bool snapshot_write(const snapshot_t *snapshot, const char *path);
+snapshot_t *snapshot_read(const char *path);
+bool run_to_instruction(simulator_t *simulator, uint64_t instructions, int32_t ip);
+
+// Batch runner
+int run_batch(const batch_options_t *options, char *const inputs[], int input_count);
+
+// Disassembler
+int disassemble_file(const char *path, int workers, output_sink_t *out);
+
+// Profiler
+profile_t *profile_create(size_t program_size);
+void profile_free(profile_t *profile);
+void format_profile(simulator_t *simulator);
+
+segmented_address_t effective_address(const memory_address_t *mem, simulator_t *simulator);
+uint16_t evaluate_src(operand_t src, uint8_t w_bit, simulator_t *simulator);
+register_data_t get_register_data(cpu_reg_t reg, simulator_t *simulator);
+void set_register_data(cpu_reg_t reg, uint16_t src_value, simulator_t *simulator);
+void set_memory_data(segmented_address_t address, uint16_t src_value, uint8_t w_bit, simulator_t *simulator);
+void report_register_change(cpu_reg_t reg, register_data_t prev_data, uint16_t value, simulator_t *simulator);
+void format_reg_before_after(output_sink_t *out, register_data_t prev_data, uint16_t src_value);
 
 #endif
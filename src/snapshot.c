@@ -0,0 +1,349 @@
+#include "simulator.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// SNAPSHOTS
+//
+// snapshot_take copies the CPU state and the pages that can be nonzero.
+// snapshot_restore puts them back, and for the snapshot a simulator last
+// took or restored it only has to rewrite the pages written since, which
+// memory tracks in `changed` next to `dirty`.
+
+// Generation of the last snapshot made, shared by every simulator in the
+// process
+static atomic_uint_fast64_t last_generation;
+
+static uint32_t image_address(const simulator_t *simulator)
+{
+	return (uint32_t)(simulator->decoder->bin_buffer - simulator->memory.bytes);
+}
+
+// Adds the pages under the program image, which hold code the program never
+// wrote
+static void add_image_pages(const simulator_t *simulator, uint64_t *pages)
+{
+	if (!simulator->decoder->bin_buffer || simulator->program_size == 0)
+	{
+		return;
+	}
+	uint32_t start = image_address(simulator);
+	uint32_t last = (start + (uint32_t)simulator->program_size - 1) >> MEMORY_PAGE_SHIFT;
+	for (uint32_t page = start >> MEMORY_PAGE_SHIFT; page <= last; page++)
+	{
+		pages[page / 64] |= (uint64_t)1 << (page % 64);
+	}
+}
+
+static bool page_is_zero(const uint8_t *page)
+{
+	const uint64_t *words = (const uint64_t *)page;
+	for (size_t i = 0; i < MEMORY_PAGE_SIZE / sizeof(uint64_t); i++)
+	{
+		if (words[i])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static snapshot_t *snapshot_alloc(uint32_t page_count)
+{
+	snapshot_t *snapshot = calloc(1, sizeof(snapshot_t));
+	uint8_t *page_data = malloc(page_count ? (size_t)page_count * MEMORY_PAGE_SIZE : 1);
+	if (!snapshot || !page_data)
+	{
+		fprintf(stderr, "Error: Could not allocate snapshot of %u pages\n", page_count);
+		free(snapshot);
+		free(page_data);
+		return NULL;
+	}
+	snapshot->page_data = page_data;
+	snapshot->generation = atomic_fetch_add(&last_generation, 1) + 1;
+	return snapshot;
+}
+
+snapshot_t *snapshot_take(simulator_t *simulator)
+{
+	memory_data_t *memory = &simulator->memory;
+	uint64_t candidates[MEMORY_PAGE_COUNT / 64];
+	memcpy(candidates, memory->dirty, sizeof(candidates));
+	add_image_pages(simulator, candidates);
+
+	// Written pages can be back to all zeroes, and are then left out
+	uint32_t page_count = 0;
+	for (uint32_t word = 0; word < MEMORY_PAGE_COUNT / 64; word++)
+	{
+		for (uint64_t bits = candidates[word]; bits; bits &= bits - 1)
+		{
+			uint32_t page = word * 64 + __builtin_ctzll(bits);
+			if (page_is_zero(memory->bytes + ((size_t)page << MEMORY_PAGE_SHIFT)))
+			{
+				candidates[word] &= ~((uint64_t)1 << (page % 64));
+			}
+			else
+			{
+				page_count++;
+			}
+		}
+	}
+
+	snapshot_t *snapshot = snapshot_alloc(page_count);
+	if (!snapshot)
+	{
+		return NULL;
+	}
+	uint8_t *copy = snapshot->page_data;
+	for (uint32_t word = 0; word < MEMORY_PAGE_COUNT / 64; word++)
+	{
+		for (uint64_t bits = candidates[word]; bits; bits &= bits - 1)
+		{
+			uint32_t page = word * 64 + __builtin_ctzll(bits);
+			memcpy(copy, memory->bytes + ((size_t)page << MEMORY_PAGE_SHIFT), MEMORY_PAGE_SIZE);
+			snapshot->pages[page] = copy;
+			copy += MEMORY_PAGE_SIZE;
+		}
+	}
+
+	snapshot->cpu = simulator->cpu;
+	snapshot->image_address = simulator->decoder->bin_buffer ? image_address(simulator) : 0;
+	snapshot->program_size = (uint32_t)simulator->program_size;
+	snapshot->cycles = simulator->cycles;
+	snapshot->status = simulator->status;
+	memcpy(snapshot->dirty, memory->dirty, sizeof(snapshot->dirty));
+
+	memset(memory->changed, 0, sizeof(memory->changed));
+	simulator->snapshot_generation = snapshot->generation;
+	return snapshot;
+}
+
+// Cached decodes of restored code are stale; the instructions that start up
+// to DECODE_MAX_LENGTH bytes before a page can reach into it
+static void invalidate_restored_code(simulator_t *simulator, uint32_t page)
+{
+	uint32_t image = image_address(simulator);
+	int64_t start = ((int64_t)page << MEMORY_PAGE_SHIFT) - image - DECODE_MAX_LENGTH;
+	int64_t end = ((int64_t)(page + 1) << MEMORY_PAGE_SHIFT) - image;
+	for (int64_t ip = start < 0 ? 0 : start; ip < end && ip < (int64_t)simulator->program_size; ip++)
+	{
+		simulator->decode_cache[ip].is_decoded = false;
+	}
+}
+
+void snapshot_restore(simulator_t *simulator, const snapshot_t *snapshot)
+{
+	memory_data_t *memory = &simulator->memory;
+	uint64_t pages[MEMORY_PAGE_COUNT / 64];
+	memcpy(pages, memory->changed, sizeof(pages));
+	if (simulator->snapshot_generation != snapshot->generation)
+	{
+		// Memory has nothing to do with this snapshot, so every page either
+		// side could have something in gets rewritten
+		for (uint32_t word = 0; word < MEMORY_PAGE_COUNT / 64; word++)
+		{
+			pages[word] |= memory->dirty[word];
+		}
+		add_image_pages(simulator, pages);
+		for (uint32_t page = 0; page < MEMORY_PAGE_COUNT; page++)
+		{
+			if (snapshot->pages[page])
+			{
+				pages[page / 64] |= (uint64_t)1 << (page % 64);
+			}
+		}
+	}
+
+	// A different program image leaves nothing in the decode cache worth keeping
+	bool same_image = simulator->decoder->bin_buffer &&
+			  image_address(simulator) == snapshot->image_address &&
+			  simulator->program_size == snapshot->program_size;
+	if (simulator->decode_cache && !same_image)
+	{
+		free_decode_cache(simulator);
+	}
+	if (!same_image)
+	{
+		simulator->program_mapped = false;
+	}
+	simulator->decoder->bin_buffer = memory->bytes + snapshot->image_address;
+	simulator->program_size = snapshot->program_size;
+
+	for (uint32_t word = 0; word < MEMORY_PAGE_COUNT / 64; word++)
+	{
+		for (uint64_t bits = pages[word]; bits; bits &= bits - 1)
+		{
+			uint32_t page = word * 64 + __builtin_ctzll(bits);
+			uint8_t *bytes = memory->bytes + ((size_t)page << MEMORY_PAGE_SHIFT);
+			if (snapshot->pages[page])
+			{
+				memcpy(bytes, snapshot->pages[page], MEMORY_PAGE_SIZE);
+			}
+			else
+			{
+				memset(bytes, 0, MEMORY_PAGE_SIZE);
+			}
+			if (simulator->decode_cache)
+			{
+				invalidate_restored_code(simulator, page);
+			}
+		}
+	}
+	memcpy(memory->dirty, snapshot->dirty, sizeof(memory->dirty));
+	memset(memory->changed, 0, sizeof(memory->changed));
+
+	simulator->cpu = snapshot->cpu;
+	simulator->cycles = snapshot->cycles;
+	simulator->status = snapshot->status;
+	simulator->snapshot_generation = snapshot->generation;
+}
+
+void snapshot_free(snapshot_t *snapshot)
+{
+	if (!snapshot)
+	{
+		return;
+	}
+	free(snapshot->page_data);
+	free(snapshot);
+}
+
+bool snapshot_write(const snapshot_t *snapshot, const char *path)
+{
+	FILE *file = fopen(path, "wb");
+	if (!file)
+	{
+		fprintf(stderr, "Error: Could not open snapshot file '%s'\n", path);
+		return false;
+	}
+
+	// Zeroed first so padding bytes in the file are deterministic
+	snapshot_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	header.version = SNAPSHOT_VERSION;
+	header.page_shift = MEMORY_PAGE_SHIFT;
+	header.cpu = snapshot->cpu;
+	header.image_address = snapshot->image_address;
+	header.program_size = snapshot->program_size;
+	header.cycles = snapshot->cycles;
+	header.status = snapshot->status;
+	memcpy(header.dirty, snapshot->dirty, sizeof(header.dirty));
+	for (uint32_t page = 0; page < MEMORY_PAGE_COUNT; page++)
+	{
+		if (snapshot->pages[page])
+		{
+			header.saved[page / 64] |= (uint64_t)1 << (page % 64);
+			header.page_count++;
+		}
+	}
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	for (uint32_t page = 0; ok && page < MEMORY_PAGE_COUNT; page++)
+	{
+		if (snapshot->pages[page])
+		{
+			ok = fwrite(snapshot->pages[page], MEMORY_PAGE_SIZE, 1, file) == 1;
+		}
+	}
+	ok = fclose(file) == 0 && ok;
+	if (!ok)
+	{
+		fprintf(stderr, "Error: Could not write snapshot to '%s'\n", path);
+	}
+	return ok;
+}
+
+snapshot_t *snapshot_read(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+	{
+		fprintf(stderr, "Error: Could not open snapshot file '%s'\n", path);
+		return NULL;
+	}
+
+	snapshot_header_t header;
+	uint32_t saved_count = 0;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+		  memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0;
+	if (ok)
+	{
+		for (uint32_t word = 0; word < MEMORY_PAGE_COUNT / 64; word++)
+		{
+			saved_count += (uint32_t)__builtin_popcountll(header.saved[word]);
+		}
+		ok = header.version == SNAPSHOT_VERSION && header.page_shift == MEMORY_PAGE_SHIFT &&
+		     header.page_count == saved_count && header.program_size > 0 &&
+		     header.program_size <= 0x10000 && header.image_address % 16 == 0 &&
+		     header.program_size <= MEMORY_SIZE - header.image_address;
+	}
+	if (!ok)
+	{
+		fprintf(stderr, "Error: '%s' is not a snapshot this simulator can read\n", path);
+		fclose(file);
+		return NULL;
+	}
+
+	snapshot_t *snapshot = snapshot_alloc(header.page_count);
+	if (!snapshot)
+	{
+		fclose(file);
+		return NULL;
+	}
+	uint8_t *copy = snapshot->page_data;
+	for (uint32_t page = 0; ok && page < MEMORY_PAGE_COUNT; page++)
+	{
+		if (header.saved[page / 64] & ((uint64_t)1 << (page % 64)))
+		{
+			ok = fread(copy, MEMORY_PAGE_SIZE, 1, file) == 1;
+			snapshot->pages[page] = copy;
+			copy += MEMORY_PAGE_SIZE;
+		}
+	}
+	fclose(file);
+	if (!ok)
+	{
+		fprintf(stderr, "Error: Snapshot '%s' is truncated\n", path);
+		snapshot_free(snapshot);
+		return NULL;
+	}
+
+	snapshot->cpu = header.cpu;
+	snapshot->image_address = header.image_address;
+	snapshot->program_size = header.program_size;
+	snapshot->cycles = header.cycles;
+	snapshot->status = (simulation_status_t)header.status;
+	memcpy(snapshot->dirty, header.dirty, sizeof(snapshot->dirty));
+	return snapshot;
+}
+
+// Steps the interpreter until `instructions` instructions have run or, when
+// ip is not negative, instr_ptr first reaches ip. Returns false if the
+// program ended first.
+bool run_to_instruction(simulator_t *simulator, uint64_t instructions, int32_t ip)
+{
+	if (!init_decode_cache(simulator))
+	{
+		return false;
+	}
+	// The end of the program still counts when the snapshot point is there
+	bool reached = false;
+	for (uint64_t count = 0;; count++)
+	{
+		if (count == instructions || simulator->cpu.instr_ptr == ip)
+		{
+			reached = true;
+			break;
+		}
+		if (simulator->cpu.instr_ptr >= simulator->program_size - 1)
+		{
+			break;
+		}
+		simulate_instruction(simulator);
+	}
+	free_decode_cache(simulator);
+	return reached;
+}
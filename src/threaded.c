@@ -0,0 +1,366 @@
+#include "simulator.h"
+#include <stdint.h>
+#include <stdio.h>
+
+// THREADED EXECUTION ENGINE
+//
+// Alternative to the run_simulation loop. Every instruction is decoded once
+// into a stream slot indexed by instr_ptr that records which handler runs it
+// and where the next instruction starts. With GCC/Clang each handler ends in
+// its own computed goto, so every dispatch site gets its own indirect branch;
+// other compilers fall back to a switch inside a loop.
+
+#if defined(__GNUC__)
+#define THREADED_COMPUTED_GOTO 1
+#else
+#define THREADED_COMPUTED_GOTO 0
+#endif
+
+typedef enum ThreadedKind {
+	THREADED_UNRESOLVED = 0,
+	THREADED_MOV,
+	THREADED_ADD,
+	THREADED_SUB,
+	THREADED_CMP,
+	THREADED_JMP,
+	THREADED_JCC,
+	THREADED_LOOP,
+	THREADED_STRING,
+	THREADED_DIRECTION,
+	THREADED_PUSH,
+	THREADED_POP,
+	THREADED_CALL,
+	THREADED_RET,
+	THREADED_NOP, // Decoded but has no effect when evaluated
+	THREADED_KIND_COUNT
+} threaded_kind_t;
+
+typedef struct ThreadedOp {
+	const void *handler; // Label address, only used with computed goto
+	const instruction_t *instruction;
+	uint16_t next_ip;
+	uint8_t kind;
+	bool breakpoint; // Always takes the checked path through run_control_step
+} threaded_op_t;
+
+static threaded_kind_t threaded_kind_for(operation_t op)
+{
+	switch (op)
+	{
+	case OP_MOV:
+		return THREADED_MOV;
+	case OP_ADD:
+		return THREADED_ADD;
+	case OP_SUB:
+		return THREADED_SUB;
+	case OP_CMP:
+		return THREADED_CMP;
+	case OP_JMP:
+		return THREADED_JMP;
+	case OP_JNZ:
+	case OP_JB:
+	case OP_JE:
+	case OP_JNE:
+	case OP_JL:
+	case OP_JLE:
+	case OP_JG:
+	case OP_JGE:
+	case OP_JBE:
+	case OP_JP:
+	case OP_JO:
+	case OP_JS:
+	case OP_JNL:
+	case OP_JA:
+	case OP_JNB:
+	case OP_JNP:
+	case OP_JNO:
+	case OP_JNS:
+		return THREADED_JCC;
+	case OP_JCXZ:
+	case LOOP_LOOP:
+	case LOOP_LOOPZ:
+	case LOOP_LOOPNZ:
+		return THREADED_LOOP;
+	case OP_MOVS:
+	case OP_CMPS:
+	case OP_STOS:
+	case OP_LODS:
+	case OP_SCAS:
+		return THREADED_STRING;
+	case OP_CLD:
+	case OP_STD:
+		return THREADED_DIRECTION;
+	case OP_PUSH:
+	case OP_PUSHF:
+		return THREADED_PUSH;
+	case OP_POP:
+	case OP_POPF:
+		return THREADED_POP;
+	case OP_CALL:
+		return THREADED_CALL;
+	case OP_RET:
+		return THREADED_RET;
+	default:
+		return THREADED_NOP;
+	}
+}
+
+// Returns the stream slot for the instruction at instr_ptr, threading it on
+// first visit, and moves instr_ptr past it. NULL once the program has ended
+// or a run control stops it before the instruction. The fuel is kept in a
+// local of the run loop, out of reach of the handlers' stores, and only goes
+// back to the run controls for the checked path.
+static inline threaded_op_t *next_threaded_op(simulator_t *simulator, threaded_op_t *stream,
+					      const void *const *handlers, uint64_t *fuel)
+{
+	uint16_t ip = simulator->cpu.instr_ptr;
+	if (ip >= simulator->program_size - 1)
+	{
+		return NULL;
+	}
+
+	// A store into the code drops the decode cache entry, so the slot is
+	// threaded again
+	threaded_op_t *op = &stream[ip];
+	if (op->kind == THREADED_UNRESOLVED || !simulator->decode_cache[ip].is_decoded)
+	{
+		const decoded_instruction_t *decoded = fetch_instruction(simulator);
+		op->instruction = &decoded->instruction;
+		op->next_ip = simulator->cpu.instr_ptr;
+		op->kind = threaded_kind_for(decoded->instruction.op);
+		op->breakpoint = is_breakpoint(simulator, ip);
+		if (handlers)
+		{
+			op->handler = handlers[op->kind];
+		}
+		simulator->cpu.instr_ptr = ip;
+	}
+
+	if (*fuel == 0 || op->breakpoint)
+	{
+		simulator->control.fuel = *fuel;
+		bool stop = run_control_step(simulator);
+		*fuel = simulator->control.fuel;
+		if (stop)
+		{
+			return NULL;
+		}
+	}
+	else
+	{
+		(*fuel)--;
+	}
+	simulator->cpu.instr_ptr = op->next_ip;
+	return op;
+}
+
+static inline void trace_threaded_op(simulator_t *simulator, const threaded_op_t *stream,
+				     const threaded_op_t *op)
+{
+	if (is_tracing(simulator))
+	{
+		format_instruction(&simulator->output, op->instruction);
+		output_write(&simulator->output, "\n", 1);
+	}
+	if (simulator->trace)
+	{
+		trace_write_instruction(simulator->trace, (uint16_t)(op - stream), op->instruction);
+	}
+	if (simulator->count_cycles)
+	{
+		count_cycles(op->instruction, simulator);
+	}
+}
+
+static inline void profile_threaded_op(simulator_t *simulator, const threaded_op_t *stream,
+				       const threaded_op_t *op)
+{
+	if (simulator->profile)
+	{
+		profile_instruction(simulator->profile, (uint16_t)(op - stream), op->instruction->op, op->next_ip,
+				    simulator->cpu.instr_ptr);
+	}
+}
+
+void run_simulation_threaded(simulator_t *simulator)
+{
+	if (!init_decode_cache(simulator))
+	{
+		return;
+	}
+	threaded_op_t *stream = calloc(simulator->program_size, sizeof(threaded_op_t));
+	if (!stream)
+	{
+		fprintf(stderr, "Error: Could not allocate threaded stream (%zu entries)\n", simulator->program_size);
+		free_decode_cache(simulator);
+		return;
+	}
+
+	if (simulator->trace)
+	{
+		trace_write_start(simulator->trace, simulator);
+	}
+	run_control_start(simulator);
+	uint64_t fuel = simulator->control.fuel;
+	threaded_op_t *op;
+
+#if THREADED_COMPUTED_GOTO
+	static const void *const handlers[THREADED_KIND_COUNT] = {
+		[THREADED_MOV] = &&handler_THREADED_MOV,
+		[THREADED_ADD] = &&handler_THREADED_ADD,
+		[THREADED_SUB] = &&handler_THREADED_SUB,
+		[THREADED_CMP] = &&handler_THREADED_CMP,
+		[THREADED_JMP] = &&handler_THREADED_JMP,
+		[THREADED_JCC] = &&handler_THREADED_JCC,
+		[THREADED_LOOP] = &&handler_THREADED_LOOP,
+		[THREADED_STRING] = &&handler_THREADED_STRING,
+		[THREADED_DIRECTION] = &&handler_THREADED_DIRECTION,
+		[THREADED_PUSH] = &&handler_THREADED_PUSH,
+		[THREADED_POP] = &&handler_THREADED_POP,
+		[THREADED_CALL] = &&handler_THREADED_CALL,
+		[THREADED_RET] = &&handler_THREADED_RET,
+		[THREADED_NOP] = &&handler_THREADED_NOP,
+	};
+#define HANDLER(kind) handler_##kind:
+#define DISPATCH()                                                 \
+	do                                                             \
+	{                                                              \
+		op = next_threaded_op(simulator, stream, handlers, &fuel); \
+		if (!op)                                                   \
+			goto done;                                             \
+		goto *op->handler;                                         \
+	} while (0)
+
+	DISPATCH();
+#else
+#define HANDLER(kind) case kind:
+#define DISPATCH() continue
+
+	for (;;)
+	{
+		op = next_threaded_op(simulator, stream, NULL, &fuel);
+		if (!op)
+			goto done;
+		switch (op->kind)
+		{
+#endif
+
+	HANDLER(THREADED_MOV)
+		trace_threaded_op(simulator, stream, op);
+		handle_mov(op->instruction, simulator);
+		profile_threaded_op(simulator, stream, op);
+		DISPATCH();
+
+	HANDLER(THREADED_ADD)
+		trace_threaded_op(simulator, stream, op);
+		handle_add(op->instruction, simulator);
+		profile_threaded_op(simulator, stream, op);
+		DISPATCH();
+
+	HANDLER(THREADED_SUB)
+		trace_threaded_op(simulator, stream, op);
+		handle_sub(op->instruction, simulator);
+		profile_threaded_op(simulator, stream, op);
+		DISPATCH();
+
+	HANDLER(THREADED_CMP)
+		trace_threaded_op(simulator, stream, op);
+		handle_cmp(op->instruction, simulator);
+		profile_threaded_op(simulator, stream, op);
+		DISPATCH();
+
+	HANDLER(THREADED_JMP)
+		trace_threaded_op(simulator, stream, op);
+		handle_jmp(op->instruction, simulator);
+		profile_threaded_op(simulator, stream, op);
+		DISPATCH();
+
+	HANDLER(THREADED_JCC)
+		trace_threaded_op(simulator, stream, op);
+		handle_conditional_jump(op->instruction, simulator);
+		profile_threaded_op(simulator, stream, op);
+		DISPATCH();
+
+	HANDLER(THREADED_LOOP)
+		trace_threaded_op(simulator, stream, op);
+		handle_loop(op->instruction, simulator);
+		profile_threaded_op(simulator, stream, op);
+		DISPATCH();
+
+	HANDLER(THREADED_STRING)
+		trace_threaded_op(simulator, stream, op);
+		handle_string(op->instruction, simulator);
+		profile_threaded_op(simulator, stream, op);
+		if (op->instruction->rep != REP_NONE && simulator->control.max_cycles)
+		{
+			// The repetition can take more clocks than the fuel allowed for
+			simulator->control.fuel = fuel;
+			run_control_refuel(simulator);
+			fuel = simulator->control.fuel;
+		}
+		DISPATCH();
+
+	HANDLER(THREADED_DIRECTION)
+		trace_threaded_op(simulator, stream, op);
+		handle_direction(op->instruction, simulator);
+		profile_threaded_op(simulator, stream, op);
+		DISPATCH();
+
+	HANDLER(THREADED_PUSH)
+		trace_threaded_op(simulator, stream, op);
+		handle_push(op->instruction, simulator);
+		profile_threaded_op(simulator, stream, op);
+		DISPATCH();
+
+	HANDLER(THREADED_POP)
+		trace_threaded_op(simulator, stream, op);
+		handle_pop(op->instruction, simulator);
+		profile_threaded_op(simulator, stream, op);
+		DISPATCH();
+
+	HANDLER(THREADED_CALL)
+		trace_threaded_op(simulator, stream, op);
+		handle_call(op->instruction, simulator);
+		profile_threaded_op(simulator, stream, op);
+		DISPATCH();
+
+	HANDLER(THREADED_RET)
+		trace_threaded_op(simulator, stream, op);
+		handle_ret(op->instruction, simulator);
+		profile_threaded_op(simulator, stream, op);
+		DISPATCH();
+
+	HANDLER(THREADED_NOP)
+		trace_threaded_op(simulator, stream, op);
+		profile_threaded_op(simulator, stream, op);
+		DISPATCH();
+
+#if !THREADED_COMPUTED_GOTO
+		default:
+			DISPATCH();
+		}
+	}
+#endif
+
+#undef HANDLER
+#undef DISPATCH
+
+done:
+	simulator->control.fuel = fuel;
+	if (simulator->trace)
+	{
+		trace_write_end(simulator->trace, simulator->cpu.instr_ptr);
+	}
+	if (simulator->verbosity != VERBOSITY_SILENT)
+	{
+		format_cpu_state(simulator);
+		format_memory_state(simulator);
+		if (simulator->profile)
+		{
+			format_profile(simulator);
+		}
+	}
+	output_flush(&simulator->output);
+	free(stream);
+	free_decode_cache(simulator);
+}
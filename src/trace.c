@@ -0,0 +1,419 @@
+#include "simulator.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// BINARY TRACE WRITER
+
+trace_writer_t *trace_open(const char *path)
+{
+	FILE *file = fopen(path, "wb");
+	if (!file)
+	{
+		fprintf(stderr, "Error: Could not open trace file '%s'\n", path);
+		return NULL;
+	}
+
+	trace_writer_t *trace = calloc(1, sizeof(trace_writer_t));
+	trace_record_t *records = malloc(TRACE_BUFFER_RECORDS * sizeof(trace_record_t));
+	if (!trace || !records)
+	{
+		fprintf(stderr, "Error: Could not allocate trace buffer for '%s'\n", path);
+		free(trace);
+		free(records);
+		fclose(file);
+		return NULL;
+	}
+
+	trace_header_t header = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.record_size = sizeof(trace_record_t),
+	};
+	if (fwrite(&header, sizeof(header), 1, file) != 1)
+	{
+		fprintf(stderr, "Error: Could not write trace header to '%s'\n", path);
+		free(trace);
+		free(records);
+		fclose(file);
+		return NULL;
+	}
+
+	trace->file = file;
+	trace->records = records;
+	return trace;
+}
+
+bool trace_flush(trace_writer_t *trace)
+{
+	if (trace->count == 0)
+	{
+		return true;
+	}
+	size_t written = fwrite(trace->records, sizeof(trace_record_t), trace->count, trace->file);
+	bool ok = written == trace->count;
+	trace->count = 0;
+	if (!ok && !trace->failed)
+	{
+		fprintf(stderr, "Error: Could not write trace records\n");
+	}
+	trace->failed = trace->failed || !ok;
+	return ok;
+}
+
+bool trace_close(trace_writer_t *trace)
+{
+	if (!trace)
+	{
+		return true;
+	}
+	// Flushes while running drop their records on failure, so any of them
+	// failing leaves the trace incomplete
+	trace_flush(trace);
+	bool ok = (fclose(trace->file) == 0) && !trace->failed;
+	free(trace->records);
+	free(trace);
+	return ok;
+}
+
+// Claims the next record slot, flushing the buffer to disk when it is full.
+// Records are zeroed so padding bytes in the file are deterministic.
+static inline trace_record_t *trace_next_record(trace_writer_t *trace, trace_record_type_t type)
+{
+	if (trace->count == TRACE_BUFFER_RECORDS)
+	{
+		trace_flush(trace);
+	}
+	trace_record_t *record = &trace->records[trace->count++];
+	*record = (trace_record_t){.type = type, .ip = trace->ip};
+	return record;
+}
+
+static trace_operand_t pack_operand(const operand_t *operand)
+{
+	trace_operand_t packed = {.type = operand->type};
+	switch (operand->type)
+	{
+	case OPERAND_REGISTER:
+		packed.reg = operand->value.reg;
+		break;
+	case OPERAND_MEMORY:
+	{
+		const memory_address_t *mem = &operand->value.memory;
+		packed.reg = mem->base_reg;
+		packed.index_reg = mem->index_reg;
+		packed.has = (mem->has_base ? TRACE_HAS_BASE : 0) |
+			     (mem->has_index ? TRACE_HAS_INDEX : 0) |
+			     (mem->has_displacement ? TRACE_HAS_DISPLACEMENT : 0);
+		if (mem->segment != REG_NONE)
+		{
+			packed.has |= (mem->segment - REG_ES + 1) << TRACE_SEGMENT_SHIFT;
+		}
+		packed.value = mem->displacement;
+		break;
+	}
+	case OPERAND_IMMEDIATE:
+		packed.value = operand->value.immediate;
+		break;
+	case OPERAND_LABEL:
+		packed.value = (int16_t)operand->value.label_offset;
+		break;
+	default:
+		break;
+	}
+	return packed;
+}
+
+// Whether a packed operand only names registers there are names for, so a
+// corrupt trace can't index past reg_names
+static bool valid_operand(const trace_operand_t *packed)
+{
+	switch (packed->type)
+	{
+	case OPERAND_NONE:
+	case OPERAND_IMMEDIATE:
+	case OPERAND_LABEL:
+		return true;
+	case OPERAND_REGISTER:
+		return packed->reg < REG_COUNT;
+	case OPERAND_MEMORY:
+		return packed->reg < REG_COUNT && packed->index_reg < REG_COUNT &&
+		       (packed->has >> TRACE_SEGMENT_SHIFT) <= REG_DS - REG_ES + 1;
+	default:
+		return false;
+	}
+}
+
+static operand_t unpack_operand(const trace_operand_t *packed)
+{
+	operand_t operand = {.type = packed->type};
+	switch (packed->type)
+	{
+	case OPERAND_REGISTER:
+		operand.value.reg = packed->reg;
+		break;
+	case OPERAND_MEMORY:
+		operand.value.memory = (memory_address_t){
+			.base_reg = packed->reg,
+			.index_reg = packed->index_reg,
+			.displacement = packed->value,
+			.has_base = (packed->has & TRACE_HAS_BASE) != 0,
+			.has_index = (packed->has & TRACE_HAS_INDEX) != 0,
+			.has_displacement = (packed->has & TRACE_HAS_DISPLACEMENT) != 0,
+		};
+		if (packed->has >> TRACE_SEGMENT_SHIFT)
+		{
+			operand.value.memory.segment = REG_ES + (packed->has >> TRACE_SEGMENT_SHIFT) - 1;
+		}
+		break;
+	case OPERAND_IMMEDIATE:
+		operand.value.immediate = packed->value;
+		break;
+	case OPERAND_LABEL:
+		operand.value.label_offset = (uint16_t)packed->value;
+		break;
+	default:
+		break;
+	}
+	return operand;
+}
+
+void trace_write_instruction(trace_writer_t *trace, uint16_t ip, const instruction_t *instr)
+{
+	trace->ip = ip;
+	if (instr->rep != REP_NONE)
+	{
+		trace_next_record(trace, TRACE_REPEAT)->detail = instr->rep;
+	}
+	trace_record_t *record = trace_next_record(trace, TRACE_INSTRUCTION);
+	record->detail = instr->op | (instr->w_bit ? TRACE_W_BIT : 0);
+	record->data.instruction.dest = pack_operand(&instr->dest);
+	record->data.instruction.src = pack_operand(&instr->src);
+}
+
+void trace_write_register(trace_writer_t *trace, cpu_reg_t reg, uint16_t before, uint16_t after)
+{
+	trace_record_t *record = trace_next_record(trace, TRACE_REGISTER);
+	record->detail = reg;
+	record->data.reg.before = before;
+	record->data.reg.after = after;
+}
+
+void trace_write_flags(trace_writer_t *trace, const lazy_flags_t *flags)
+{
+	trace_record_t *record = trace_next_record(trace, TRACE_FLAGS);
+	record->detail = flags->op | (flags->w_bit ? TRACE_W_BIT : 0);
+	record->data.flags.dest = flags->dest;
+	record->data.flags.src = flags->src;
+	record->data.flags.result = flags->result;
+}
+
+void trace_write_memory(trace_writer_t *trace, segmented_address_t address, uint16_t value, uint8_t w_bit)
+{
+	trace_record_t *record = trace_next_record(trace, TRACE_MEMORY_WRITE);
+	record->detail = w_bit;
+	record->data.memory.segment = address.segment;
+	record->data.memory.offset = address.offset;
+	record->data.memory.value = value;
+}
+
+void trace_write_unhandled(trace_writer_t *trace)
+{
+	trace_next_record(trace, TRACE_UNHANDLED);
+}
+
+void trace_write_cycles(trace_writer_t *trace, uint32_t clocks)
+{
+	trace_record_t *record = trace_next_record(trace, TRACE_CYCLES);
+	record->data.clocks = clocks;
+}
+
+// Records the starting segment registers and the program image, so the
+// replay sees the code bytes a run may store into and dump.
+void trace_write_start(trace_writer_t *trace, const simulator_t *simulator)
+{
+	const cpu_state_t *cpu = &simulator->cpu;
+	trace->ip = cpu->instr_ptr;
+	trace_record_t *record = trace_next_record(trace, TRACE_START);
+	record->detail = simulator->count_cycles;
+	record->data.segments.es = cpu->es;
+	record->data.segments.cs = cpu->cs;
+	record->data.segments.ss = cpu->ss;
+	record->data.segments.ds = cpu->ds;
+
+	for (size_t offset = 0; offset < simulator->program_size; offset += sizeof(record->data.image))
+	{
+		size_t count = simulator->program_size - offset;
+		if (count > sizeof(record->data.image))
+		{
+			count = sizeof(record->data.image);
+		}
+		trace->ip = (uint16_t)offset;
+		record = trace_next_record(trace, TRACE_IMAGE);
+		record->detail = (uint8_t)count;
+		memcpy(record->data.image, simulator->decoder->bin_buffer + offset, count);
+	}
+}
+
+void trace_write_end(trace_writer_t *trace, uint16_t instr_ptr)
+{
+	trace->ip = instr_ptr;
+	trace_next_record(trace, TRACE_END);
+}
+
+// BINARY TRACE FORMATTER
+
+// Renders a binary trace as the text the simulator prints in trace mode. The
+// register, flag and memory events are replayed into a scratch simulator so
+// the final state dump comes out of the same formatters as a live run.
+int format_trace(FILE *trace_file, output_sink_t *out)
+{
+	trace_header_t header;
+	if (fread(&header, sizeof(header), 1, trace_file) != 1 ||
+	    memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0)
+	{
+		fprintf(stderr, "Error: Not a binary trace file\n");
+		return 1;
+	}
+	if (header.version != TRACE_VERSION || header.record_size != sizeof(trace_record_t))
+	{
+		fprintf(stderr, "Error: Unsupported trace version %u (record size %u)\n",
+			header.version, header.record_size);
+		return 1;
+	}
+
+	simulator_t *replay = calloc(1, sizeof(simulator_t));
+	trace_record_t *records = malloc(TRACE_BUFFER_RECORDS * sizeof(trace_record_t));
+	if (!replay || !records || !memory_init(&replay->memory))
+	{
+		fprintf(stderr, "Error: Could not allocate trace replay state\n");
+		free(replay);
+		free(records);
+		return 1;
+	}
+
+	replay->output = *out;
+
+	int result = 1;
+	uint8_t rep = REP_NONE; // Prefix of the next instruction record
+	size_t count;
+	while ((count = fread(records, sizeof(trace_record_t), TRACE_BUFFER_RECORDS, trace_file)) > 0)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			const trace_record_t *record = &records[i];
+			switch (record->type)
+			{
+			case TRACE_INSTRUCTION:
+			{
+				if ((record->detail & ~TRACE_W_BIT) > LOOP_LOOPNZ)
+				{
+					fprintf(stderr, "Error: Unknown operation %u in trace\n", record->detail & ~TRACE_W_BIT);
+					goto done;
+				}
+				if (!valid_operand(&record->data.instruction.dest) ||
+				    !valid_operand(&record->data.instruction.src))
+				{
+					fprintf(stderr, "Error: Unknown operand register in trace\n");
+					goto done;
+				}
+				instruction_t instr = {
+					.op = record->detail & ~TRACE_W_BIT,
+					.w_bit = (record->detail & TRACE_W_BIT) != 0,
+					.rep = rep,
+					.dest = unpack_operand(&record->data.instruction.dest),
+					.src = unpack_operand(&record->data.instruction.src),
+				};
+				rep = REP_NONE;
+				format_instruction(&replay->output, &instr);
+				output_write(&replay->output, "\n", 1);
+				break;
+			}
+			case TRACE_REGISTER:
+			{
+				if (record->detail >= REG_COUNT)
+				{
+					fprintf(stderr, "Error: Unknown register %u in trace\n", record->detail);
+					goto done;
+				}
+				register_data_t prev_data = get_register_data(record->detail, replay);
+				prev_data.value = record->data.reg.before;
+				set_register_data(record->detail, record->data.reg.after, replay);
+				format_reg_before_after(&replay->output, prev_data, record->data.reg.after);
+				break;
+			}
+			case TRACE_FLAGS:
+				if ((record->detail & ~TRACE_W_BIT) > LAZY_FLAGS_SUB)
+				{
+					fprintf(stderr, "Error: Unknown flags operation %u in trace\n",
+						record->detail & ~TRACE_W_BIT);
+					goto done;
+				}
+				replay->cpu.lazy_flags = (lazy_flags_t){
+					.op = record->detail & ~TRACE_W_BIT,
+					.w_bit = (record->detail & TRACE_W_BIT) != 0,
+					.dest = record->data.flags.dest,
+					.src = record->data.flags.src,
+					.result = record->data.flags.result,
+				};
+				if (replay->cpu.lazy_flags.op == LAZY_FLAGS_NONE)
+				{
+					replay->cpu.flags = record->data.flags.result;
+				}
+				format_cpu_flags(replay);
+				break;
+			case TRACE_MEMORY_WRITE:
+			{
+				segmented_address_t address = {record->data.memory.segment, record->data.memory.offset};
+				set_memory_data(address, record->data.memory.value, record->detail, replay);
+				break;
+			}
+			case TRACE_UNHANDLED:
+				output_printf(&replay->output, "UNHANDLED MOV INSTRUCTION\n");
+				break;
+			case TRACE_CYCLES:
+				replay->cycles += record->data.clocks;
+				format_cycles(&replay->output, record->data.clocks, replay->cycles);
+				break;
+			case TRACE_REPEAT:
+				rep = record->detail;
+				break;
+			case TRACE_START:
+				replay->count_cycles = record->detail != 0;
+				replay->cpu.es = record->data.segments.es;
+				replay->cpu.cs = record->data.segments.cs;
+				replay->cpu.ss = record->data.segments.ss;
+				replay->cpu.ds = record->data.segments.ds;
+				break;
+			case TRACE_IMAGE:
+				for (uint8_t i = 0; i < record->detail; i++)
+				{
+					replay->memory.bytes[physical_address(replay->cpu.cs, record->ip + i)] = record->data.image[i];
+				}
+				break;
+			case TRACE_END:
+				replay->cpu.instr_ptr = record->ip;
+				format_cpu_state(replay);
+				format_memory_state(replay);
+				result = 0;
+				break;
+			default:
+				fprintf(stderr, "Error: Unknown trace record type %u\n", record->type);
+				goto done;
+			}
+		}
+	}
+
+	if (result != 0)
+	{
+		fprintf(stderr, "Error: Trace ended before the end of the run\n");
+	}
+
+done:
+	// The sink may have flushed or grown while replaying
+	*out = replay->output;
+	memory_free(&replay->memory);
+	free(records);
+	free(replay);
+	return result;
+}
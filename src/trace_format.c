@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include "simulator.h"
+
+// Renders a trace written with `simulator --binary-trace` as the text the
+// simulator prints when it runs in full trace mode.
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		printf("Usage: %s <trace_path>\n", argv[0]);
+		return 1;
+	}
+
+	FILE *trace_file = fopen(argv[1], "rb");
+	if (!trace_file) {
+		fprintf(stderr, "Error: Could not open trace file '%s'\n", argv[1]);
+		return 1;
+	}
+
+	output_sink_t out;
+	if (!output_init(&out, OUTPUT_STDOUT, NULL, OUTPUT_BUFFER_SIZE)) {
+		fclose(trace_file);
+		return 1;
+	}
+
+	int result = format_trace(trace_file, &out);
+	if (!output_free(&out)) {
+		result = 1;
+	}
+	fclose(trace_file);
+	return result;
+}
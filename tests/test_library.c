@@ -0,0 +1,140 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim8086.h"
+
+// Runs every listing through the library at the same time, one thread each,
+// and checks that each instance's trace matches the expected output and that
+// stepping an instance through the program ends in the same state, both from
+// the start and again after restoring a snapshot of the start. A JIT instance
+// limited to one instruction per run must get there too, run after run.
+//
+// Usage: test_library <binary> <expected output> [<binary> <expected output> ...]
+
+typedef struct {
+    const char *binary_path;
+    const char *expected_path;
+    const char *error;
+} library_job_t;
+
+static char *read_file(const char *path, size_t *length) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *text = malloc(size > 0 ? size : 1);
+    if (text && fread(text, 1, size, file) != (size_t)size) {
+        free(text);
+        text = NULL;
+    }
+    fclose(file);
+    *length = size;
+    return text;
+}
+
+static int same_state(const sim8086_state_t *a, const sim8086_state_t *b) {
+    return a->ax == b->ax && a->bx == b->bx && a->cx == b->cx && a->dx == b->dx &&
+           a->sp == b->sp && a->bp == b->bp && a->si == b->si && a->di == b->di &&
+           a->es == b->es && a->cs == b->cs && a->ss == b->ss && a->ds == b->ds &&
+           a->flags == b->flags && a->ip == b->ip && a->status == b->status && a->halted == b->halted;
+}
+
+static void *run_job(void *arg) {
+    library_job_t *job = arg;
+
+    sim8086_t *traced = sim8086_create(NULL);
+    sim8086_options_t silent_options = {.verbosity = SIM8086_VERBOSITY_SILENT};
+    sim8086_t *stepped = sim8086_create(&silent_options);
+    sim8086_options_t limited_options = {
+        .verbosity = SIM8086_VERBOSITY_SILENT,
+        .engine = SIM8086_ENGINE_JIT,
+        .max_instructions = 1,
+    };
+    sim8086_t *limited = sim8086_create(&limited_options);
+    if (!traced || !stepped || !limited ||
+        !sim8086_load(traced, job->binary_path, 0x10000) ||
+        !sim8086_load(stepped, job->binary_path, 0x10000) ||
+        !sim8086_load(limited, job->binary_path, 0x10000)) {
+        job->error = "could not create or load";
+        goto done;
+    }
+
+    sim8086_run(traced);
+    size_t expected_length;
+    char *expected = read_file(job->expected_path, &expected_length);
+    size_t actual_length;
+    const char *actual = sim8086_output(traced, &actual_length);
+    if (!expected || expected_length != actual_length || memcmp(expected, actual, actual_length) != 0) {
+        job->error = "trace differs from expected output";
+    }
+    free(expected);
+
+    sim8086_snapshot_t *start = sim8086_snapshot(stepped);
+    if (!start) {
+        job->error = "could not take snapshot";
+        goto done;
+    }
+    sim8086_state_t run_state;
+    sim8086_state_t step_state;
+    sim8086_get_state(traced, &run_state);
+    for (int pass = 0; pass < 2; pass++) {
+        while (sim8086_step(stepped)) {
+        }
+        sim8086_get_state(stepped, &step_state);
+        if (!job->error && !same_state(&run_state, &step_state)) {
+            job->error = pass == 0 ? "stepped state differs from run state"
+                                   : "state after restoring a snapshot differs from run state";
+        }
+        sim8086_restore(stepped, start);
+    }
+    sim8086_snapshot_free(start);
+
+    while (sim8086_run(limited) == SIM8086_INSTRUCTION_LIMIT) {
+    }
+    sim8086_get_state(limited, &step_state);
+    if (!job->error && !same_state(&run_state, &step_state)) {
+        job->error = "state after runs of one instruction differs from run state";
+    }
+
+done:
+    sim8086_destroy(traced);
+    sim8086_destroy(stepped);
+    sim8086_destroy(limited);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int count = (argc - 1) / 2;
+    library_job_t *jobs = calloc(count, sizeof(library_job_t));
+    pthread_t *threads = calloc(count, sizeof(pthread_t));
+    if (!jobs || !threads) {
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        jobs[i].binary_path = argv[1 + 2 * i];
+        jobs[i].expected_path = argv[2 + 2 * i];
+        if (pthread_create(&threads[i], NULL, run_job, &jobs[i]) != 0) {
+            jobs[i].error = "could not start thread";
+            threads[i] = 0;
+        }
+    }
+
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        if (threads[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        if (jobs[i].error) {
+            printf("%s: %s\n", jobs[i].binary_path, jobs[i].error);
+            failed++;
+        }
+    }
+    free(jobs);
+    free(threads);
+    return failed != 0;
+}
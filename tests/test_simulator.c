@@ -1,8 +1,21 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
-#include <sys/wait.h>
+#include "simulator.h"
+
+// The runner is linked against the simulator core and runs every listing
+// in-process. Listings are assembled once and their binaries reused until the
+// source changes, the listings are tested in parallel on a pool of threads,
+// and each run writes to a memory sink that is compared against the expected
+// output in memory. Outputs only reach the disk when they differ.
+//
+// Usage: test_simulator [--jobs <n>] [<listing>...]
 
 // ANSI color codes
 #define RED     "\x1b[31m"
@@ -11,123 +24,764 @@
 #define BLUE    "\x1b[34m"
 #define RESET   "\x1b[0m"
 
-int run_simulator_on_file(const char *binary_path, const char *output_path) {
-    char command[512];
-    snprintf(command, sizeof(command), "../src/simulator %s > %s 2>&1", binary_path, output_path);
-    return system(command);
+// Starting size of each run's memory sink, which grows as needed
+#define RUN_OUTPUT_SIZE (64 * 1024)
+
+// Optional expected outputs for runs with extra flags, test_<listing><suffix>.txt
+typedef struct {
+    const char *suffix;
+    const char *flags;
+    verbosity_t verbosity;
+    bool count_cycles;
+    bool profile;
+} test_variant_t;
+
+static const test_variant_t test_variants[] = {
+    {"_cycles", "--cycles", VERBOSITY_TRACE, true, false},
+    {"_profile", "--quiet --profile", VERBOSITY_FINAL, false, true},
+    {NULL, NULL, VERBOSITY_TRACE, false, false}
+};
+
+// One run, described by the simulator flags it stands for
+typedef struct {
+    engine_t engine;
+    verbosity_t verbosity;
+    bool count_cycles;
+    bool profile;
+    uint64_t max_instructions;
+    const char *trace_path;         // --binary-trace
+    const char *save_snapshot_path; // --save-snapshot --snapshot-at 1
+    const char *load_snapshot_path; // --load-snapshot, in place of the binary
+} run_options_t;
+
+typedef struct {
+    const char *name;
+    bool skipped; // No expected output
+    bool failed;
+    double milliseconds;
+    char *report; // What a failing case printed, shown in listing order
+    size_t report_length;
+} test_case_t;
+
+typedef struct {
+    test_case_t *cases;
+    size_t count;
+    atomic_size_t next_case;
+} test_pool_t;
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
 }
 
-int compare_files(const char *expected_path, const char *actual_path) {
-    FILE *expected = fopen(expected_path, "r");
-    FILE *actual = fopen(actual_path, "r");
-    
-    if (!expected) {
-        printf(RED "Error: Could not open expected file %s\n" RESET, expected_path);
-        if (actual) fclose(actual);
-        return -1;
-    }
-    
-    if (!actual) {
-        printf(RED "Error: Could not open actual file %s\n" RESET, actual_path);
-        fclose(expected);
-        return -1;
-    }
-    
-    char expected_line[1024];
-    char actual_line[1024];
+static char *read_file(const char *path, size_t *length) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *text = malloc(size > 0 ? size : 1);
+    if (text && fread(text, 1, size, file) != (size_t)size) {
+        free(text);
+        text = NULL;
+    }
+    fclose(file);
+    *length = size;
+    return text;
+}
+
+static bool contains_text(const char *text, size_t length, const char *needle) {
+    size_t needle_length = strlen(needle);
+    for (size_t i = 0; i + needle_length <= length; i++) {
+        if (memcmp(text + i, needle, needle_length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Keeps a differing output around for inspection
+static void save_output(FILE *report, const char *path, const output_sink_t *out) {
+    FILE *file = fopen(path, "wb");
+    if (file) {
+        fwrite(out->buffer, 1, out->length, file);
+        fclose(file);
+    }
+    fprintf(report, "Actual output saved to: %s\n", path);
+}
+
+// Writes a file unless it already holds exactly `out`, so its modification
+// time only moves when its contents change
+static bool write_if_changed(const char *path, const output_sink_t *out) {
+    size_t length;
+    char *current = read_file(path, &length);
+    bool same = current && length == out->length && memcmp(current, out->buffer, length) == 0;
+    free(current);
+    if (same) {
+        return true;
+    }
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    bool ok = fwrite(out->buffer, 1, out->length, file) == out->length;
+    return fclose(file) == 0 && ok;
+}
+
+// Runs a program the way the simulator binary runs it with the matching
+// flags, leaving its text in `out` for the caller to free. Returns false if
+// the run could not be set up or its trace or snapshot could not be written.
+static bool run_program(const char *binary_path, const run_options_t *options, output_sink_t *out) {
+    *out = (output_sink_t){};
+    trace_writer_t *trace = NULL;
+    if (options->trace_path && !(trace = trace_open(options->trace_path))) {
+        return false;
+    }
+
+    decoder_t decoder = {};
+    simulator_t simulator = {
+        .decoder = &decoder,
+        .verbosity = options->verbosity,
+        .trace = trace,
+        .count_cycles = options->count_cycles,
+        .control = {.max_instructions = options->max_instructions},
+    };
+    if (!output_init(&simulator.output, OUTPUT_MEMORY, NULL, RUN_OUTPUT_SIZE) || !memory_init(&simulator.memory)) {
+        *out = simulator.output;
+        trace_close(trace);
+        return false;
+    }
+
+    bool ok;
+    snapshot_t *start = NULL;
+    if (options->load_snapshot_path) {
+        start = snapshot_read(options->load_snapshot_path);
+        ok = start != NULL;
+        if (ok) {
+            snapshot_restore(&simulator, start);
+        }
+    } else {
+        ok = load_program(&simulator, binary_path, DEFAULT_LOAD_ADDRESS);
+    }
+    if (ok && options->profile) {
+        simulator.profile = profile_create(simulator.program_size);
+        ok = simulator.profile != NULL;
+    }
+    if (ok && options->save_snapshot_path) {
+        snapshot_t *snapshot = run_to_instruction(&simulator, 1, -1) ? snapshot_take(&simulator) : NULL;
+        ok = snapshot && snapshot_write(snapshot, options->save_snapshot_path);
+        snapshot_free(snapshot);
+    }
+    if (ok) {
+        run_engine(&simulator, options->engine);
+    }
+
+    profile_free(simulator.profile);
+    memory_free(&simulator.memory);
+    snapshot_free(start);
+    ok = trace_close(trace) && ok;
+    *out = simulator.output;
+    return ok;
+}
+
+// Renders a binary trace the way trace_format does
+static bool render_trace(const char *trace_path, output_sink_t *out) {
+    if (!output_init(out, OUTPUT_MEMORY, NULL, RUN_OUTPUT_SIZE)) {
+        return false;
+    }
+    FILE *trace_file = fopen(trace_path, "rb");
+    if (!trace_file) {
+        return false;
+    }
+    int result = format_trace(trace_file, out);
+    fclose(trace_file);
+    return result == 0;
+}
+
+// Compares two texts line by line, reporting each line that differs.
+// Returns the number of differences.
+static int compare_text(FILE *report, const char *expected, size_t expected_length,
+                        const char *actual, size_t actual_length) {
+    const char *expected_end = expected + expected_length;
+    const char *actual_end = actual + actual_length;
     int line_num = 1;
     int differences = 0;
-    
-    while (1) {
-        char *exp_result = fgets(expected_line, sizeof(expected_line), expected);
-        char *act_result = fgets(actual_line, sizeof(actual_line), actual);
-        
-        // Both files ended
-        if (!exp_result && !act_result) {
-            break;
-        }
-        
-        // One file ended before the other
-        if (!exp_result || !act_result) {
-            printf(RED "Files have different lengths at line %d\n" RESET, line_num);
+
+    while (expected < expected_end || actual < actual_end) {
+        // One text ended before the other
+        if (expected == expected_end || actual == actual_end) {
+            fprintf(report, RED "Outputs have different lengths at line %d\n" RESET, line_num);
             differences++;
             break;
         }
-        
+
+        const char *expected_newline = memchr(expected, '\n', expected_end - expected);
+        const char *actual_newline = memchr(actual, '\n', actual_end - actual);
+        int expected_line = (int)((expected_newline ? expected_newline + 1 : expected_end) - expected);
+        int actual_line = (int)((actual_newline ? actual_newline + 1 : actual_end) - actual);
+
         // Compare lines
-        if (strcmp(expected_line, actual_line) != 0) {
-            printf(RED "Difference at line %d:\n" RESET, line_num);
-            printf(RED "Expected: %s" RESET, expected_line);
-            printf(RED "Actual:   %s" RESET, actual_line);
+        if (expected_line != actual_line || memcmp(expected, actual, expected_line) != 0) {
+            fprintf(report, RED "Difference at line %d:\n" RESET, line_num);
+            fprintf(report, RED "Expected: %.*s" RESET, expected_line, expected);
+            fprintf(report, RED "Actual:   %.*s" RESET, actual_line, actual);
             differences++;
         }
-        
+
+        expected += expected_line;
+        actual += actual_line;
         line_num++;
     }
-    
-    fclose(expected);
-    fclose(actual);
-    
+
     return differences;
 }
 
-int test_listing(const char *listing_name) {
+static int compare_outputs(FILE *report, const output_sink_t *expected, const output_sink_t *actual) {
+    return compare_text(report, expected->buffer, expected->length, actual->buffer, actual->length);
+}
+
+// Runs every check on one listing and describes any failure in `report`.
+// Returns 0 when the listing passes.
+static int test_listing(const char *listing_name, FILE *report) {
     char binary_path[256];
     char expected_path[256];
     char actual_path[256];
-    char asm_path[256];
-    
+    char trace_path[256];
+    char snapshot_path[256];
+    char reassembled_path[256];
+    char variant_expected_path[256];
+
     // Construct file paths
-    snprintf(asm_path, sizeof(asm_path), "../listings/%s.asm", listing_name);
     snprintf(binary_path, sizeof(binary_path), "../listings/%s", listing_name);
     snprintf(expected_path, sizeof(expected_path), "test_%s.txt", listing_name);
-    snprintf(actual_path, sizeof(actual_path), "actual_%s.txt", listing_name);
-    
-    printf(BLUE "Testing %s..." RESET, listing_name);
-    
-    // Check if expected test file exists
-    if (access(expected_path, F_OK) != 0) {
-        printf(YELLOW " SKIP (no expected output file)\n" RESET);
+    snprintf(trace_path, sizeof(trace_path), "trace_%s.bin", listing_name);
+    snprintf(snapshot_path, sizeof(snapshot_path), "snapshot_%s.bin", listing_name);
+    snprintf(reassembled_path, sizeof(reassembled_path), "disasm_%s.bin", listing_name);
+
+    size_t expected_length;
+    char *expected = read_file(expected_path, &expected_length);
+    if (!expected) {
+        fprintf(report, RED " ERROR (could not read %s)\n" RESET, expected_path);
+        return 1;
+    }
+
+    int result = 1;
+    output_sink_t actual = {};
+    output_sink_t rendered = {};
+    output_sink_t interpreted = {};
+    output_sink_t threaded = {};
+    output_sink_t jit = {};
+    output_sink_t saved = {};
+    output_sink_t restored = {};
+    output_sink_t disassembly = {};
+    output_sink_t chunked = {};
+
+    // Full trace on the interpreter
+    if (!run_program(binary_path, &(run_options_t){}, &actual)) {
+        fprintf(report, RED " FAIL (simulator run failed)\n" RESET);
+        goto done;
+    }
+    int differences = compare_text(report, expected, expected_length, actual.buffer, actual.length);
+    if (differences > 0) {
+        fprintf(report, RED " FAIL (%d differences)\n" RESET, differences);
+        snprintf(actual_path, sizeof(actual_path), "actual_%s.txt", listing_name);
+        save_output(report, actual_path, &actual);
+        goto done;
+    }
+    output_free(&actual);
+
+    // The binary trace must render to exactly the same text
+    run_options_t traced = {.verbosity = VERBOSITY_SILENT, .trace_path = trace_path};
+    bool rendered_ok = run_program(binary_path, &traced, &actual) && render_trace(trace_path, &rendered);
+    unlink(trace_path);
+    if (!rendered_ok) {
+        fprintf(report, RED " FAIL (trace formatting failed)\n" RESET);
+        goto done;
+    }
+    if (compare_text(report, expected, expected_length, rendered.buffer, rendered.length) != 0) {
+        fprintf(report, RED " FAIL (binary trace differs)\n" RESET);
+        snprintf(actual_path, sizeof(actual_path), "actual_trace_%s.txt", listing_name);
+        save_output(report, actual_path, &rendered);
+        goto done;
+    }
+
+    // Translated code must leave the same final state as the interpreter
+    if (!run_program(binary_path, &(run_options_t){.verbosity = VERBOSITY_FINAL}, &interpreted) ||
+        !run_program(binary_path, &(run_options_t){.engine = ENGINE_JIT, .verbosity = VERBOSITY_FINAL}, &jit)) {
+        fprintf(report, RED " FAIL (JIT run failed)\n" RESET);
+        goto done;
+    }
+    if (compare_outputs(report, &interpreted, &jit) != 0) {
+        fprintf(report, RED " FAIL (JIT final state differs)\n" RESET);
+        snprintf(actual_path, sizeof(actual_path), "actual_jit_%s.txt", listing_name);
+        save_output(report, actual_path, &jit);
+        goto done;
+    }
+
+    // Saving a snapshot must not disturb the run, and a run started from
+    // the snapshot must end in the same state
+    run_options_t saving = {.verbosity = VERBOSITY_FINAL, .save_snapshot_path = snapshot_path};
+    run_options_t restoring = {.verbosity = VERBOSITY_FINAL, .load_snapshot_path = snapshot_path};
+    bool snapshot_ok = run_program(binary_path, &saving, &saved) && run_program(binary_path, &restoring, &restored);
+    unlink(snapshot_path);
+    if (!snapshot_ok) {
+        fprintf(report, RED " FAIL (snapshot run failed)\n" RESET);
+        goto done;
+    }
+    if (compare_outputs(report, &interpreted, &saved) != 0 || compare_outputs(report, &interpreted, &restored) != 0) {
+        fprintf(report, RED " FAIL (snapshot final state differs)\n" RESET);
+        snprintf(actual_path, sizeof(actual_path), "actual_saved_%s.txt", listing_name);
+        save_output(report, actual_path, &saved);
+        snprintf(actual_path, sizeof(actual_path), "actual_restored_%s.txt", listing_name);
+        save_output(report, actual_path, &restored);
+        goto done;
+    }
+    output_free(&interpreted);
+    output_free(&jit);
+
+    // Every engine must stop a limited run at the same instruction
+    run_options_t limited = {.verbosity = VERBOSITY_FINAL, .max_instructions = 2};
+    bool limited_ok = run_program(binary_path, &limited, &interpreted);
+    limited.engine = ENGINE_THREADED;
+    limited_ok = run_program(binary_path, &limited, &threaded) && limited_ok;
+    limited.engine = ENGINE_JIT;
+    limited_ok = run_program(binary_path, &limited, &jit) && limited_ok;
+    if (!limited_ok) {
+        fprintf(report, RED " FAIL (limited run failed)\n" RESET);
+        goto done;
+    }
+    if (compare_outputs(report, &interpreted, &threaded) != 0 || compare_outputs(report, &interpreted, &jit) != 0) {
+        fprintf(report, RED " FAIL (engines stop differently at an instruction limit)\n" RESET);
+        snprintf(actual_path, sizeof(actual_path), "actual_threaded_%s.txt", listing_name);
+        save_output(report, actual_path, &threaded);
+        snprintf(actual_path, sizeof(actual_path), "actual_jit_%s.txt", listing_name);
+        save_output(report, actual_path, &jit);
+        goto done;
+    }
+
+    // The disassembly, assembled again, must give back the original bytes
+    size_t original_length;
+    size_t reassembled_length;
+    char *original = read_file(binary_path, &original_length);
+    char *reassembled = read_file(reassembled_path, &reassembled_length);
+    bool same_bytes = original && reassembled && original_length == reassembled_length &&
+                      memcmp(original, reassembled, original_length) == 0;
+    free(original);
+    free(reassembled);
+    if (!same_bytes) {
+        fprintf(report, RED " FAIL (disassembly does not reassemble to the same bytes)\n" RESET);
+        fprintf(report, "Disassembly kept in: disasm_%s.asm\n", listing_name);
+        goto done;
+    }
+
+    // Split into chunks, which run_tests.sh makes small enough to cut every
+    // listing, the disassembly on several threads must read the same
+    bool disassembled = output_init(&disassembly, OUTPUT_MEMORY, NULL, RUN_OUTPUT_SIZE) &&
+                        output_init(&chunked, OUTPUT_MEMORY, NULL, RUN_OUTPUT_SIZE) &&
+                        disassemble_file(binary_path, 1, &disassembly) == 0 &&
+                        disassemble_file(binary_path, 4, &chunked) == 0;
+    if (!disassembled) {
+        fprintf(report, RED " FAIL (disassembly failed)\n" RESET);
+        goto done;
+    }
+    if (compare_outputs(report, &disassembly, &chunked) != 0) {
+        fprintf(report, RED " FAIL (disassembly on several threads differs)\n" RESET);
+        snprintf(actual_path, sizeof(actual_path), "actual_disasm_%s.asm", listing_name);
+        save_output(report, actual_path, &chunked);
+        goto done;
+    }
+
+    for (const test_variant_t *variant = test_variants; variant->suffix; variant++) {
+        snprintf(variant_expected_path, sizeof(variant_expected_path), "test_%s%s.txt", listing_name, variant->suffix);
+        size_t variant_length;
+        char *variant_expected = read_file(variant_expected_path, &variant_length);
+        if (!variant_expected) {
+            continue;
+        }
+        run_options_t options = {
+            .verbosity = variant->verbosity,
+            .count_cycles = variant->count_cycles,
+            .profile = variant->profile,
+        };
+        output_free(&actual);
+        if (!run_program(binary_path, &options, &actual)) {
+            fprintf(report, RED " FAIL (simulator run failed with %s)\n" RESET, variant->flags);
+            free(variant_expected);
+            goto done;
+        }
+        differences = compare_text(report, variant_expected, variant_length, actual.buffer, actual.length);
+        free(variant_expected);
+        if (differences != 0) {
+            fprintf(report, RED " FAIL (%d differences with %s)\n" RESET, differences, variant->flags);
+            snprintf(actual_path, sizeof(actual_path), "actual_%s%s.txt", listing_name, variant->suffix);
+            save_output(report, actual_path, &actual);
+            goto done;
+        }
+    }
+    result = 0;
+
+done:
+    free(expected);
+    output_free(&actual);
+    output_free(&rendered);
+    output_free(&interpreted);
+    output_free(&threaded);
+    output_free(&jit);
+    output_free(&saved);
+    output_free(&restored);
+    output_free(&disassembly);
+    output_free(&chunked);
+    return result;
+}
+
+// Takes the next untested listing until none are left
+static void *test_worker(void *arg) {
+    test_pool_t *pool = arg;
+    for (size_t i; (i = atomic_fetch_add(&pool->next_case, 1)) < pool->count;) {
+        test_case_t *test = &pool->cases[i];
+        if (test->skipped || test->failed) {
+            continue;
+        }
+        FILE *report = open_memstream(&test->report, &test->report_length);
+        if (!report) {
+            test->failed = true;
+            continue;
+        }
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        test->failed = test_listing(test->name, report) != 0;
+        test->milliseconds = elapsed_ms(&start);
+        fclose(report);
+    }
+    return NULL;
+}
+
+// A binary is current when it is at least as new as its source, or when
+// there is no source to rebuild it from
+static int binary_is_current(const char *asm_path, const char *binary_path) {
+    struct stat source;
+    struct stat binary;
+    if (stat(binary_path, &binary) != 0) {
+        return 0;
+    }
+    if (stat(asm_path, &source) != 0) {
+        return 1;
+    }
+    if (binary.st_mtim.tv_sec != source.st_mtim.tv_sec) {
+        return binary.st_mtim.tv_sec > source.st_mtim.tv_sec;
+    }
+    return binary.st_mtim.tv_nsec >= source.st_mtim.tv_nsec;
+}
+
+// Assembles a listing unless its cached binary is still current
+static int assemble_listing(const char *listing_name) {
+    char asm_path[256];
+    char binary_path[256];
+    snprintf(asm_path, sizeof(asm_path), "../listings/%s.asm", listing_name);
+    snprintf(binary_path, sizeof(binary_path), "../listings/%s", listing_name);
+    if (binary_is_current(asm_path, binary_path)) {
         return 0;
     }
-    
-    // Assemble the file
     char assemble_cmd[512];
     snprintf(assemble_cmd, sizeof(assemble_cmd), "nasm %s -o %s 2>/dev/null", asm_path, binary_path);
-    if (system(assemble_cmd) != 0) {
-        printf(RED " FAIL (assembly failed)\n" RESET);
+    return system(assemble_cmd) == 0 ? 0 : 1;
+}
+
+// Programs for instructions the listings never use, assembled by hand. The
+// runner writes each one to ../listings/<name>, where it is tested like any
+// listing with an expected output but no source.
+typedef struct {
+    const char *name;
+    const uint8_t *bytes;
+    size_t size;
+} program_t;
+
+// Every string instruction with and without repeat prefixes: forward and
+// backward, an overlapping copy, a count of zero, a segment override and a
+// store that wraps around the end of its segment
+static const uint8_t string_instructions[] = {
+    0xBF, 0x00, 0x10,       // mov di, 1000h
+    0xB9, 0x10, 0x00,       // mov cx, 16
+    0xB0, 0x41,             // mov al, 41h
+    0xF3, 0xAA,             // rep stosb
+    0xB8, 0x42, 0x43,       // mov ax, 4342h
+    0xB9, 0x04, 0x00,       // mov cx, 4
+    0xF3, 0xAB,             // rep stosw
+    0xBE, 0x00, 0x10,       // mov si, 1000h
+    0xBF, 0x00, 0x20,       // mov di, 2000h
+    0xB9, 0x18, 0x00,       // mov cx, 24
+    0xF3, 0xA4,             // rep movsb
+    0xBE, 0x10, 0x20,       // mov si, 2010h
+    0xBF, 0x11, 0x20,       // mov di, 2011h
+    0xB9, 0x06, 0x00,       // mov cx, 6
+    0xF3, 0xA4,             // rep movsb
+    0xBE, 0x00, 0x10,       // mov si, 1000h
+    0xBF, 0x00, 0x20,       // mov di, 2000h
+    0xB9, 0x18, 0x00,       // mov cx, 24
+    0xF3, 0xA6,             // repz cmpsb
+    0xBF, 0x00, 0x20,       // mov di, 2000h
+    0xB9, 0x20, 0x00,       // mov cx, 32
+    0xB0, 0x43,             // mov al, 43h
+    0xF2, 0xAE,             // repnz scasb
+    0xB8, 0x41, 0x41,       // mov ax, 4141h
+    0xBF, 0x00, 0x10,       // mov di, 1000h
+    0xB9, 0x0A, 0x00,       // mov cx, 10
+    0xF3, 0xAF,             // repz scasw
+    0xBE, 0x10, 0x10,       // mov si, 1010h
+    0xAD,                   // lodsw
+    0xFD,                   // std
+    0xBE, 0x16, 0x10,       // mov si, 1016h
+    0xBF, 0x06, 0x30,       // mov di, 3006h
+    0xB9, 0x03, 0x00,       // mov cx, 3
+    0xF3, 0xA5,             // rep movsw
+    0xFC,                   // cld
+    0xB9, 0x00, 0x00,       // mov cx, 0
+    0xF3, 0xAA,             // rep stosb
+    0xBE, 0x00, 0x00,       // mov si, 0
+    0x2E, 0xAC,             // cs lodsb
+    0xB8, 0x00, 0x02,       // mov ax, 200h
+    0x8E, 0xC0,             // mov es, ax
+    0xBE, 0x00, 0x10,       // mov si, 1000h
+    0xBF, 0x00, 0x10,       // mov di, 1000h
+    0xA5,                   // movsw
+    0xB8, 0x61, 0x62,       // mov ax, 6261h
+    0xBF, 0xFF, 0xFF,       // mov di, 0FFFFh
+    0xB9, 0x02, 0x00,       // mov cx, 2
+    0xF3, 0xAB,             // rep stosw
+};
+
+// Near calls and returns, direct, through a register and through memory,
+// with a frame that takes its arguments off the stack on return, recursion
+// and a routine that returns past the instruction after its call. Around
+// them, pushes and pops of registers, segment registers, memory, sp itself
+// and the flags.
+static const uint8_t stack_instructions[] = {
+    0xE3, 0x1E,             // jcxz main
+                            // sum2:
+    0x55,                   // push bp
+    0x89, 0xE5,             // mov bp, sp
+    0x8B, 0x46, 0x04,       // mov ax, [bp+4]
+    0x03, 0x46, 0x06,       // add ax, [bp+6]
+    0x5D,                   // pop bp
+    0xC2, 0x04, 0x00,       // ret 4
+                            // sumdown:
+    0x01, 0xC8,             // add ax, cx
+    0x83, 0xE9, 0x01,       // sub cx, 1
+    0x74, 0x03,             // jz .done
+    0xE8, 0xF6, 0xFF,       // call sumdown
+    0xC3,                   // .done: ret
+                            // skip:
+    0x5B,                   // pop bx
+    0x83, 0xC3, 0x03,       // add bx, 3
+    0x53,                   // push bx
+    0xC3,                   // ret
+                            // main:
+    0xB8, 0x00, 0x02,       // mov ax, 200h
+    0x8E, 0xD0,             // mov ss, ax
+    0xBC, 0x00, 0x01,       // mov sp, 100h
+    0xB8, 0x00, 0x03,       // mov ax, 300h
+    0x8E, 0xC0,             // mov es, ax
+    0x06,                   // push es
+    0x1F,                   // pop ds
+    0xBB, 0x34, 0x12,       // mov bx, 1234h
+    0xBA, 0x78, 0x56,       // mov dx, 5678h
+    0x53,                   // push bx
+    0x52,                   // push dx
+    0x5B,                   // pop bx
+    0x5A,                   // pop dx
+    0xBE, 0xEF, 0xBE,       // mov si, 0BEEFh
+    0x89, 0x36, 0x00, 0x10, // mov [1000h], si
+    0xFF, 0x36, 0x00, 0x10, // push word [1000h]
+    0x8F, 0x06, 0x02, 0x10, // pop word [1002h]
+    0x54,                   // push sp
+    0x58,                   // pop ax
+    0xB9, 0x05, 0x00,       // mov cx, 5
+    0x83, 0xF9, 0x07,       // cmp cx, 7
+    0x9C,                   // pushf
+    0x39, 0xC9,             // cmp cx, cx
+    0x9D,                   // popf
+    0x52,                   // push dx
+    0x53,                   // push bx
+    0xE8, 0xA9, 0xFF,       // call sum2
+    0xB8, 0x00, 0x00,       // mov ax, 0
+    0xB9, 0x04, 0x00,       // mov cx, 4
+    0xE8, 0xAD, 0xFF,       // call sumdown
+    0xB9, 0x03, 0x00,       // mov cx, 3
+    0xBF, 0x0F, 0x00,       // mov di, sumdown
+    0xFF, 0xD7,             // call di
+    0x89, 0x3E, 0x04, 0x10, // mov [1004h], di
+    0xB9, 0x02, 0x00,       // mov cx, 2
+    0xFF, 0x16, 0x04, 0x10, // call word [1004h]
+    0xE8, 0xA2, 0xFF,       // call skip
+    0xB8, 0x01, 0x00,       // mov ax, 1
+    0xBA, 0x02, 0x00,       // mov dx, 2
+};
+
+static const program_t programs[] = {
+    {"string_instructions", string_instructions, sizeof(string_instructions)},
+    {"stack_instructions", stack_instructions, sizeof(stack_instructions)},
+};
+
+static bool write_programs(void) {
+    for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+        char binary_path[256];
+        snprintf(binary_path, sizeof(binary_path), "../listings/%s", programs[i].name);
+        output_sink_t bytes = {.buffer = (char *)programs[i].bytes, .length = programs[i].size};
+        if (!write_if_changed(binary_path, &bytes)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Disassembles a listing's binary and assembles the result again. The source
+// is only rewritten when the disassembly changed, so nasm only runs when
+// either the listing or the disassembler did.
+static int reassemble_listing(const char *listing_name) {
+    char binary_path[256];
+    char asm_path[256];
+    char reassembled_path[256];
+    snprintf(binary_path, sizeof(binary_path), "../listings/%s", listing_name);
+    snprintf(asm_path, sizeof(asm_path), "disasm_%s.asm", listing_name);
+    snprintf(reassembled_path, sizeof(reassembled_path), "disasm_%s.bin", listing_name);
+
+    output_sink_t out = {};
+    bool ok = output_init(&out, OUTPUT_MEMORY, NULL, RUN_OUTPUT_SIZE) &&
+              disassemble_file(binary_path, 1, &out) == 0 &&
+              write_if_changed(asm_path, &out);
+    output_free(&out);
+    if (!ok) {
+        return 1;
+    }
+    if (binary_is_current(asm_path, reassembled_path)) {
+        return 0;
+    }
+    char assemble_cmd[512];
+    snprintf(assemble_cmd, sizeof(assemble_cmd), "nasm %s -o %s 2>/dev/null", asm_path, reassembled_path);
+    return system(assemble_cmd) == 0 ? 0 : 1;
+}
+
+// Runs every listing at once through the library, one instance per thread.
+// test_library is built next to this runner by run_tests.sh.
+int test_library_concurrently(const char *test_cases[]) {
+    char command[4096];
+    int used = snprintf(command, sizeof(command), "./test_library");
+    int count = 0;
+    for (int i = 0; test_cases[i] != NULL; i++, count++) {
+        used += snprintf(command + used, sizeof(command) - used, " ../listings/%s test_%s.txt",
+                         test_cases[i], test_cases[i]);
+    }
+
+    printf(BLUE "Testing library on %d threads..." RESET, count);
+    fflush(stdout);
+    if (access("test_library", X_OK) != 0) {
+        printf(RED " FAIL (test_library is not built)\n" RESET);
         return 1;
     }
-    
-    // Run simulator
-    if (run_simulator_on_file(binary_path, actual_path) != 0) {
-        printf(RED " FAIL (simulator crashed)\n" RESET);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (system(command) != 0) {
+        printf(RED " FAIL\n" RESET);
         return 1;
     }
-    
-    // Compare output
-    int differences = compare_files(expected_path, actual_path);
-    if (differences < 0) {
-        printf(RED " ERROR (file comparison failed)\n" RESET);
+    printf(GREEN " PASS" RESET " (%.1f ms)\n", elapsed_ms(&start));
+    return 0;
+}
+
+// Runs every listing through the batch runner and checks each program's
+// output file against its expected output, and the batch's result against
+// whether any expected output ends on an unhandled instruction
+int test_batch(const char *test_cases[]) {
+    int count = 0;
+    while (test_cases[count] != NULL) {
+        count++;
+    }
+    char paths[count][256];
+    char *inputs[count];
+    for (int i = 0; i < count; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "../listings/%s", test_cases[i]);
+        inputs[i] = paths[i];
+    }
+
+    printf(BLUE "Testing batch runner on %d programs..." RESET, count);
+    fflush(stdout);
+    char output_dir[] = "/tmp/sim8086_batch_XXXXXX";
+    if (!mkdtemp(output_dir)) {
+        printf(RED " FAIL (could not create an output directory)\n" RESET);
         return 1;
-    } else if (differences == 0) {
-        printf(GREEN " PASS\n" RESET);
-        // Clean up actual output file on success
+    }
+    batch_options_t options = {
+        .engine = ENGINE_INTERPRETER,
+        .verbosity = VERBOSITY_TRACE,
+        .load_address = DEFAULT_LOAD_ADDRESS,
+        .workers = 4,
+        .output_dir = output_dir,
+    };
+
+    // Listings that end on an unhandled instruction are failed programs,
+    // which the batch reports on stderr; keep that out of the test output
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fflush(stderr);
+    int saved_stderr = dup(STDERR_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+    }
+    int result = run_batch(&options, inputs, count);
+    fflush(stderr);
+    if (saved_stderr >= 0) {
+        dup2(saved_stderr, STDERR_FILENO);
+        close(saved_stderr);
+    }
+
+    char expected_path[256];
+    char actual_path[256];
+    int expected_result = 0;
+    for (int i = 0; i < count; i++) {
+        snprintf(expected_path, sizeof(expected_path), "test_%s.txt", test_cases[i]);
+        snprintf(actual_path, sizeof(actual_path), "%s/%s.txt", output_dir, test_cases[i]);
+        size_t expected_length;
+        size_t actual_length;
+        char *expected = read_file(expected_path, &expected_length);
+        char *actual = read_file(actual_path, &actual_length);
+        int differences = expected && actual
+                          ? compare_text(stdout, expected, expected_length, actual, actual_length)
+                          : -1;
+        if (expected && contains_text(expected, expected_length, "UNHANDLED")) {
+            expected_result = 1;
+        }
+        free(expected);
+        free(actual);
+        if (differences != 0) {
+            printf(RED " FAIL (%s differs)\n" RESET, test_cases[i]);
+            printf("Batch outputs saved in: %s\n", output_dir);
+            return 1;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        snprintf(actual_path, sizeof(actual_path), "%s/%s.txt", output_dir, test_cases[i]);
         unlink(actual_path);
-        return 0;
-    } else {
-        printf(RED " FAIL (%d differences)\n" RESET, differences);
-        printf("Actual output saved to: %s\n", actual_path);
+    }
+    rmdir(output_dir);
+    if (result != expected_result) {
+        printf(RED " FAIL (batch returned %d, expected %d)\n" RESET, result, expected_result);
         return 1;
     }
+    printf(GREEN " PASS" RESET " (%.1f ms)\n", elapsed_ms(&start));
+    return 0;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
     printf(BLUE "8086 Simulator Test Suite\n" RESET);
     printf("========================\n\n");
-    
+
     // List of test cases (excluding listing_54 as requested)
-    const char *test_cases[] = {
+    const char *all_test_cases[] = {
         "listing_37",
         "listing_38",
         "listing_39",
@@ -140,40 +794,125 @@ int main() {
         "listing_49",
         "listing_51",
         "listing_52",
+        "string_instructions",
+        "stack_instructions",
         NULL
     };
-    
+
+    // Listings named on the command line replace the full list
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *selected[argc];
+    int selected_count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            workers = atol(argv[++i]);
+        } else {
+            selected[selected_count++] = argv[i];
+        }
+    }
+    selected[selected_count] = NULL;
+    const char **test_cases = selected_count ? selected : all_test_cases;
+
     int total_tests = 0;
     int passed_tests = 0;
     int failed_tests = 0;
-    
+
     // We're already in the tests directory when run from run_tests.sh
-    
-    // Compile simulator first
-    printf(YELLOW "Compiling simulator...\n" RESET);
-    if (system("cd ../src && gcc simulator.c main.c -o simulator") != 0) {
-        printf(RED "Error: Failed to compile simulator\n" RESET);
+    struct timespec suite_start;
+    clock_gettime(CLOCK_MONOTONIC, &suite_start);
+
+    size_t case_count = 0;
+    while (test_cases[case_count] != NULL) {
+        case_count++;
+    }
+    test_pool_t pool = {.cases = calloc(case_count + 1, sizeof(test_case_t)), .count = case_count};
+    if (!pool.cases) {
+        printf(RED "Error: Could not allocate %zu test cases\n" RESET, case_count);
+        return 1;
+    }
+
+    if (!write_programs()) {
+        printf(RED "Error: Could not write the hand-assembled programs to ../listings\n" RESET);
         return 1;
     }
-    printf(GREEN "Simulator compiled successfully\n\n" RESET);
-    
+
+    // Assembling is the only step that starts a process, and only for
+    // listings or disassemblies whose source changed since their binary was
+    // built
+    for (size_t i = 0; i < case_count; i++) {
+        test_case_t *test = &pool.cases[i];
+        test->name = test_cases[i];
+        char expected_path[256];
+        snprintf(expected_path, sizeof(expected_path), "test_%s.txt", test->name);
+        if (access(expected_path, F_OK) != 0) {
+            test->skipped = true;
+        } else if (assemble_listing(test->name) != 0) {
+            test->failed = true;
+            test->report = strdup(RED " FAIL (assembly failed)\n" RESET);
+        } else if (reassemble_listing(test->name) != 0) {
+            test->failed = true;
+            test->report = strdup(RED " FAIL (disassembly did not assemble)\n" RESET);
+        }
+    }
+
     // Run tests
-    for (int i = 0; test_cases[i] != NULL; i++) {
+    if (workers < 1) {
+        workers = 1;
+    }
+    if ((size_t)workers > case_count) {
+        workers = case_count > 0 ? (long)case_count : 1;
+    }
+    pthread_t threads[workers];
+    long started = 0;
+    while (started < workers && pthread_create(&threads[started], NULL, test_worker, &pool) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        test_worker(&pool);
+    }
+    for (long i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (size_t i = 0; i < case_count; i++) {
+        test_case_t *test = &pool.cases[i];
         total_tests++;
-        if (test_listing(test_cases[i]) == 0) {
+        printf(BLUE "Testing %s..." RESET, test->name);
+        if (test->skipped) {
+            printf(YELLOW " SKIP (no expected output file)\n" RESET);
             passed_tests++;
-        } else {
+        } else if (test->failed) {
+            printf("%s", test->report ? test->report : RED " FAIL\n" RESET);
             failed_tests++;
+        } else {
+            printf(GREEN " PASS" RESET " (%.1f ms)\n", test->milliseconds);
+            passed_tests++;
         }
+        free(test->report);
     }
-    
+    free(pool.cases);
+
+    total_tests++;
+    if (test_library_concurrently(test_cases) == 0) {
+        passed_tests++;
+    } else {
+        failed_tests++;
+    }
+    total_tests++;
+    if (test_batch(test_cases) == 0) {
+        passed_tests++;
+    } else {
+        failed_tests++;
+    }
+
     // Summary
     printf("\n" BLUE "Test Summary\n" RESET);
     printf("============\n");
     printf("Total tests: %d\n", total_tests);
     printf(GREEN "Passed: %d\n" RESET, passed_tests);
     printf(RED "Failed: %d\n" RESET, failed_tests);
-    
+    printf("Time: %.1f ms on %ld threads\n", elapsed_ms(&suite_start), workers);
+
     if (failed_tests == 0) {
         printf("\n" GREEN "🎉 All tests passed!\n" RESET);
         return 0;